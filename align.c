@@ -0,0 +1,438 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "align.h"
+#include "budget.h"
+#include "raw.h"
+#include "role.h"
+
+//Histogram of the binned values, 4 samples of 10 bits
+#define ALIGN_BINS 4096
+
+typedef struct {
+  //Size of the level being processed
+  int width;
+  int height;
+  const unsigned short* pixels;
+  unsigned short* grey;
+  align_bitmaps_t* bitmaps;
+  int level;
+  int median;
+  //align_shift: integer offset in sensor pixels, distance to the second
+  //neighbour (0 if its weight is 0) and bilinear weights
+  int ox;
+  int oy;
+  int step_x;
+  int step_y;
+  float weights[4];
+  //Frame rows held by pixels and the first one of out
+  int src_top;
+  int src_rows;
+  int out_top;
+  unsigned short* out;
+} align_job_t;
+
+typedef void (*align_pass_t) (align_job_t* job, int top, int bottom);
+
+typedef struct {
+  align_job_t* job;
+  align_pass_t pass;
+  int top;
+  int bottom;
+} align_band_t;
+
+static void* align_band_main (void* arg){
+  align_band_t* band = arg;
+  band->pass (band->job, band->top, band->bottom);
+  return NULL;
+}
+
+//Runs a pass over rows [0, rows) split in bands, the calling thread takes
+//the first one
+static void align_parallel (
+			    align_job_t* job,
+			    align_pass_t pass,
+			    int rows,
+			    int threads){
+  align_band_t bands[ALIGN_MAX_THREADS];
+  pthread_t ids[ALIGN_MAX_THREADS];
+  int band_rows = (rows + threads - 1)/threads;
+  int i;
+  for (i=0; i<threads; i++){
+    bands[i].job = job;
+    bands[i].pass = pass;
+    bands[i].top = i*band_rows < rows ? i*band_rows : rows;
+    bands[i].bottom = (i + 1)*band_rows < rows ? (i + 1)*band_rows : rows;
+  }
+  for (i=1; i<threads; i++){
+    if (role_spawn (&ids[i], ROLE_POOL, align_band_main, &bands[i])){
+      fprintf (stderr, "error: align: pthread_create\n");
+      exit (1);
+    }
+  }
+  align_band_main (&bands[0]);
+  for (i=1; i<threads; i++) pthread_join (ids[i], NULL);
+}
+
+static void* align_alloc (size_t size){
+  void* p = budget_calloc (BUDGET_ALIGN, size, 1);
+  if (!p){
+    fprintf (stderr, "error: align: out of memory\n");
+    exit (1);
+  }
+  return p;
+}
+
+void align_init (align_t* align, int width, int height, int threads){
+  int levels = 0, w = width/2, h = height/2;
+  int i;
+  memset (align, 0, sizeof (*align));
+  align->width = width;
+  align->height = height;
+  align->threads = threads < 1 ? 1 :
+    threads > ALIGN_MAX_THREADS ? ALIGN_MAX_THREADS : threads;
+  while (levels < ALIGN_LEVELS && w >= ALIGN_MIN_SIZE && h >= ALIGN_MIN_SIZE){
+    align->grey[levels] = align_alloc (sizeof (unsigned short)*w*h);
+    for (i=0; i<3; i++){
+      align_bitmaps_t* b = &align->frames[i];
+      b->widths[levels] = w;
+      b->heights[levels] = h;
+      b->words[levels] = (w + 63)/64;
+      b->bits[levels] = align_alloc (sizeof (uint64_t)*b->words[levels]*h);
+      b->mask[levels] = align_alloc (sizeof (uint64_t)*b->words[levels]*h);
+    }
+    levels++;
+    w /= 2;
+    h /= 2;
+  }
+  if (!levels){
+    fprintf (stderr, "error: align: %ix%i is too small\n", width, height);
+    exit (1);
+  }
+  for (i=0; i<3; i++) align->frames[i].levels = levels;
+}
+
+void align_free (align_t* align){
+  int i, l;
+  for (l=0; l<align->frames[0].levels; l++){
+    budget_free (align->grey[l]);
+    for (i=0; i<3; i++){
+      budget_free (align->frames[i].bits[l]);
+      budget_free (align->frames[i].mask[l]);
+    }
+  }
+}
+
+//Sum of each 2x2 Bayer block, one of every colour
+static void align_bin (align_job_t* job, int top, int bottom){
+  int stride = 2*job->width;
+  int x, y;
+  for (y=top; y<bottom; y++){
+    const unsigned short* p = job->pixels + (size_t)2*y*stride;
+    const unsigned short* q = p + stride;
+    unsigned short* out = job->grey + (size_t)y*job->width;
+    for (x=0; x<job->width; x++){
+      out[x] = p[2*x] + p[2*x + 1] + q[2*x] + q[2*x + 1];
+    }
+  }
+}
+
+static void align_threshold (align_job_t* job, int top, int bottom){
+  align_bitmaps_t* b = job->bitmaps;
+  int words = b->words[job->level];
+  int median = job->median;
+  int x, y;
+  for (y=top; y<bottom; y++){
+    const unsigned short* in = job->grey + (size_t)y*job->width;
+    uint64_t* bits = b->bits[job->level] + (size_t)y*words;
+    uint64_t* mask = b->mask[job->level] + (size_t)y*words;
+    memset (bits, 0, sizeof (uint64_t)*words);
+    memset (mask, 0, sizeof (uint64_t)*words);
+    for (x=0; x<job->width; x++){
+      int v = in[x];
+      uint64_t bit = (uint64_t)1 << (x & 63);
+      if (v > median) bits[x >> 6] |= bit;
+      if (v > median + ALIGN_EXCLUDE || v < median - ALIGN_EXCLUDE){
+	mask[x >> 6] |= bit;
+      }
+    }
+  }
+}
+
+static int align_median (const unsigned short* grey, size_t n){
+  unsigned histogram[ALIGN_BINS] = { 0 };
+  size_t i, count = 0;
+  int v;
+  for (i=0; i<n; i++) histogram[grey[i] < ALIGN_BINS ? grey[i] : ALIGN_BINS - 1]++;
+  for (v=0; v<ALIGN_BINS; v++){
+    count += histogram[v];
+    if (2*count >= n) return v;
+  }
+  return ALIGN_BINS - 1;
+}
+
+//Halves a level, odd rows and columns at the end are dropped
+static void align_downsample (
+			      const unsigned short* in,
+			      int width,
+			      unsigned short* out,
+			      int out_width,
+			      int out_height){
+  int x, y;
+  for (y=0; y<out_height; y++){
+    const unsigned short* p = in + (size_t)2*y*width;
+    const unsigned short* q = p + width;
+    for (x=0; x<out_width; x++){
+      out[(size_t)y*out_width + x] =
+	(p[2*x] + p[2*x + 1] + q[2*x] + q[2*x + 1] + 2)/4;
+    }
+  }
+}
+
+//Builds the bitmaps of all levels, returns the fraction of usable pixels of
+//the finest one
+static double align_bitmaps (
+			     align_t* align,
+			     const unsigned short* pixels,
+			     align_bitmaps_t* b){
+  align_job_t job;
+  int l;
+  memset (&job, 0, sizeof (job));
+  job.pixels = pixels;
+  job.bitmaps = b;
+  for (l=0; l<b->levels; l++){
+    job.width = b->widths[l];
+    job.height = b->heights[l];
+    job.grey = align->grey[l];
+    job.level = l;
+    if (l){
+      align_downsample (align->grey[l - 1], b->widths[l - 1], job.grey,
+			job.width, job.height);
+    } else {
+      align_parallel (&job, align_bin, job.height, align->threads);
+    }
+    job.median = align_median (job.grey, (size_t)job.width*job.height);
+    if (l){
+      align_threshold (&job, 0, job.height);
+    } else {
+      align_parallel (&job, align_threshold, job.height, align->threads);
+    }
+  }
+
+  size_t i, usable = 0, n = (size_t)b->words[0]*b->heights[0];
+  for (i=0; i<n; i++) usable += __builtin_popcountll (b->mask[0][i]);
+  return (double)usable/((size_t)b->widths[0]*b->heights[0]);
+}
+
+//Bits [bit, bit + 64) of a row, 0 outside of it
+static inline uint64_t align_bits (const uint64_t* row, int words, int bit){
+  int w = bit >> 6, s = bit & 63;
+  uint64_t lo = w >= 0 && w < words ? row[w] : 0;
+  uint64_t hi = w + 1 >= 0 && w + 1 < words ? row[w + 1] : 0;
+  return s ? (lo >> s) | (hi << (64 - s)) : lo;
+}
+
+//Pixels that differ between ref (x, y) and cur (x + sx, y + sy), where both
+//are usable
+static uint64_t align_error (
+			     const align_bitmaps_t* ref,
+			     const align_bitmaps_t* cur,
+			     int level,
+			     int sx,
+			     int sy){
+  int words = ref->words[level], height = ref->heights[level];
+  uint64_t error = 0;
+  int x, y;
+  for (y=0; y<height; y++){
+    int cy = y + sy;
+    if (cy < 0 || cy >= height) continue;
+    const uint64_t* rb = ref->bits[level] + (size_t)y*words;
+    const uint64_t* rm = ref->mask[level] + (size_t)y*words;
+    const uint64_t* cb = cur->bits[level] + (size_t)cy*words;
+    const uint64_t* cm = cur->mask[level] + (size_t)cy*words;
+    for (x=0; x<words; x++){
+      int bit = 64*x + sx;
+      error += __builtin_popcountll ((rb[x] ^ align_bits (cb, words, bit)) &
+				     rm[x] & align_bits (cm, words, bit));
+    }
+  }
+  return error;
+}
+
+//Sub pixel position of the minimum from the errors at -1, 0 and 1. The
+//number of differing bits grows about linearly with the distance, so a V with
+//equal slopes is fitted rather than a parabola
+static float align_vertex (uint64_t a, uint64_t b, uint64_t c){
+  double slope = (double)(a > c ? a : c) - b;
+  if (slope <= 0) return 0;
+  double vertex = ((double)a - c)/(2*slope);
+  return vertex < -0.5 ? -0.5 : vertex > 0.5 ? 0.5 : vertex;
+}
+
+//Offset of cur to ref in sensor pixels. The shift found on a level is
+//doubled and refined by one pixel on the next, the finest level adds a sub
+//pixel part from the errors around the minimum
+static void align_search (
+			  const align_bitmaps_t* ref,
+			  const align_bitmaps_t* cur,
+			  float* dx,
+			  float* dy){
+  uint64_t errors[3][3];
+  int sx = 0, sy = 0;
+  int l, i, j;
+  for (l=ref->levels - 1; l>=0; l--){
+    int bx = 2*sx, by = 2*sy;
+    uint64_t best = UINT64_MAX;
+    for (j=-1; j<=1; j++){
+      for (i=-1; i<=1; i++){
+	uint64_t error = align_error (ref, cur, l, 2*sx + i, 2*sy + j);
+	if (error < best){
+	  best = error;
+	  bx = 2*sx + i;
+	  by = 2*sy + j;
+	}
+      }
+    }
+    sx = bx;
+    sy = by;
+  }
+  for (j=-1; j<=1; j++){
+    for (i=-1; i<=1; i++){
+      errors[j + 1][i + 1] = align_error (ref, cur, 0, sx + i, sy + j);
+    }
+  }
+  //One binned pixel is two sensor pixels
+  *dx = 2*(sx + align_vertex (errors[1][0], errors[1][1], errors[1][2]));
+  *dy = 2*(sy + align_vertex (errors[0][1], errors[1][1], errors[2][1]));
+}
+
+//Estimates the offset (dx, dy) of a frame to the series, so that
+//pixels (x + dx, y + dy) shows what the first usable frame has at (x, y).
+//Returns 0 if the frame has too little structure, it then gets the offset of
+//the last usable frame
+int align_frame (
+		 align_t* align,
+		 const unsigned short* pixels,
+		 int exposure,
+		 float* dx,
+		 float* dy){
+  align_bitmaps_t* cur = align->frames;
+  while (cur == align->anchor || cur == align->last) cur++;
+
+  double usable = align_bitmaps (align, pixels, cur);
+  cur->exposure = exposure;
+  if (usable < ALIGN_MIN_USABLE){
+    *dx = align->last ? align->last->dx : 0;
+    *dy = align->last ? align->last->dy : 0;
+    return 0;
+  }
+  if (!align->anchor){
+    cur->dx = cur->dy = 0;
+    align->anchor = align->last = cur;
+  } else {
+    //Compare with the usable frame closest in exposure
+    align_bitmaps_t* ref = align->last;
+    if (fabs (log ((double)exposure/align->anchor->exposure)) <=
+	fabs (log ((double)exposure/align->last->exposure))){
+      ref = align->anchor;
+    }
+    float sx, sy;
+    align_search (ref, cur, &sx, &sy);
+    cur->dx = ref->dx + sx;
+    cur->dy = ref->dy + sy;
+    align->last = cur;
+  }
+  *dx = cur->dx;
+  *dy = cur->dy;
+  return 1;
+}
+
+static void align_resample (align_job_t* job, int top, int bottom){
+  int width = job->width;
+  float w00 = job->weights[0], w01 = job->weights[1];
+  float w10 = job->weights[2], w11 = job->weights[3];
+  int x, y;
+  for (y=top; y<bottom; y++){
+    unsigned short* out = job->out + (size_t)y*width;
+    int y0 = job->out_top + y + job->oy, y1 = y0 + job->step_y;
+    if (y0 < job->src_top || y1 >= job->src_top + job->src_rows){
+      memset (out, 0, sizeof (unsigned short)*width);
+      continue;
+    }
+    const unsigned short* p = job->pixels + (size_t)(y0 - job->src_top)*width;
+    const unsigned short* q = job->pixels + (size_t)(y1 - job->src_top)*width;
+    for (x=0; x<width; x++){
+      int x0 = x + job->ox, x1 = x0 + job->step_x;
+      if (x0 < 0 || x1 >= width){
+	out[x] = 0;
+	continue;
+      }
+      //A clipped neighbour keeps the result clipped, so the merge skips it
+      if ((w00 > 0 && p[x0] >= RAW_WHITE_LEVEL) ||
+	  (w01 > 0 && p[x1] >= RAW_WHITE_LEVEL) ||
+	  (w10 > 0 && q[x0] >= RAW_WHITE_LEVEL) ||
+	  (w11 > 0 && q[x1] >= RAW_WHITE_LEVEL)){
+	out[x] = RAW_WHITE_LEVEL;
+	continue;
+      }
+      out[x] = w00*p[x0] + w01*p[x1] + w10*q[x0] + w11*q[x1] + 0.5f;
+    }
+  }
+}
+
+//Like align_shift for a band of the frame: pixels holds frame rows
+//[top, top + rows), out receives rows [out_top, out_top + out_rows). Samples
+//needed from outside of pixels are treated as outside of the frame
+void align_shift_rows (
+		       const align_t* align,
+		       const unsigned short* pixels,
+		       int top,
+		       int rows,
+		       float dx,
+		       float dy,
+		       unsigned short* out,
+		       int out_top,
+		       int out_rows){
+  align_job_t job;
+  float px = floorf (dx/2), py = floorf (dy/2);
+  float fx = dx/2 - px, fy = dy/2 - py;
+  memset (&job, 0, sizeof (job));
+  job.width = align->width;
+  job.height = align->height;
+  job.pixels = pixels;
+  job.src_top = top;
+  job.src_rows = rows;
+  job.out = out;
+  job.out_top = out_top;
+  job.ox = 2*(int)px;
+  job.oy = 2*(int)py;
+  job.step_x = fx > 0 ? 2 : 0;
+  job.step_y = fy > 0 ? 2 : 0;
+  job.weights[0] = (1 - fx)*(1 - fy);
+  job.weights[1] = fx*(1 - fy);
+  job.weights[2] = (1 - fx)*fy;
+  job.weights[3] = fx*fy;
+  align_parallel (&job, align_resample, out_rows, align->threads);
+}
+
+//Rows (or columns) a band has to be widened by on each side to be shifted by d
+int align_margin (float d){
+  return 2*(int)ceilf (fabsf (d)/2) + 2;
+}
+
+//out (x, y) = pixels (x + dx, y + dy), interpolated between the samples of
+//the same colour, which are 2 pixels apart. The shift is the same for the
+//whole frame, so are the weights. Pixels shifted in from outside are 0 and
+//ignored by the merge
+void align_shift (
+		  const align_t* align,
+		  const unsigned short* pixels,
+		  float dx,
+		  float dy,
+		  unsigned short* out){
+  align_shift_rows (align, pixels, 0, align->height, dx, dy, out, 0,
+		    align->height);
+}
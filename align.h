@@ -0,0 +1,78 @@
+#ifndef ALIGN_H
+#define ALIGN_H
+
+#include <stdint.h>
+
+//Pyramid levels of the bitmaps, the search reaches 2^ALIGN_LEVELS - 1 binned
+//pixels (twice as many sensor pixels) in every direction
+#define ALIGN_LEVELS 5
+//Levels stop when the smaller side gets below this
+#define ALIGN_MIN_SIZE 16
+//Binned values this close to the median are noise and left out of the
+//comparison (the sum of a 2x2 block, so 4 times the 10 bit scale)
+#define ALIGN_EXCLUDE 16
+//A frame with fewer usable pixels is not aligned, it gets the offset of the
+//frame before
+#define ALIGN_MIN_USABLE 0.02
+#define ALIGN_MAX_THREADS 16
+
+//Median threshold and exclusion bitmaps of one frame, one bit per binned
+//pixel, LSB first
+typedef struct {
+  int levels;
+  int widths[ALIGN_LEVELS];
+  int heights[ALIGN_LEVELS];
+  int words[ALIGN_LEVELS];
+  uint64_t* bits[ALIGN_LEVELS];
+  uint64_t* mask[ALIGN_LEVELS];
+  int exposure;
+  //Offset of the frame to the series in sensor pixels
+  float dx;
+  float dy;
+} align_bitmaps_t;
+
+//Translation of the frames of a series (median threshold bitmaps, Ward 2003).
+//The Bayer blocks are binned to luminance, which makes the comparison
+//independent of the CFA. A frame is compared with the anchor (the first
+//usable frame) or with the last usable one, whichever is closer in exposure,
+//and its offset is added to the one of that frame. The bitmaps of those two
+//are all that is kept
+typedef struct {
+  //Raw frame size, even
+  int width;
+  int height;
+  int threads;
+  //Binned luminance, all levels
+  unsigned short* grey[ALIGN_LEVELS];
+  align_bitmaps_t frames[3];
+  align_bitmaps_t* anchor;
+  align_bitmaps_t* last;
+} align_t;
+
+void align_init (align_t* align, int width, int height, int threads);
+void align_free (align_t* align);
+int align_frame (
+		 align_t* align,
+		 const unsigned short* pixels,
+		 int exposure,
+		 float* dx,
+		 float* dy);
+void align_shift (
+		  const align_t* align,
+		  const unsigned short* pixels,
+		  float dx,
+		  float dy,
+		  unsigned short* out);
+void align_shift_rows (
+		       const align_t* align,
+		       const unsigned short* pixels,
+		       int top,
+		       int rows,
+		       float dx,
+		       float dy,
+		       unsigned short* out,
+		       int out_top,
+		       int out_rows);
+int align_margin (float d);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "budget.h"
+
+static const char* arena_pages_name (arena_pages pages){
+  switch (pages){
+  case ARENA_PAGES_HUGETLB: return "hugetlb";
+  case ARENA_PAGES_THP: return "transparent huge pages";
+  default: return "normal pages";
+  }
+}
+
+//slot_size is rounded up to a multiple of the huge page size so every slot
+//starts on a huge page (and therefore any smaller) alignment. With huge set
+//MAP_HUGETLB is tried first, then transparent huge pages, then normal pages
+void arena_init (arena_t* arena, int slots, size_t slot_size, int huge){
+  arena->slot_size = (slot_size + ARENA_HUGE_PAGE_SIZE - 1) &
+    ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+  arena->slots = slots;
+  arena->size = arena->slot_size*slots;
+  arena->base = MAP_FAILED;
+  arena->pages = ARENA_PAGES_NORMAL;
+  //The camera fills every slot, so all of it counts
+  budget_charge (BUDGET_ARENA, arena->size);
+
+#ifdef MAP_HUGETLB
+  if (huge){
+    arena->base = mmap (NULL, arena->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->base != MAP_FAILED) arena->pages = ARENA_PAGES_HUGETLB;
+  }
+#endif
+  if (arena->base == MAP_FAILED){
+    arena->base = mmap (NULL, arena->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->base == MAP_FAILED){
+      fprintf (stderr, "error: arena_init: mmap of %zu bytes\n", arena->size);
+      exit (1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge && !madvise (arena->base, arena->size, MADV_HUGEPAGE)){
+      arena->pages = ARENA_PAGES_THP;
+    }
+#endif
+  }
+
+  arena->used = calloc (slots, 1);
+  if (!arena->used){
+    fprintf (stderr, "error: arena_init: out of memory\n");
+    exit (1);
+  }
+  arena->in_use = arena->peak_in_use = 0;
+  arena->acquired = arena->exhausted = 0;
+
+  printf ("arena: %i slots of %zu bytes, %s\n", slots, arena->slot_size,
+	  arena_pages_name (arena->pages));
+}
+
+void arena_free (arena_t* arena){
+  munmap (arena->base, arena->size);
+  budget_release (BUDGET_ARENA, arena->size);
+  free (arena->used);
+  arena->base = NULL;
+  arena->used = NULL;
+}
+
+//Faults the whole mapping in and keeps it in RAM, so no frame waits for a
+//page fault or for swap
+void arena_lock (arena_t* arena){
+  if (mlock (arena->base, arena->size)){
+    fprintf (stderr, "error: arena_lock: mlock of %zu bytes, raise "
+	     "RLIMIT_MEMLOCK\n", arena->size);
+    exit (1);
+  }
+  printf ("arena: %zu bytes locked\n", arena->size);
+}
+
+//Returns a free slot or -1 if all slots hold frames
+int arena_acquire (arena_t* arena){
+  int i;
+  for (i=0; i<arena->slots; i++){
+    if (!arena->used[i]){
+      arena->used[i] = 1;
+      arena->acquired++;
+      if (++arena->in_use > arena->peak_in_use){
+	arena->peak_in_use = arena->in_use;
+      }
+      return i;
+    }
+  }
+  arena->exhausted++;
+  return -1;
+}
+
+void arena_release (arena_t* arena, int slot){
+  if (slot < 0 || slot >= arena->slots || !arena->used[slot]){
+    fprintf (stderr, "error: arena_release: slot %i not in use\n", slot);
+    exit (1);
+  }
+  arena->used[slot] = 0;
+  arena->in_use--;
+}
+
+unsigned char* arena_slot (arena_t* arena, int slot){
+  return arena->base + arena->slot_size*slot;
+}
+
+void arena_dump (arena_t* arena){
+  printf ("| arena slots | in use | peak | acquired | exhausted | pages |\n");
+  printf ("| %11i | %6i | %4i | %8lu | %9lu | %s |\n", arena->slots,
+	  arena->in_use, arena->peak_in_use, arena->acquired, arena->exhausted,
+	  arena_pages_name (arena->pages));
+}
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+//Size of a huge page on the Raspberry Pi kernels (ARM LPAE and arm64)
+#define ARENA_HUGE_PAGE_SIZE (2*1024*1024)
+
+typedef enum {
+  ARENA_PAGES_NORMAL,
+  //Transparent huge pages requested with madvise, the kernel may ignore it
+  ARENA_PAGES_THP,
+  //Reserved huge pages (MAP_HUGETLB), needs vm.nr_hugepages
+  ARENA_PAGES_HUGETLB
+} arena_pages;
+
+//Fixed size frame slots carved from one mapping that is reserved once. The
+//slots are handed to the OMX components with OMX_UseBuffer so the frames are
+//written where the writer and the processing stages read them
+typedef struct {
+  unsigned char* base;
+  size_t size;
+  size_t slot_size;
+  int slots;
+  arena_pages pages;
+  //Per slot flag, 1 while the slot holds a frame
+  unsigned char* used;
+  //Occupancy metrics
+  int in_use;
+  int peak_in_use;
+  unsigned long acquired;
+  unsigned long exhausted;
+} arena_t;
+
+void arena_init (arena_t* arena, int slots, size_t slot_size, int huge);
+void arena_free (arena_t* arena);
+void arena_lock (arena_t* arena);
+int arena_acquire (arena_t* arena);
+void arena_release (arena_t* arena, int slot);
+unsigned char* arena_slot (arena_t* arena, int slot);
+void arena_dump (arena_t* arena);
+
+#endif
@@ -0,0 +1,508 @@
+//Benchmarks of the processing stages on synthetic data, independent of the
+//camera: make bench && ./bench [threads] [frame.jpg]
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "demosaic.h"
+#include "colour.h"
+#include "tonemap.h"
+#include "fusion.h"
+#include "align.h"
+#include "stack.h"
+#include "compress.h"
+#include "ring.h"
+#include "budget.h"
+
+#define BENCH_WIDTH RAW_WIDTH
+#define BENCH_HEIGHT RAW_HEIGHT
+#define BENCH_REPEAT 5
+//Frames stacked, and the signal and read noise of the synthetic dim frames
+#define BENCH_STACK_FRAMES 8
+#define BENCH_STACK_SIGNAL 20
+#define BENCH_STACK_NOISE 3
+#define BENCH_STACK_OUTLIER 50
+//Exposure of the synthetic frame to compress, in us at the scene radiance
+#define BENCH_COMPRESS_EXPOSURE 120
+//Relative amplitude of the texture of the scene to compress
+#define BENCH_COMPRESS_TEXTURE 0.5
+//Written for the delta coding and removed
+#define BENCH_COMPRESS_REFERENCE "bench-reference.rawz"
+//Pre-trigger store: window, frames pushed at the framerate, the size of an
+//H.264 buffer at its bitrate and the room given to the bitrate, as -P sizes it
+#define BENCH_RING_WINDOW 2
+#define BENCH_RING_FRAMES 120
+#define BENCH_RING_FRAMERATE 30
+#define BENCH_RING_H264 (17000000/8/BENCH_RING_FRAMERATE)
+#define BENCH_RING_HEADROOM 2
+
+static double bench_now (){
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void* bench_alloc (size_t size){
+  void* p = malloc (size);
+  if (!p){
+    fprintf (stderr, "error: bench: out of memory\n");
+    exit (1);
+  }
+  return p;
+}
+
+//Smooth gradients, a few hard edges and noise, in counts/us like the merge
+static void bench_scene (float* rgb, int width, int height){
+  int x, y, c;
+  srand (1);
+  for (y=0; y<height; y++){
+    for (x=0; x<width; x++){
+      float* p = rgb + 3*((size_t)y*width + x);
+      float edge = ((x/97 + y/61) & 1) ? 4.0f : 0.25f;
+      for (c=0; c<3; c++){
+	float smooth = 1.0f + 0.5f*sinf (x*0.01f*(c + 1) + y*0.007f);
+	p[c] = edge*smooth*(1.0f + 0.01f*(rand ()/(float)RAND_MAX - 0.5f));
+      }
+    }
+  }
+}
+
+static void bench_mosaic (
+			  const float* rgb,
+			  int width,
+			  int height,
+			  cfa_t order,
+			  float* cfa){
+  int x, y;
+  for (y=0; y<height; y++){
+    for (x=0; x<width; x++){
+      int red = (x & 1) == (order & 1) && (y & 1) == ((order >> 1) & 1);
+      int blue = (x & 1) != (order & 1) && (y & 1) != ((order >> 1) & 1);
+      int c = red ? 0 : blue ? 2 : 1;
+      cfa[(size_t)y*width + x] = rgb[3*((size_t)y*width + x) + c];
+    }
+  }
+}
+
+//Peak signal to noise ratio against the scene, the 2 pixel border excluded
+static double bench_psnr (const float* a, const float* b, int width,
+			  int height){
+  double sum = 0, peak = 0;
+  size_t n = 0;
+  int x, y, c;
+  for (y=2; y<height - 2; y++){
+    for (x=2; x<width - 2; x++){
+      for (c=0; c<3; c++){
+	size_t i = 3*((size_t)y*width + x) + c;
+	double d = a[i] - b[i];
+	sum += d*d;
+	if (a[i] > peak) peak = a[i];
+	n++;
+      }
+    }
+  }
+  return 10*log10 (peak*peak/(sum/n));
+}
+
+static void bench_demosaic (int threads){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  float* scene = bench_alloc (3*pixels*sizeof (float));
+  float* cfa = bench_alloc (pixels*sizeof (float));
+  float* rgb = bench_alloc (3*pixels*sizeof (float));
+  const float ccm[9] = COLOUR_CCM;
+  float matrix[9];
+  demosaic_mode_t mode;
+  int t, i, colour;
+
+  bench_scene (scene, BENCH_WIDTH, BENCH_HEIGHT);
+  bench_mosaic (scene, BENCH_WIDTH, BENCH_HEIGHT, RAW_CFA, cfa);
+  printf ("demosaic %ix%i, best of %i\n", BENCH_WIDTH, BENCH_HEIGHT,
+	  BENCH_REPEAT);
+  colour_matrix (matrix, 1.5, 1.7, ccm);
+  //The PSNR is only meaningful without the colour matrix
+  printf ("| mode     | colour | threads | ms      | Mpix/s  | PSNR dB |\n");
+  for (colour=0; colour<2; colour++){
+    for (mode=DEMOSAIC_BILINEAR; mode<=DEMOSAIC_EDGE; mode++){
+      for (t=1; t<=threads; t *= 2){
+	double best = 1e9;
+	for (i=0; i<BENCH_REPEAT; i++){
+	  double start = bench_now ();
+	  demosaic (cfa, BENCH_WIDTH, BENCH_HEIGHT, RAW_CFA, mode,
+		    colour ? matrix : NULL, t, rgb);
+	  double elapsed = bench_now () - start;
+	  if (elapsed < best) best = elapsed;
+	}
+	char psnr[16] = "-";
+	if (!colour){
+	  snprintf (psnr, sizeof (psnr), "%.2f",
+		    bench_psnr (scene, rgb, BENCH_WIDTH, BENCH_HEIGHT));
+	}
+	printf ("| %-8s | %-6s | %7i | %7.1f | %7.1f | %7s |\n",
+		demosaic_mode_name (mode), colour ? "yes" : "no", t, best*1e3,
+		pixels/best*1e-6, psnr);
+      }
+    }
+  }
+  free (scene);
+  free (cfa);
+  free (rgb);
+}
+
+static void bench_tonemap (int threads){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  float* scene = bench_alloc (3*pixels*sizeof (float));
+  unsigned char* out = bench_alloc (3*pixels);
+  tonemap_operator_t op;
+  int t, i;
+
+  //Stretch the scene to a dynamic range of about 10^5
+  bench_scene (scene, BENCH_WIDTH, BENCH_HEIGHT);
+  for (i=0; i<3*pixels; i++) scene[i] = powf (scene[i], 4)*0.01f;
+  printf ("tonemap %ix%i, best of %i\n", BENCH_WIDTH, BENCH_HEIGHT,
+	  BENCH_REPEAT);
+  printf ("| operator | threads | ms      | Mpix/s  | mean  |\n");
+  for (op=TONEMAP_REINHARD; op<=TONEMAP_LOCAL; op++){
+    for (t=1; t<=threads; t *= 2){
+      double best = 1e9;
+      for (i=0; i<BENCH_REPEAT; i++){
+	double start = bench_now ();
+	tonemap (scene, BENCH_WIDTH, BENCH_HEIGHT, op, t, out, 3*BENCH_WIDTH);
+	double elapsed = bench_now () - start;
+	if (elapsed < best) best = elapsed;
+      }
+      double mean = 0;
+      for (i=0; i<3*pixels; i++) mean += out[i];
+      printf ("| %-8s | %7i | %7.1f | %7.1f | %5.1f |\n",
+	      tonemap_operator_name (op), t, best*1e3, pixels/best*1e-6,
+	      mean/(3*pixels));
+    }
+  }
+  free (scene);
+  free (out);
+}
+
+//Exposures of the synthetic scene fused like a JPEG series
+#define BENCH_FUSION_FRAMES 3
+
+static void bench_fusion (){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  float* scene = bench_alloc (3*pixels*sizeof (float));
+  unsigned char* image = bench_alloc (3*pixels);
+  fusion_t fusion;
+  int f, i;
+
+  bench_scene (scene, BENCH_WIDTH, BENCH_HEIGHT);
+  fusion_init (&fusion, BENCH_WIDTH, BENCH_HEIGHT);
+  printf ("fusion %ix%i, %i frames, %i levels, %zu MB resident\n",
+	  BENCH_WIDTH, BENCH_HEIGHT, BENCH_FUSION_FRAMES, fusion.levels,
+	  fusion_memory (&fusion) >> 20);
+  double total = 0;
+  for (f=0; f<BENCH_FUSION_FRAMES; f++){
+    //One stop apart around the scene, clipped like a JPEG
+    float gain = powf (4, f - BENCH_FUSION_FRAMES/2);
+    for (i=0; i<3*pixels; i++){
+      float v = powf (scene[i]*gain, 1/2.2f)*255 + 0.5f;
+      image[i] = v >= 255 ? 255 : v;
+    }
+    double start = bench_now ();
+    fusion_add (&fusion, image, 3*BENCH_WIDTH);
+    total += bench_now () - start;
+  }
+  double start = bench_now ();
+  fusion_finish (&fusion, image, 3*BENCH_WIDTH);
+  double finish = bench_now () - start;
+  double mean = 0;
+  for (i=0; i<3*pixels; i++) mean += image[i];
+  printf ("| ms/frame | finish ms | Mpix/s  | mean  |\n");
+  printf ("| %8.1f | %9.1f | %7.1f | %5.1f |\n",
+	  total*1e3/BENCH_FUSION_FRAMES, finish*1e3,
+	  pixels*BENCH_FUSION_FRAMES/total*1e-6, mean/(3*pixels));
+  fusion_free (&fusion);
+  free (scene);
+  free (image);
+}
+
+//Camera motion between the two frames of the alignment bench, even so the
+//CFA order is kept
+#define BENCH_ALIGN_DX 6
+#define BENCH_ALIGN_DY -4
+
+static void bench_align (int threads){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  float* scene = bench_alloc (3*pixels*sizeof (float));
+  float* cfa = bench_alloc (pixels*sizeof (float));
+  unsigned short* frames[2];
+  unsigned short* out = bench_alloc (pixels*sizeof (unsigned short));
+  int t, f, i, x, y;
+
+  //The second frame is the first one moved by (DX, DY) at half the exposure
+  bench_scene (scene, BENCH_WIDTH, BENCH_HEIGHT);
+  bench_mosaic (scene, BENCH_WIDTH, BENCH_HEIGHT, CFA_BGGR, cfa);
+  for (f=0; f<2; f++){
+    frames[f] = bench_alloc (pixels*sizeof (unsigned short));
+    for (y=0; y<BENCH_HEIGHT; y++){
+      for (x=0; x<BENCH_WIDTH; x++){
+	int sx = x - f*BENCH_ALIGN_DX, sy = y - f*BENCH_ALIGN_DY;
+	if (sx < 0 || sx >= BENCH_WIDTH || sy < 0 || sy >= BENCH_HEIGHT){
+	  sx = x;
+	  sy = y;
+	}
+	float v = RAW_BLACK_LEVEL + cfa[(size_t)sy*BENCH_WIDTH + sx]*(f ? 60 : 120);
+	frames[f][(size_t)y*BENCH_WIDTH + x] = v > RAW_WHITE_LEVEL ?
+	  RAW_WHITE_LEVEL : v;
+      }
+    }
+  }
+  printf ("align %ix%i, moved by %i,%i, best of %i\n", BENCH_WIDTH,
+	  BENCH_HEIGHT, BENCH_ALIGN_DX, BENCH_ALIGN_DY, BENCH_REPEAT);
+  printf ("| threads | estimate ms | shift ms | dx     | dy     |\n");
+  for (t=1; t<=threads; t *= 2){
+    double best_estimate = 1e9, best_shift = 1e9;
+    float dx = 0, dy = 0;
+    for (i=0; i<BENCH_REPEAT; i++){
+      align_t align;
+      align_init (&align, BENCH_WIDTH, BENCH_HEIGHT, t);
+      align_frame (&align, frames[0], 120, &dx, &dy);
+      double start = bench_now ();
+      align_frame (&align, frames[1], 60, &dx, &dy);
+      double estimate = bench_now () - start;
+      start = bench_now ();
+      align_shift (&align, frames[1], dx, dy, out);
+      double shift = bench_now () - start;
+      align_free (&align);
+      if (estimate < best_estimate) best_estimate = estimate;
+      if (shift < best_shift) best_shift = shift;
+    }
+    printf ("| %7i | %11.1f | %8.1f | %+6.2f | %+6.2f |\n", t,
+	    best_estimate*1e3, best_shift*1e3, dx, dy);
+  }
+  free (scene);
+  free (cfa);
+  free (frames[0]);
+  free (frames[1]);
+  free (out);
+}
+
+//Standard deviation of the samples about the signal of the dim frames, and
+//the outliers (hot pixels) left out of it
+static double bench_stack_noise (const unsigned short* pixels, size_t n,
+				 size_t* outliers){
+  double sum = 0;
+  size_t i;
+  *outliers = 0;
+  for (i=0; i<n; i++){
+    double d = pixels[i] - (RAW_BLACK_LEVEL + BENCH_STACK_SIGNAL);
+    if (fabs (d) > BENCH_STACK_OUTLIER){
+      (*outliers)++;
+      continue;
+    }
+    sum += d*d;
+  }
+  return sqrt (sum/(n - *outliers));
+}
+
+static void bench_stack (){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  unsigned short* frames[BENCH_STACK_FRAMES];
+  unsigned short* out = bench_alloc (pixels*sizeof (unsigned short));
+  int clip, f, i;
+  size_t p, outliers;
+
+  //Gaussian read noise (sum of 4 uniform values), a sample in 512 hot
+  for (f=0; f<BENCH_STACK_FRAMES; f++){
+    frames[f] = bench_alloc (pixels*sizeof (unsigned short));
+    for (p=0; p<pixels; p++){
+      double n = ((double)rand () + rand () + rand () + rand ())/RAND_MAX - 2;
+      double v = RAW_BLACK_LEVEL + BENCH_STACK_SIGNAL +
+	n*BENCH_STACK_NOISE*sqrt (3);
+      if (rand () % 512 == 0) v = RAW_WHITE_LEVEL - 1;
+      frames[f][p] = v < 0 ? 0 : v + 0.5;
+    }
+  }
+  double noise = bench_stack_noise (frames[0], pixels, &outliers);
+  printf ("stack %i frames %ix%i, best of %i, one frame: noise %.2f DN, "
+	  "%zu outliers\n", BENCH_STACK_FRAMES, BENCH_WIDTH, BENCH_HEIGHT,
+	  BENCH_REPEAT, noise, outliers);
+  printf ("| clip | add ms | MPixel/s | noise DN | outliers |\n");
+  for (clip=0; clip<2; clip++){
+    double best = 1e9;
+    for (i=0; i<BENCH_REPEAT; i++){
+      stack_accumulator_t stack;
+      stack_init (&stack, BENCH_WIDTH, BENCH_HEIGHT, clip);
+      double start = bench_now ();
+      for (f=0; f<BENCH_STACK_FRAMES; f++) stack_add (&stack, frames[f]);
+      double elapsed = (bench_now () - start)/BENCH_STACK_FRAMES;
+      stack_finish (&stack, out);
+      stack_free (&stack);
+      if (elapsed < best) best = elapsed;
+    }
+    noise = bench_stack_noise (out, pixels, &outliers);
+    printf ("| %4i | %6.1f | %8.1f | %8.2f | %8zu |\n", clip, best*1e3,
+	    pixels/best*1e-6, noise, outliers);
+  }
+  for (f=0; f<BENCH_STACK_FRAMES; f++) free (frames[f]);
+  free (out);
+}
+
+//Ratio against the packed 10 bit data, throughput of that data, time to
+//read one band at random and whether the round trip is exact. Delta coded
+//against the reference if there is one, its file must exist
+static void bench_compress_frame (
+				  const unsigned short* frame,
+				  int exposure,
+				  const compress_reference_t* reference,
+				  int width,
+				  int height,
+				  int threads){
+  size_t pixels = (size_t)width*height;
+  double packed = pixels*10/8.0;
+  unsigned short* out = bench_alloc (pixels*sizeof (unsigned short));
+  int t, i;
+  printf ("| threads | ratio | encode MB/s | decode MB/s | band ms | exact |\n");
+  for (t=1; t<=threads; t *= 2){
+    double best_encode = 1e9, best_decode = 1e9, best_band = 1e9;
+    compress_t compress;
+    for (i=0; i<BENCH_REPEAT; i++){
+      double start = bench_now ();
+      compress_encode (&compress, frame, exposure, reference, width, height, t);
+      double encode = bench_now () - start;
+      start = bench_now ();
+      compress_decode (&compress, out, t);
+      double decode = bench_now () - start;
+      start = bench_now ();
+      compress_decode_rows (&compress, height/2, COMPRESS_BAND_ROWS,
+			    out + (size_t)height/2*width);
+      double band = bench_now () - start;
+      if (i < BENCH_REPEAT - 1) compress_free (&compress);
+      if (encode < best_encode) best_encode = encode;
+      if (decode < best_decode) best_decode = decode;
+      if (band < best_band) best_band = band;
+    }
+    printf ("| %7i | %5.2f | %11.1f | %11.1f | %7.2f | %5s |\n", t,
+	    packed/compress.size, packed/best_encode*1e-6,
+	    packed/best_decode*1e-6, best_band*1e3,
+	    memcmp (frame, out, pixels*sizeof (unsigned short)) ? "no" : "yes");
+    compress_free (&compress);
+  }
+  free (out);
+}
+
+//The mosaic at an exposure with shot and read noise
+static void bench_compress_synthetic (
+				      const float* cfa,
+				      int exposure,
+				      unsigned short* frame){
+  size_t p, pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  for (p=0; p<pixels; p++){
+    double signal = cfa[p]*exposure;
+    double n = ((double)rand () + rand () + rand () + rand ())/RAND_MAX - 2;
+    double v = RAW_BLACK_LEVEL + signal +
+      n*sqrt (3*(BENCH_STACK_NOISE*BENCH_STACK_NOISE + signal));
+    frame[p] = v < 0 ? 0 : v > RAW_WHITE_LEVEL ? RAW_WHITE_LEVEL : v + 0.5;
+  }
+}
+
+//A synthetic frame on its own and delta coded against one of twice the
+//exposure, and the raw data of a frame captured by jpeg if one is given
+static void bench_compress (int threads, const char* filename){
+  size_t pixels = (size_t)BENCH_WIDTH*BENCH_HEIGHT;
+  float* scene = bench_alloc (3*pixels*sizeof (float));
+  float* cfa = bench_alloc (pixels*sizeof (float));
+  unsigned short* frame = bench_alloc (pixels*sizeof (unsigned short));
+  unsigned short* longer = bench_alloc (pixels*sizeof (unsigned short));
+  compress_reference_t reference = { longer, 2*BENCH_COMPRESS_EXPOSURE,
+				     BENCH_COMPRESS_REFERENCE };
+  compress_t compress;
+  size_t p;
+
+  bench_scene (scene, BENCH_WIDTH, BENCH_HEIGHT);
+  bench_mosaic (scene, BENCH_WIDTH, BENCH_HEIGHT, CFA_BGGR, cfa);
+  //Fine texture (foliage, gravel) that the neighbours do not predict, the
+  //same in every frame
+  for (p=0; p<pixels; p++)
+    cfa[p] *= 1 - BENCH_COMPRESS_TEXTURE/2 +
+      BENCH_COMPRESS_TEXTURE*rand ()/RAND_MAX;
+  bench_compress_synthetic (cfa, BENCH_COMPRESS_EXPOSURE, frame);
+  bench_compress_synthetic (cfa, 2*BENCH_COMPRESS_EXPOSURE, longer);
+  printf ("compress synthetic textured %ix%i, best of %i\n", BENCH_WIDTH,
+	  BENCH_HEIGHT, BENCH_REPEAT);
+  bench_compress_frame (frame, BENCH_COMPRESS_EXPOSURE, NULL, BENCH_WIDTH,
+			BENCH_HEIGHT, threads);
+  compress_encode (&compress, longer, reference.exposure, NULL, BENCH_WIDTH,
+		   BENCH_HEIGHT, threads);
+  compress_write (&compress, BENCH_COMPRESS_REFERENCE);
+  compress_free (&compress);
+  printf ("compress synthetic, delta to twice the exposure\n");
+  bench_compress_frame (frame, BENCH_COMPRESS_EXPOSURE, &reference,
+			BENCH_WIDTH, BENCH_HEIGHT, threads);
+  unlink (BENCH_COMPRESS_REFERENCE);
+
+  if (filename){
+    roi_t sensor = { 0, 0, RAW_WIDTH, RAW_HEIGHT };
+    raw_map_t map;
+    raw_map (&map, filename, -1);
+    raw_unpack (map.raw, RAW_STRIDE, &sensor, frame);
+    raw_unmap (&map);
+    printf ("compress %s, best of %i\n", filename, BENCH_REPEAT);
+    bench_compress_frame (frame, 0, NULL, RAW_WIDTH, RAW_HEIGHT, threads);
+  }
+  free (scene);
+  free (cfa);
+  free (frame);
+  free (longer);
+}
+
+//Time to push a buffer into the store, against the frame period, and what
+//it holds at the end
+static void bench_ring_frames (const char* name, size_t size,
+			       size_t ring_size){
+  unsigned char* buffer = bench_alloc (size);
+  ring_t ring;
+  double worst = 0, total = 0;
+  int f;
+  memset (buffer, 0x55, size);
+  ring_init (&ring, ring_size, BENCH_RING_FRAMES,
+	     BENCH_RING_WINDOW*1000000000LL);
+  for (f=0; f<BENCH_RING_FRAMES; f++){
+    double start = bench_now ();
+    ring_push (&ring, buffer, size,
+	       f*1000000000LL/BENCH_RING_FRAMERATE, RING_KEYFRAME);
+    double elapsed = bench_now () - start;
+    total += elapsed;
+    if (elapsed > worst) worst = elapsed;
+  }
+  printf ("| %-5s | %8zu | %7.1f | %7.2f | %7.2f | %6i | %6.2f | %9lu |\n",
+	  name, size, ring_size/(1024.0*1024.0), total/BENCH_RING_FRAMES*1e3, worst*1e3, ring.count,
+	  ring_span (&ring)*1e-9, ring.overflows);
+  ring_free (&ring);
+  free (buffer);
+}
+
+static void bench_ring (){
+  size_t raw = (size_t)RAW_STRIDE*BENCH_HEIGHT;
+  printf ("ring %i s window, %i frames at %i frames/s\n", BENCH_RING_WINDOW,
+	  BENCH_RING_FRAMES, BENCH_RING_FRAMERATE);
+  printf ("| frame | bytes    | ring MB | push ms | worst   | frames | span s | overflows |\n");
+  bench_ring_frames ("raw", raw,
+		     (BENCH_RING_WINDOW*BENCH_RING_FRAMERATE + 1)*raw);
+  bench_ring_frames ("h264", BENCH_RING_H264,
+		     (size_t)BENCH_RING_WINDOW*BENCH_RING_H264*
+		     BENCH_RING_FRAMERATE*BENCH_RING_HEADROOM);
+}
+
+int main (int argc, char** argv){
+  int threads = argc > 1 ? atoi (argv[1]) : 4;
+  bench_demosaic (threads);
+  bench_tonemap (threads);
+  bench_fusion ();
+  bench_align (threads);
+  bench_stack ();
+  bench_compress (threads, argc > 2 ? argv[2] : NULL);
+  bench_ring ();
+  printf ("memory of the stages, peak over all benchmarks\n");
+  budget_dump ();
+  return 0;
+}
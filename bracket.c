@@ -0,0 +1,59 @@
+#include <stdio.h>
+
+#include "bracket.h"
+
+//Without adaptive the whole ladder is captured from step 0 up
+void bracket_init (bracket_t* bracket, int steps, int stride, int adaptive){
+  bracket->steps = steps;
+  bracket->stride = stride < 1 ? 1 : stride;
+  bracket->adaptive = adaptive;
+  bracket->start = adaptive ? BRACKET_START_STEP : 0;
+  if (bracket->start >= steps) bracket->start = steps - 1;
+  bracket->step = bracket->start;
+  bracket->direction = 1;
+  bracket->start_clipped = 1;
+}
+
+//Returns the step of the next frame given the statistics of the current one,
+//-1 at the end of the series
+int bracket_next (bracket_t* bracket, const raw_stats_t* stats){
+  if (bracket->direction > 0){
+    if (bracket->adaptive && bracket->step == bracket->start){
+      bracket->start_clipped = stats_clipped_fraction (stats);
+    }
+    int done = bracket->step + 1 >= bracket->steps;
+    if (bracket->adaptive){
+      double dark = stats_dark_fraction (stats);
+      double clipped = stats_clipped_fraction (stats);
+      if (dark < BRACKET_DARK_DONE || clipped > BRACKET_SATURATED){
+	printf ("bracket: no shadows left at step %i\n", bracket->step);
+	done = 1;
+      }
+    }
+    if (!done){
+      bracket->step += bracket->stride;
+      if (bracket->step >= bracket->steps) bracket->step = bracket->steps - 1;
+      return bracket->step;
+    }
+    if (!bracket->adaptive || bracket->start == 0) return -1;
+    if (bracket->start_clipped < BRACKET_CLIPPED_DONE){
+      printf ("bracket: no highlights at step %i\n", bracket->start);
+      return -1;
+    }
+    bracket->direction = -1;
+    bracket->step = bracket->start - bracket->stride;
+    if (bracket->step < 0) bracket->step = 0;
+    return bracket->step;
+  }
+
+  if (bracket->step == 0) return -1;
+  double dark = stats_dark_fraction (stats);
+  double clipped = stats_clipped_fraction (stats);
+  if (clipped < BRACKET_CLIPPED_DONE || dark > BRACKET_SATURATED){
+    printf ("bracket: no highlights left at step %i\n", bracket->step);
+    return -1;
+  }
+  bracket->step -= bracket->stride;
+  if (bracket->step < 0) bracket->step = 0;
+  return bracket->step;
+}
@@ -0,0 +1,34 @@
+#ifndef BRACKET_H
+#define BRACKET_H
+
+#include "stats.h"
+
+//Adaptive bracketing: the series starts at BRACKET_START_STEP of the exposure
+//ladder, goes up until a frame has next to no dark samples left (or is
+//clipped almost everywhere), then goes down from below the start until a
+//frame has next to no clipped samples left (or is dark almost everywhere).
+//Frames beyond these points add no information to the merge
+#define BRACKET_START_STEP 9
+#define BRACKET_DARK_DONE 0.001
+#define BRACKET_CLIPPED_DONE 0.0001
+//Fraction above which a frame is considered fully clipped or fully black
+#define BRACKET_SATURATED 0.99
+
+typedef struct {
+  int steps;
+  //Steps between two frames, more than 1 covers the ladder with fewer
+  //frames. The ends of the ladder are always captured
+  int stride;
+  int adaptive;
+  int start;
+  int step;
+  //+1 towards longer exposures, -1 towards shorter ones
+  int direction;
+  //Of the first frame, going down is useless if it has no highlights
+  double start_clipped;
+} bracket_t;
+
+void bracket_init (bracket_t* bracket, int steps, int stride, int adaptive);
+int bracket_next (bracket_t* bracket, const raw_stats_t* stats);
+
+#endif
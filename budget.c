@@ -0,0 +1,267 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "budget.h"
+
+//In front of every allocation, keeps the alignment of malloc
+#define BUDGET_HEADER 16
+#define BUDGET_MB (1024.0*1024.0)
+
+typedef struct {
+  size_t size;
+  budget_stage stage;
+  //Allocated by a thread other than the one that set up the budget
+  int other;
+} budget_header_t;
+
+typedef struct {
+  size_t used;
+  size_t peak;
+  unsigned long allocations;
+} budget_account_t;
+
+//Memory of the stages against one limit, shared by all threads
+typedef struct {
+  //0 for no limit
+  size_t limit;
+  //The thread that set up the budget, the control thread. Only the memory
+  //of the other threads can be freed while it waits
+  pthread_t owner;
+  size_t others;
+  size_t used;
+  size_t peak;
+  budget_account_t stages[BUDGET_STAGES];
+  //In use when the last frame was armed and the most since, the difference
+  //is what a frame takes
+  size_t gate_used;
+  size_t gate_peak;
+  //Allocations and frames that waited for memory, and for how long
+  unsigned long waits;
+  int64_t wait_ns;
+  //Series the capture loop ended early for lack of memory
+  unsigned long cut_short;
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+} budget_t;
+
+static budget_t budget = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .freed = PTHREAD_COND_INITIALIZER
+};
+
+static const char* budget_names[BUDGET_STAGES] = {
+  "arena", "stream", "merge", "align", "stack", "demosaic", "tonemap",
+  "fusion", "compress", "calibration", "output"
+};
+
+static int64_t budget_now (){
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+//MemAvailable of the kernel, 0 if unknown
+static size_t budget_available (){
+  char line[128];
+  unsigned long kb = 0;
+  FILE* file = fopen ("/proc/meminfo", "r");
+  if (!file) return 0;
+  while (fgets (line, sizeof (line), file)){
+    if (sscanf (line, "MemAvailable: %lu kB", &kb) == 1) break;
+  }
+  fclose (file);
+  return (size_t)kb*1024;
+}
+
+//limit in bytes, 0 for BUDGET_FRACTION of the memory available now
+void budget_init (size_t limit){
+  if (!limit) limit = budget_available ()*BUDGET_FRACTION;
+  pthread_mutex_lock (&budget.lock);
+  budget.limit = limit;
+  budget.owner = pthread_self ();
+  pthread_mutex_unlock (&budget.lock);
+  if (limit) printf ("budget: %.1f MB\n", limit/BUDGET_MB);
+  else printf ("budget: unknown memory, no limit\n");
+}
+
+static int budget_other (){
+  return !pthread_equal (pthread_self (), budget.owner);
+}
+
+//With the lock held: waits for the other threads to free enough for size
+//more bytes. Returns 0 if they still do not fit after BUDGET_WAIT_MS, or
+//at once if the caller is the owner and no other thread holds memory: the
+//owner is the one to free the rest, nobody else would
+static int budget_wait (size_t size){
+  struct timespec deadline;
+  int owner = !budget_other ();
+  if (!budget.limit || budget.used + size <= budget.limit) return 1;
+  if (size > budget.limit || (owner && !budget.others)) return 0;
+  int64_t start = budget_now ();
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += BUDGET_WAIT_MS/1000;
+  deadline.tv_nsec += (BUDGET_WAIT_MS%1000)*1000000L;
+  if (deadline.tv_nsec >= 1000000000L){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  budget.waits++;
+  while (budget.used + size > budget.limit && (!owner || budget.others) &&
+	 !pthread_cond_timedwait (&budget.freed, &budget.lock, &deadline));
+  budget.wait_ns += budget_now () - start;
+  return budget.used + size <= budget.limit;
+}
+
+//With the lock held. Running out of the budget ends the program here, with
+//the stage named, instead of wherever the kernel runs out of memory
+static void budget_add (budget_stage stage, size_t size, int other){
+  budget_account_t* account = &budget.stages[stage];
+  if (!budget_wait (size)){
+    fprintf (stderr, "error: budget: %s needs %.1f MB with %.1f of %.1f MB "
+	     "in use\n", budget_names[stage], size/BUDGET_MB,
+	     budget.used/BUDGET_MB, budget.limit/BUDGET_MB);
+    exit (1);
+  }
+  budget.used += size;
+  if (other) budget.others += size;
+  if (budget.used > budget.peak) budget.peak = budget.used;
+  if (budget.used > budget.gate_peak) budget.gate_peak = budget.used;
+  account->used += size;
+  if (account->used > account->peak) account->peak = account->used;
+  account->allocations++;
+}
+
+//With the lock held
+static void budget_sub (budget_stage stage, size_t size, int other){
+  budget.used -= size;
+  if (other) budget.others -= size;
+  budget.stages[stage].used -= size;
+  pthread_cond_broadcast (&budget.freed);
+}
+
+static void budget_charge_by (budget_stage stage, size_t size, int other){
+  pthread_mutex_lock (&budget.lock);
+  budget_add (stage, size, other);
+  pthread_mutex_unlock (&budget.lock);
+}
+
+static void budget_release_by (budget_stage stage, size_t size, int other){
+  pthread_mutex_lock (&budget.lock);
+  budget_sub (stage, size, other);
+  pthread_mutex_unlock (&budget.lock);
+}
+
+//Memory the owner allocates itself and gives back, as the frame slots
+void budget_charge (budget_stage stage, size_t size){
+  budget_charge_by (stage, size, 0);
+}
+
+void budget_release (budget_stage stage, size_t size){
+  budget_release_by (stage, size, 0);
+}
+
+static void* budget_wrap (budget_header_t* header, budget_stage stage,
+			  size_t size, int other){
+  if (!header){
+    budget_release_by (stage, size, other);
+    return NULL;
+  }
+  header->size = size;
+  header->stage = stage;
+  header->other = other;
+  return (unsigned char*)header + BUDGET_HEADER;
+}
+
+//malloc() charged to a stage, the memory goes back with budget_free(). Waits
+//for room if the budget is spent and ends the program if none is made.
+//NULL if malloc() fails
+void* budget_malloc (budget_stage stage, size_t size){
+  int other = budget_other ();
+  budget_charge_by (stage, size, other);
+  return budget_wrap (malloc (BUDGET_HEADER + size), stage, size, other);
+}
+
+void* budget_calloc (budget_stage stage, size_t n, size_t size){
+  int other = budget_other ();
+  budget_charge_by (stage, n*size, other);
+  return budget_wrap (calloc (1, BUDGET_HEADER + n*size), stage, n*size,
+		      other);
+}
+
+//Keeps the stage of p, NULL p allocates for stage. NULL if realloc() fails,
+//p is left as it was
+void* budget_realloc (budget_stage stage, void* p, size_t size){
+  if (!p) return budget_malloc (stage, size);
+  budget_header_t* header = (budget_header_t*)((unsigned char*)p -
+					       BUDGET_HEADER);
+  size_t old = header->size;
+  stage = header->stage;
+  int other = header->other;
+  if (size > old) budget_charge_by (stage, size - old, other);
+  header = realloc (header, BUDGET_HEADER + size);
+  if (!header){
+    if (size > old) budget_release_by (stage, size - old, other);
+    return NULL;
+  }
+  if (size < old) budget_release_by (stage, old - size, other);
+  header->size = size;
+  return (unsigned char*)header + BUDGET_HEADER;
+}
+
+void budget_free (void* p){
+  if (!p) return;
+  budget_header_t* header = (budget_header_t*)((unsigned char*)p -
+					       BUDGET_HEADER);
+  budget_release_by (header->stage, header->size, header->other);
+  free (header);
+}
+
+//Prediction check of the capture loop, called by the owner before a frame is
+//armed: whether the memory in use leaves room for what the frame before took
+//on top of it, then starts measuring this frame. The first call of a series
+//only starts measuring. It waits only while other threads hold memory they
+//may free, the capture loop itself frees nothing until the series ends.
+//Returns 0 if there is no room, the frame is better not captured
+int budget_gate (int first){
+  int fits = 1;
+  pthread_mutex_lock (&budget.lock);
+  if (!first){
+    fits = budget_wait (budget.gate_peak - budget.gate_used);
+    if (!fits) budget.cut_short++;
+  }
+  budget.gate_used = budget.gate_peak = budget.used;
+  pthread_mutex_unlock (&budget.lock);
+  return fits;
+}
+
+//Bytes that can still be charged without waiting, SIZE_MAX without a limit
+size_t budget_room (){
+  size_t room = SIZE_MAX;
+  pthread_mutex_lock (&budget.lock);
+  if (budget.limit)
+    room = budget.used < budget.limit ? budget.limit - budget.used : 0;
+  pthread_mutex_unlock (&budget.lock);
+  return room;
+}
+
+void budget_dump (){
+  int i;
+  pthread_mutex_lock (&budget.lock);
+  printf ("| stage       | in use MB | peak MB | allocations |\n");
+  for (i=0; i<BUDGET_STAGES; i++){
+    const budget_account_t* account = &budget.stages[i];
+    if (!account->allocations) continue;
+    printf ("| %-11s | %9.1f | %7.1f | %11lu |\n", budget_names[i],
+	    account->used/BUDGET_MB, account->peak/BUDGET_MB,
+	    account->allocations);
+  }
+  printf ("| %-11s | %9.1f | %7.1f |             |\n", "total",
+	  budget.used/BUDGET_MB, budget.peak/BUDGET_MB);
+  if (budget.limit) printf ("budget: %.1f MB, ", budget.limit/BUDGET_MB);
+  else printf ("budget: no limit, ");
+  printf ("%lu waits for memory, %.3f ms, %lu series cut short\n",
+	  budget.waits, budget.wait_ns*1e-6, budget.cut_short);
+  pthread_mutex_unlock (&budget.lock);
+}
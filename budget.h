@@ -0,0 +1,47 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Share of the memory available at start given to the budget when no limit
+//is set
+#define BUDGET_FRACTION 0.8
+//How long an allocation or the capture loop waits for memory to be freed by
+//the other threads before it gives up. The thread that called budget_init()
+//only waits while the other threads hold memory
+#define BUDGET_WAIT_MS 1000
+
+//What the memory is for, accounted separately
+typedef enum {
+  //Frame slots of the camera ports
+  BUDGET_ARENA,
+  //Pre-trigger store of a stream
+  BUDGET_STREAM,
+  //Radiance maps and the frames merged into them
+  BUDGET_MERGE,
+  BUDGET_ALIGN,
+  BUDGET_STACK,
+  BUDGET_DEMOSAIC,
+  BUDGET_TONEMAP,
+  BUDGET_FUSION,
+  BUDGET_COMPRESS,
+  //Dark frames, defect maps and the response curve
+  BUDGET_CALIBRATION,
+  //Frames reassembled and images being written
+  BUDGET_OUTPUT,
+  BUDGET_STAGES
+} budget_stage;
+
+void budget_init (size_t limit);
+void* budget_malloc (budget_stage stage, size_t size);
+void* budget_calloc (budget_stage stage, size_t n, size_t size);
+void* budget_realloc (budget_stage stage, void* p, size_t size);
+void budget_free (void* p);
+void budget_charge (budget_stage stage, size_t size);
+void budget_release (budget_stage stage, size_t size);
+int budget_gate (int first);
+size_t budget_room ();
+void budget_dump ();
+
+#endif
@@ -0,0 +1,57 @@
+#include <stdio.h>
+
+#include "colour.h"
+
+void colour_matrix (
+		    float* matrix,
+		    double red_gain,
+		    double blue_gain,
+		    const float* ccm){
+  int row;
+  for (row=0; row<3; row++){
+    matrix[3*row] = ccm[3*row]*red_gain;
+    matrix[3*row + 1] = ccm[3*row + 1];
+    matrix[3*row + 2] = ccm[3*row + 2]*blue_gain;
+  }
+}
+
+void colour_dump (const float* matrix){
+  int row;
+  for (row=0; row<3; row++){
+    printf ("| %7.4f %7.4f %7.4f |\n", matrix[3*row], matrix[3*row + 1],
+	    matrix[3*row + 2]);
+  }
+}
+
+static inline unsigned char colour_clamp (int value){
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+//Coefficients in Q16
+void colour_yuv420_to_rgb (
+			   const unsigned char* y,
+			   const unsigned char* u,
+			   const unsigned char* v,
+			   int y_stride,
+			   int uv_stride,
+			   int width,
+			   int rows,
+			   unsigned char* rgb,
+			   int rgb_stride){
+  int row, x;
+  for (row=0; row<rows; row++){
+    const unsigned char* luma = y + row*y_stride;
+    const unsigned char* cb = u + row/2*uv_stride;
+    const unsigned char* cr = v + row/2*uv_stride;
+    unsigned char* out = rgb + row*rgb_stride;
+    for (x=0; x<width; x++){
+      int l = luma[x] << 16;
+      int b = cb[x/2] - 128;
+      int r = cr[x/2] - 128;
+      out[0] = colour_clamp ((l + 91881*r + 32768) >> 16);
+      out[1] = colour_clamp ((l - 22554*b - 46802*r + 32768) >> 16);
+      out[2] = colour_clamp ((l + 116130*b + 32768) >> 16);
+      out += 3;
+    }
+  }
+}
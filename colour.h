@@ -0,0 +1,34 @@
+#ifndef COLOUR_H
+#define COLOUR_H
+
+//Camera RGB to linear sRGB for IMX219 in daylight, row major. Approximate,
+//replace with a calibrated matrix. The rows sum to 1 so that white balanced
+//grey stays grey
+#define COLOUR_CCM {				\
+    1.80f, -0.65f, -0.15f,			\
+    -0.30f, 1.70f, -0.40f,			\
+    0.05f, -0.70f, 1.65f			\
+  }
+
+//The white balance gains and the colour correction matrix combined into the
+//one matrix the demosaic applies to every pixel: ccm*diag (red, 1, blue)
+void colour_matrix (
+		    float* matrix,
+		    double red_gain,
+		    double blue_gain,
+		    const float* ccm);
+void colour_dump (const float* matrix);
+//JFIF (full range BT.601) YUV 4:2:0 planes to 8 bit RGB, 3 bytes per pixel.
+//rows is even except for the last slice of an image
+void colour_yuv420_to_rgb (
+			   const unsigned char* y,
+			   const unsigned char* u,
+			   const unsigned char* v,
+			   int y_stride,
+			   int uv_stride,
+			   int width,
+			   int rows,
+			   unsigned char* rgb,
+			   int rgb_stride);
+
+#endif
@@ -0,0 +1,576 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "budget.h"
+#include "raw.h"
+#include "role.h"
+
+//Worst case of a sample: the escape and the verbatim residual
+#define COMPRESS_MAX_BITS (COMPRESS_MAX_UNARY + COMPRESS_ESCAPE_BITS)
+//Initial sum of the residuals of a context, LOCO-I for a 10 bit range
+#define COMPRESS_INITIAL_SUM 16
+
+typedef struct {
+  unsigned char* out;
+  size_t pos;
+  uint64_t acc;
+  int bits;
+} compress_writer_t;
+
+typedef struct {
+  const unsigned char* in;
+  size_t pos;
+  size_t size;
+  uint64_t acc;
+  int bits;
+} compress_reader_t;
+
+//Residual statistics of the contexts of a plane
+typedef struct {
+  int sum[COMPRESS_CONTEXTS];
+  int count[COMPRESS_CONTEXTS];
+} compress_state_t;
+
+typedef struct {
+  const compress_t* compress;
+  const unsigned short* pixels;
+  //Whole reference frame, NULL for a frame coded on its own
+  const unsigned short* reference;
+  unsigned short* out;
+  //Bands at their worst case offsets, before they are moved together
+  unsigned char* data;
+  //Room for the delta coded version of a band
+  size_t capacity;
+  int first;
+  int step;
+} compress_job_t;
+
+static void compress_put (compress_writer_t* w, uint32_t value, int bits){
+  w->acc = w->acc << bits | value;
+  w->bits += bits;
+  while (w->bits >= 8){
+    w->bits -= 8;
+    w->out[w->pos++] = w->acc >> w->bits;
+  }
+}
+
+static void compress_flush (compress_writer_t* w){
+  if (w->bits) compress_put (w, 0, 8 - w->bits);
+}
+
+//Past the end of the band zeros are read, a damaged band decodes to garbage
+//but not out of bounds
+static void compress_refill (compress_reader_t* r){
+  while (r->bits <= 56){
+    r->acc = r->acc << 8 | (r->pos < r->size ? r->in[r->pos] : 0);
+    r->pos++;
+    r->bits += 8;
+  }
+}
+
+static uint32_t compress_get (compress_reader_t* r, int bits){
+  if (!bits) return 0;
+  compress_refill (r);
+  r->bits -= bits;
+  return (r->acc >> r->bits) & ((1u << bits) - 1);
+}
+
+//Leading ones up to COMPRESS_MAX_UNARY, and the zero that ends them
+static int compress_get_unary (compress_reader_t* r){
+  compress_refill (r);
+  uint64_t ones = ~(r->acc << (64 - r->bits));
+  int q = ones ? __builtin_clzll (ones) : 64;
+  if (q >= COMPRESS_MAX_UNARY){
+    r->bits -= COMPRESS_MAX_UNARY;
+    return COMPRESS_MAX_UNARY;
+  }
+  r->bits -= q + 1;
+  return q;
+}
+
+static void compress_state_init (compress_state_t* state){
+  int i;
+  for (i=0; i<COMPRESS_CONTEXTS; i++){
+    state->sum[i] = COMPRESS_INITIAL_SUM;
+    state->count[i] = 1;
+  }
+}
+
+//Rice parameter of a context: the smallest k with count*2^k >= sum
+static int compress_parameter (const compress_state_t* state, int context){
+  int k = 0;
+  while ((state->count[context] << k) < state->sum[context] &&
+	 k < COMPRESS_ESCAPE_BITS)
+    k++;
+  return k;
+}
+
+static void compress_update (compress_state_t* state, int context, int error){
+  state->sum[context] += error < 0 ? -error : error;
+  if (++state->count[context] == COMPRESS_RESET){
+    state->sum[context] >>= 1;
+    state->count[context] >>= 1;
+  }
+}
+
+//Prediction of a sample from its left (a), upper (b) and upper left (c)
+//neighbours of the same plane, and the context from their differences
+static int compress_predict (
+			     const unsigned short* row,
+			     const unsigned short* up,
+			     int x,
+			     int* context){
+  if (!up){
+    *context = 0;
+    return x ? row[x - 2] : 0;
+  }
+  if (!x){
+    *context = 0;
+    return up[0];
+  }
+  int a = row[x - 2], b = up[x], c = up[x - 2];
+  int lo = a < b ? a : b, hi = a < b ? b : a;
+  int g = (a > c ? a - c : c - a) + (b > c ? b - c : c - b);
+  int bucket = g ? 31 - __builtin_clz (g) : 0;
+  *context = bucket < COMPRESS_CONTEXTS ? bucket : COMPRESS_CONTEXTS - 1;
+  return c >= hi ? lo : c <= lo ? hi : a + b - c;
+}
+
+//A sample of the reference scaled to the exposure of the frame
+static int compress_scale (int reference, uint32_t scale){
+  int64_t v = RAW_BLACK_LEVEL + (((int64_t)(reference - RAW_BLACK_LEVEL)*scale +
+				  (1 << (COMPRESS_SCALE_BITS - 1))) >>
+				 COMPRESS_SCALE_BITS);
+  return v < 0 ? 0 : v > RAW_WHITE_LEVEL ? RAW_WHITE_LEVEL : v;
+}
+
+//Prediction of a delta coded sample: the scaled reference, corrected by the
+//mean difference of the left and upper neighbours to their scaled
+//reference. That follows the scene where the ratio is off, in the response of
+//the sensor near black and where the reference is clipped
+static int compress_predict_delta (
+				   const unsigned short* row,
+				   const unsigned short* up,
+				   const unsigned short* ref,
+				   const unsigned short* ref_up,
+				   uint32_t scale,
+				   int x,
+				   int* context){
+  int p = compress_scale (ref[x], scale), d;
+  if (!up){
+    *context = 0;
+    d = x ? row[x - 2] - compress_scale (ref[x - 2], scale) : 0;
+  } else if (!x){
+    *context = 0;
+    d = up[0] - compress_scale (ref_up[0], scale);
+  } else {
+    int a = row[x - 2] - compress_scale (ref[x - 2], scale);
+    int b = up[x] - compress_scale (ref_up[x], scale);
+    int c = up[x - 2] - compress_scale (ref_up[x - 2], scale);
+    int g = (a > c ? a - c : c - a) + (b > c ? b - c : c - b);
+    int bucket = g ? 31 - __builtin_clz (g) : 0;
+    *context = bucket < COMPRESS_CONTEXTS ? bucket : COMPRESS_CONTEXTS - 1;
+    //What the reference leaves is mostly noise, independent from sample to
+    //sample, so the mean of the neighbours does better than following edges
+    d = (a + b)/2;
+  }
+  p += d;
+  return p < 0 ? 0 : p > RAW_WHITE_LEVEL ? RAW_WHITE_LEVEL : p;
+}
+
+//Codes the rows of a band plane by plane, from the reference rows if there
+//are any, returns the bytes written
+static size_t compress_encode_band (
+				    const unsigned short* pixels,
+				    const unsigned short* reference,
+				    uint32_t scale,
+				    int width,
+				    int rows,
+				    unsigned char* out){
+  compress_writer_t w = { out, 0, 0, 0 };
+  compress_state_t state;
+  int plane, x, y;
+  for (plane=0; plane<4; plane++){
+    compress_state_init (&state);
+    for (y=plane >> 1; y<rows; y += 2){
+      size_t offset = (size_t)y*width + (plane & 1);
+      const unsigned short* row = pixels + offset;
+      const unsigned short* up = y >= 2 ? row - 2*width : NULL;
+      const unsigned short* ref = reference ? reference + offset : NULL;
+      for (x=0; x<width; x += 2){
+	int context;
+	int prediction = ref ?
+	  compress_predict_delta (row, up, ref, up ? ref - 2*width : NULL,
+				  scale, x, &context) :
+	  compress_predict (row, up, x, &context);
+	int error = row[x] - prediction;
+	uint32_t mapped = error < 0 ? -2*error - 1 : 2*error;
+	int k = compress_parameter (&state, context);
+	uint32_t q = mapped >> k;
+	if (q < COMPRESS_MAX_UNARY){
+	  compress_put (&w, ((1u << q) - 1) << 1, q + 1);
+	  compress_put (&w, mapped & ((1u << k) - 1), k);
+	} else {
+	  compress_put (&w, (1u << COMPRESS_MAX_UNARY) - 1, COMPRESS_MAX_UNARY);
+	  compress_put (&w, mapped, COMPRESS_ESCAPE_BITS);
+	}
+	compress_update (&state, context, error);
+      }
+    }
+  }
+  compress_flush (&w);
+  return w.pos;
+}
+
+static void compress_decode_rows_of_band (
+					  const unsigned char* in,
+					  size_t size,
+					  const unsigned short* reference,
+					  uint32_t scale,
+					  int width,
+					  int rows,
+					  unsigned short* pixels){
+  compress_reader_t r = { in, 0, size, 0, 0 };
+  compress_state_t state;
+  int plane, x, y;
+  for (plane=0; plane<4; plane++){
+    compress_state_init (&state);
+    for (y=plane >> 1; y<rows; y += 2){
+      size_t offset = (size_t)y*width + (plane & 1);
+      unsigned short* row = pixels + offset;
+      const unsigned short* up = y >= 2 ? row - 2*width : NULL;
+      const unsigned short* ref = reference ? reference + offset : NULL;
+      for (x=0; x<width; x += 2){
+	int context;
+	int prediction = ref ?
+	  compress_predict_delta (row, up, ref, up ? ref - 2*width : NULL,
+				  scale, x, &context) :
+	  compress_predict (row, up, x, &context);
+	int k = compress_parameter (&state, context);
+	uint32_t mapped;
+	int q = compress_get_unary (&r);
+	if (q < COMPRESS_MAX_UNARY){
+	  mapped = (uint32_t)q << k | compress_get (&r, k);
+	} else {
+	  mapped = compress_get (&r, COMPRESS_ESCAPE_BITS);
+	}
+	int error = mapped & 1 ? -(int)((mapped + 1) >> 1) : (int)(mapped >> 1);
+	row[x] = (prediction + error) & 0x3ff;
+	compress_update (&state, context, error);
+      }
+    }
+  }
+}
+
+static int compress_band_rows (const compress_header_t* header, int band){
+  int top = band*header->band_rows;
+  return top + header->band_rows <= header->height ? header->band_rows :
+    header->height - top;
+}
+
+//A band of a delta coded frame is coded both ways and the smaller kept, so
+//a band the reference does not predict (moved, clipped or black in it)
+//costs no more than on its own
+static void* compress_encode_main (void* arg){
+  compress_job_t* job = arg;
+  const compress_header_t* header = job->compress->header;
+  compress_band_t* bands = (compress_band_t*)job->compress->bands;
+  unsigned char* delta = NULL;
+  int band;
+  if (job->reference &&
+      !(delta = budget_malloc (BUDGET_COMPRESS, job->capacity))){
+    fprintf (stderr, "error: compress: out of memory\n");
+    exit (1);
+  }
+  for (band=job->first; band<header->bands; band += job->step){
+    size_t top = (size_t)band*header->band_rows*header->width;
+    int rows = compress_band_rows (header, band);
+    unsigned char* out = job->data + bands[band].offset;
+    bands[band].size = compress_encode_band (job->pixels + top, NULL, 0,
+					     header->width, rows, out);
+    bands[band].delta = 0;
+    if (!delta) continue;
+    size_t size = compress_encode_band (job->pixels + top,
+					job->reference + top, header->scale,
+					header->width, rows, delta);
+    if (size < bands[band].size){
+      memcpy (out, delta, size);
+      bands[band].size = size;
+      bands[band].delta = 1;
+    }
+  }
+  budget_free (delta);
+  return NULL;
+}
+
+static void* compress_decode_main (void* arg){
+  compress_job_t* job = arg;
+  int band;
+  for (band=job->first; band<job->compress->header->bands; band += job->step)
+    compress_decode_band (job->compress, band, job->reference, job->out);
+  return NULL;
+}
+
+//Runs the bands interleaved on the threads, the calling thread takes the
+//first share
+static void compress_run (
+			  compress_job_t* job,
+			  int threads,
+			  void* (*run) (void*)){
+  compress_job_t jobs[COMPRESS_MAX_THREADS];
+  pthread_t ids[COMPRESS_MAX_THREADS];
+  int i;
+  if (threads > COMPRESS_MAX_THREADS) threads = COMPRESS_MAX_THREADS;
+  for (i=0; i<threads; i++){
+    jobs[i] = *job;
+    jobs[i].first = i;
+    jobs[i].step = threads;
+  }
+  for (i=1; i<threads; i++){
+    if (role_spawn (&ids[i], ROLE_POOL, run, &jobs[i])){
+      fprintf (stderr, "error: compress: pthread_create\n");
+      exit (1);
+    }
+  }
+  run (&jobs[0]);
+  for (i=1; i<threads; i++) pthread_join (ids[i], NULL);
+}
+
+//Compresses width x height samples (width a multiple of 4, height even),
+//delta coded if there is a reference of the same size. Every band is coded
+//into room for its worst case, then the bands are moved together, so the
+//threads need no coordination
+void compress_encode (
+		      compress_t* compress,
+		      const unsigned short* pixels,
+		      int exposure,
+		      const compress_reference_t* reference,
+		      int width,
+		      int height,
+		      int threads){
+  int bands = (height + COMPRESS_BAND_ROWS - 1)/COMPRESS_BAND_ROWS;
+  size_t table = sizeof (compress_header_t) + bands*sizeof (compress_band_t);
+  size_t band_capacity =
+    ((size_t)width*COMPRESS_BAND_ROWS*COMPRESS_MAX_BITS + 7)/8;
+  int i;
+
+  compress->size = table + bands*band_capacity;
+  compress->data = budget_malloc (BUDGET_COMPRESS, compress->size);
+  if (!compress->data){
+    fprintf (stderr, "error: compress: out of memory\n");
+    exit (1);
+  }
+  compress->mapped = 0;
+  compress_header_t* header = (compress_header_t*)compress->data;
+  compress_band_t* band = (compress_band_t*)(header + 1);
+  memcpy (header->magic, COMPRESS_MAGIC, 4);
+  header->version = COMPRESS_VERSION;
+  header->width = width;
+  header->height = height;
+  header->band_rows = COMPRESS_BAND_ROWS;
+  header->bands = bands;
+  header->scale = 0;
+  memset (header->reference, 0, COMPRESS_REFERENCE_SIZE);
+  if (reference){
+    double scale = (double)exposure/reference->exposure*
+      (1 << COMPRESS_SCALE_BITS);
+    header->scale = scale < UINT32_MAX ? (uint32_t)(scale + 0.5) : UINT32_MAX;
+    memcpy (header->reference, reference->name, COMPRESS_REFERENCE_SIZE - 1);
+  }
+  for (i=0; i<bands; i++) band[i].offset = table + i*band_capacity;
+  compress->header = header;
+  compress->bands = band;
+  compress->path[0] = 0;
+
+  compress_job_t job = { compress, pixels,
+			 reference ? reference->pixels : NULL, NULL,
+			 compress->data, band_capacity, 0, 1 };
+  compress_run (&job, threads, compress_encode_main);
+
+  size_t end = table;
+  for (i=0; i<bands; i++){
+    memmove (compress->data + end, compress->data + band[i].offset,
+	     band[i].size);
+    band[i].offset = end;
+    end += band[i].size;
+  }
+  compress->size = end;
+  unsigned char* data = budget_realloc (BUDGET_COMPRESS, compress->data,
+				       end);
+  if (data){
+    compress->data = data;
+    compress->header = (compress_header_t*)data;
+    compress->bands = (compress_band_t*)(compress->header + 1);
+  }
+}
+
+void compress_write (const compress_t* compress, const char* filename){
+  int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1 || write (fd, compress->data, compress->size) !=
+      (ssize_t)compress->size || close (fd)){
+    fprintf (stderr, "error: writing %s\n", filename);
+    exit (1);
+  }
+}
+
+//Maps a compressed frame, the bands are decoded from the mapping in place
+void compress_open (compress_t* compress, const char* filename){
+  struct stat st;
+  int fd = open (filename, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st)){
+    fprintf (stderr, "error: open %s\n", filename);
+    exit (1);
+  }
+  compress->size = st.st_size;
+  compress->data = mmap (NULL, compress->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (compress->data == MAP_FAILED){
+    fprintf (stderr, "error: mmap %s\n", filename);
+    exit (1);
+  }
+  compress->mapped = 1;
+  strncpy (compress->path, filename, sizeof (compress->path) - 1);
+  compress->path[sizeof (compress->path) - 1] = 0;
+  compress->header = (const compress_header_t*)compress->data;
+  compress->bands = (const compress_band_t*)(compress->header + 1);
+  if (compress->size < sizeof (compress_header_t) ||
+      memcmp (compress->header->magic, COMPRESS_MAGIC, 4) ||
+      compress->header->version != COMPRESS_VERSION ||
+      compress->size < sizeof (compress_header_t) +
+      compress->header->bands*sizeof (compress_band_t)){
+    fprintf (stderr, "error: %s is not a compressed frame\n", filename);
+    exit (1);
+  }
+}
+
+void compress_free (compress_t* compress){
+  if (compress->mapped) munmap (compress->data, compress->size);
+  else budget_free (compress->data);
+  compress->data = NULL;
+}
+
+static const compress_band_t* compress_band (
+					     const compress_t* compress,
+					     int band){
+  const compress_band_t* b = &compress->bands[band];
+  if (b->offset + b->size > compress->size){
+    fprintf (stderr, "error: compress: band %i is truncated\n", band);
+    exit (1);
+  }
+  return b;
+}
+
+//Decodes a band into its rows of the frame, pixels and reference (NULL for a
+//frame coded on its own) are whole frames
+void compress_decode_band (
+			   const compress_t* compress,
+			   int band,
+			   const unsigned short* reference,
+			   unsigned short* pixels){
+  const compress_header_t* header = compress->header;
+  const compress_band_t* b = compress_band (compress, band);
+  size_t top = (size_t)band*header->band_rows*header->width;
+  if (b->delta && !reference){
+    fprintf (stderr, "error: compress: band %i needs %s\n", band,
+	     header->reference);
+    exit (1);
+  }
+  compress_decode_rows_of_band (compress->data + b->offset, b->size,
+				b->delta ? reference + top : NULL,
+				header->scale, header->width,
+				compress_band_rows (header, band), pixels + top);
+}
+
+//Maps the reference of a delta coded frame, it is in the directory of the
+//frame
+static void compress_open_reference (
+				     const compress_t* compress,
+				     compress_t* reference){
+  char filename[sizeof (compress->path) + COMPRESS_REFERENCE_SIZE];
+  const char* slash = strrchr (compress->path, '/');
+  int directory = slash ? slash + 1 - compress->path : 0;
+  sprintf (filename, "%.*s%s", directory, compress->path,
+	   compress->header->reference);
+  compress_open (reference, filename);
+  if (reference->header->scale ||
+      reference->header->width != compress->header->width ||
+      reference->header->height != compress->header->height ||
+      reference->header->band_rows != compress->header->band_rows){
+    fprintf (stderr, "error: %s is no reference of %s\n", filename,
+	     compress->path);
+    exit (1);
+  }
+}
+
+//Random access: decodes rows [top, top + rows) into pixels, only the bands
+//that hold them are read
+void compress_decode_rows (
+			   const compress_t* compress,
+			   int top,
+			   int rows,
+			   unsigned short* pixels){
+  const compress_header_t* header = compress->header;
+  size_t width = header->width;
+  size_t band_size = header->band_rows*width;
+  unsigned short* scratch = budget_malloc (BUDGET_COMPRESS,
+					  2*band_size*sizeof (unsigned short));
+  compress_t reference;
+  int band;
+  if (!scratch){
+    fprintf (stderr, "error: compress: out of memory\n");
+    exit (1);
+  }
+  if (header->scale) compress_open_reference (compress, &reference);
+  for (band=top/header->band_rows;
+       band<header->bands && band*(int)header->band_rows < top + rows;
+       band++){
+    int band_top = band*header->band_rows;
+    int band_rows = compress_band_rows (header, band);
+    const compress_band_t* b = compress_band (compress, band);
+    if (b->delta){
+      const compress_band_t* r = compress_band (&reference, band);
+      compress_decode_rows_of_band (reference.data + r->offset, r->size, NULL,
+				    0, width, band_rows, scratch + band_size);
+    }
+    compress_decode_rows_of_band (compress->data + b->offset, b->size,
+				  b->delta ? scratch + band_size : NULL,
+				  header->scale, width, band_rows, scratch);
+    int first = top > band_top ? top : band_top;
+    int last = top + rows < band_top + band_rows ? top + rows :
+      band_top + band_rows;
+    memcpy (pixels + (first - top)*width, scratch + (first - band_top)*width,
+	    (last - first)*width*sizeof (unsigned short));
+  }
+  if (header->scale) compress_free (&reference);
+  budget_free (scratch);
+}
+
+void compress_decode (
+		      const compress_t* compress,
+		      unsigned short* pixels,
+		      int threads){
+  compress_job_t job = { compress, NULL, NULL, pixels, NULL, 0, 0, 1 };
+  unsigned short* frame = NULL;
+  if (compress->header->scale){
+    compress_t reference;
+    size_t size = (size_t)compress->header->width*compress->header->height;
+    if (!(frame = budget_malloc (BUDGET_COMPRESS,
+				 size*sizeof (unsigned short)))){
+      fprintf (stderr, "error: compress: out of memory\n");
+      exit (1);
+    }
+    compress_open_reference (compress, &reference);
+    compress_decode (&reference, frame, threads);
+    compress_free (&reference);
+    job.reference = frame;
+  }
+  compress_run (&job, threads, compress_decode_main);
+  budget_free (frame);
+}
@@ -0,0 +1,99 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPRESS_MAGIC "RAWZ"
+#define COMPRESS_VERSION 2
+//Rows coded independently of each other, even so every band starts on the
+//same CFA row. A band is the unit of the threads and of random access
+#define COMPRESS_BAND_ROWS 64
+#define COMPRESS_MAX_THREADS 16
+//Residuals whose Rice quotient reaches this are escaped and stored verbatim
+#define COMPRESS_MAX_UNARY 16
+//Bits of a verbatim residual, mapped to unsigned
+#define COMPRESS_ESCAPE_BITS 11
+//Contexts of a plane, by the activity around the sample
+#define COMPRESS_CONTEXTS 8
+//The statistics of a context are halved after this many samples, so the
+//Rice parameter follows the scene
+#define COMPRESS_RESET 64
+//File name of the reference of a delta coded frame, in the same directory
+#define COMPRESS_REFERENCE_SIZE 128
+//Fixed point of the exposure ratio to the reference
+#define COMPRESS_SCALE_BITS 16
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t band_rows;
+  uint32_t bands;
+  //Exposure of the frame over the one of the reference, 0 if the frame is
+  //coded on its own
+  uint32_t scale;
+  char reference[COMPRESS_REFERENCE_SIZE];
+} compress_header_t;
+
+//Where a band is in the file, followed by the table of all bands
+typedef struct {
+  uint64_t offset;
+  uint32_t size;
+  //Predicted from the reference
+  uint32_t delta;
+} compress_band_t;
+
+//A compressed frame, in memory after compress_encode or mapped by
+//compress_open. 10 bit samples, the 4 CFA planes of a band are coded one
+//after the other with the median edge detector (LOCO-I) predicting from the
+//same plane and adaptive Golomb-Rice codes.
+//A delta coded frame predicts every sample from the same sample of a
+//reference frame scaled by the exposure ratio, and the neighbours predict
+//what is left. The reference is coded on its own, so any frame takes at most
+//one more decode of the same rows
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  int mapped;
+  //Of the mapped file, the reference is looked up next to it
+  char path[256];
+  const compress_header_t* header;
+  const compress_band_t* bands;
+} compress_t;
+
+//Decoded reference frame for compress_encode
+typedef struct {
+  const unsigned short* pixels;
+  int exposure;
+  char name[COMPRESS_REFERENCE_SIZE];
+} compress_reference_t;
+
+void compress_encode (
+		      compress_t* compress,
+		      const unsigned short* pixels,
+		      int exposure,
+		      const compress_reference_t* reference,
+		      int width,
+		      int height,
+		      int threads);
+void compress_write (const compress_t* compress, const char* filename);
+void compress_open (compress_t* compress, const char* filename);
+void compress_free (compress_t* compress);
+void compress_decode_band (
+			   const compress_t* compress,
+			   int band,
+			   const unsigned short* reference,
+			   unsigned short* pixels);
+void compress_decode_rows (
+			   const compress_t* compress,
+			   int top,
+			   int rows,
+			   unsigned short* pixels);
+void compress_decode (
+		      const compress_t* compress,
+		      unsigned short* pixels,
+		      int threads);
+
+#endif
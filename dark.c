@@ -0,0 +1,271 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dark.h"
+
+//4 samples per operation, NEON on the Pi, SSE2 elsewhere. 32 bit lanes so
+//the interpolation of the masters does not overflow
+typedef int32_t dark_v4 __attribute__ ((vector_size (16)));
+
+#define DARK_LANES 4
+
+static int dark_bucket (double value, int buckets){
+  int bucket = value > 1 ? (int)floor (log2 (value) + 0.5) : 0;
+  return bucket < buckets ? bucket : buckets - 1;
+}
+
+static int dark_temperature_bucket (int temperature){
+  int bucket = temperature < 0 ? 0 : temperature/DARK_TEMPERATURE_STEP;
+  return bucket < DARK_TEMPERATURE_BUCKETS ? bucket :
+    DARK_TEMPERATURE_BUCKETS - 1;
+}
+
+static size_t dark_master_size (const dark_header_t* header){
+  return (size_t)header->width*header->height*sizeof (uint16_t);
+}
+
+//The master and its sums, a page multiple
+static size_t dark_block_size (const dark_header_t* header){
+  size_t size = (size_t)header->width*header->height*
+    (sizeof (uint16_t) + sizeof (uint32_t));
+  return (size + DARK_ALIGNMENT - 1)/DARK_ALIGNMENT*DARK_ALIGNMENT;
+}
+
+//Degrees Celsius, 0 if unknown
+int dark_temperature (){
+  FILE* f = fopen (DARK_THERMAL_ZONE, "r");
+  int millidegrees = 0;
+  if (!f) return 0;
+  if (fscanf (f, "%i", &millidegrees) != 1) millidegrees = 0;
+  fclose (f);
+  return (millidegrees + 500)/1000;
+}
+
+static void dark_map (dark_library_t* library){
+  library->data = mmap (NULL, library->size,
+			library->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, library->fd, 0);
+  if (library->data == MAP_FAILED){
+    fprintf (stderr, "error: mmap %s\n", library->filename);
+    exit (1);
+  }
+  library->header = (dark_header_t*)library->data;
+}
+
+//Maps the library. Reading, a missing library gives 0. Writing, it is created
+//for full sensor masters
+int dark_open (dark_library_t* library, const char* filename, int writable){
+  struct stat st;
+  memset (library, 0, sizeof (*library));
+  snprintf (library->filename, sizeof (library->filename), "%s", filename);
+  library->writable = writable;
+  library->fd = open (filename, writable ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+  if (library->fd == -1){
+    if (!writable) return 0;
+    fprintf (stderr, "error: open %s\n", filename);
+    exit (1);
+  }
+  if (fstat (library->fd, &st)){
+    fprintf (stderr, "error: fstat %s\n", filename);
+    exit (1);
+  }
+  library->size = st.st_size;
+  if (!library->size && writable){
+    library->size = (sizeof (dark_header_t) + DARK_ALIGNMENT - 1)/
+      DARK_ALIGNMENT*DARK_ALIGNMENT;
+    if (ftruncate (library->fd, library->size)){
+      fprintf (stderr, "error: ftruncate %s\n", filename);
+      exit (1);
+    }
+    dark_map (library);
+    memcpy (library->header->magic, DARK_MAGIC, 4);
+    library->header->version = DARK_VERSION;
+    library->header->width = RAW_WIDTH;
+    library->header->height = RAW_HEIGHT;
+    return 1;
+  }
+  if (library->size < sizeof (dark_header_t)){
+    fprintf (stderr, "error: %s is not a dark frame library\n", filename);
+    exit (1);
+  }
+  dark_map (library);
+  if (memcmp (library->header->magic, DARK_MAGIC, 4) ||
+      library->header->version != DARK_VERSION ||
+      library->header->width != RAW_WIDTH ||
+      library->header->height != RAW_HEIGHT){
+    fprintf (stderr, "error: %s is not a dark frame library of this sensor\n",
+	     filename);
+    exit (1);
+  }
+  return 1;
+}
+
+void dark_close (dark_library_t* library){
+  if (!library->data) return;
+  if (library->writable) msync (library->data, library->size, MS_SYNC);
+  munmap (library->data, library->size);
+  close (library->fd);
+  library->data = NULL;
+}
+
+//Adds a full sensor frame to the sums of the master of its key and updates
+//its mean from them, so a master can be built from any number of runs
+void dark_add (
+	       dark_library_t* library,
+	       const unsigned short* pixels,
+	       int exposure,
+	       int iso,
+	       int temperature){
+  dark_entry_t* entry = &library->header->table
+    [dark_bucket (exposure, DARK_EXPOSURE_BUCKETS)]
+    [dark_bucket (iso, DARK_ISO_BUCKETS)]
+    [dark_temperature_bucket (temperature)];
+  size_t block_size = dark_block_size (library->header);
+  size_t i, n = (size_t)library->header->width*library->header->height;
+
+  if (!entry->offset){
+    //Append a master, the mapping moves with the new size
+    uint64_t offset = library->size;
+    munmap (library->data, library->size);
+    library->size = offset + block_size;
+    if (ftruncate (library->fd, library->size)){
+      fprintf (stderr, "error: ftruncate %s\n", library->filename);
+      exit (1);
+    }
+    dark_map (library);
+    entry = &library->header->table
+      [dark_bucket (exposure, DARK_EXPOSURE_BUCKETS)]
+      [dark_bucket (iso, DARK_ISO_BUCKETS)]
+      [dark_temperature_bucket (temperature)];
+    entry->offset = offset;
+  }
+
+  uint16_t* master = (uint16_t*)(library->data + entry->offset);
+  uint32_t* sums = (uint32_t*)(library->data + entry->offset +
+			       dark_master_size (library->header));
+  uint32_t count = ++entry->count;
+  for (i=0; i<n; i++){
+    sums[i] += pixels[i];
+    master[i] = (((uint64_t)sums[i] << DARK_FRACTION_BITS) + count/2)/count;
+  }
+  entry->exposure_sum += exposure;
+  entry->exposure = (entry->exposure_sum + count/2)/count;
+}
+
+static const dark_entry_t* dark_row (
+				     const dark_library_t* library,
+				     int iso,
+				     int temperature,
+				     int bucket){
+  return &library->header->table[bucket][dark_bucket (iso, DARK_ISO_BUCKETS)]
+    [dark_temperature_bucket (temperature)];
+}
+
+//Selects the masters of the key of a frame. Returns 0 if the library has
+//none for its ISO and temperature. The search is bounded by the number of
+//exposure buckets, not by the size of the library
+int dark_lookup (
+		 const dark_library_t* library,
+		 int exposure,
+		 int iso,
+		 int temperature,
+		 dark_t* dark){
+  const dark_entry_t* below = NULL;
+  const dark_entry_t* above = NULL;
+  int bucket = dark_bucket (exposure, DARK_EXPOSURE_BUCKETS);
+  int b;
+  if (!library->data) return 0;
+
+  for (b=bucket; b>=0 && !below; b--){
+    const dark_entry_t* e = dark_row (library, iso, temperature, b);
+    if (e->offset) below = e;
+  }
+  for (b=bucket + (below != NULL); b<DARK_EXPOSURE_BUCKETS && !above; b++){
+    const dark_entry_t* e = dark_row (library, iso, temperature, b);
+    if (e->offset && e != below) above = e;
+  }
+  //Beyond the longest master, extrapolate from the two longest
+  if (!above && below){
+    above = below;
+    below = NULL;
+    for (b=dark_bucket (above->exposure, DARK_EXPOSURE_BUCKETS) - 1;
+	 b>=0 && !below; b--){
+      const dark_entry_t* e = dark_row (library, iso, temperature, b);
+      if (e->offset) below = e;
+    }
+  }
+  if (!below && !above) return 0;
+  if (!below || !above || below->exposure == above->exposure){
+    const dark_entry_t* e = below ? below : above;
+    dark->master[0] = dark->master[1] =
+      (const uint16_t*)(library->data + e->offset);
+    dark->weight = 0;
+  } else {
+    dark->master[0] = (const uint16_t*)(library->data + below->offset);
+    dark->master[1] = (const uint16_t*)(library->data + above->offset);
+    dark->weight = lround (256.0*((double)exposure - below->exposure)/
+			   ((double)above->exposure - below->exposure));
+  }
+  dark->width = library->header->width;
+  return 1;
+}
+
+//Subtracts the dark level above black from rows [top, top + rows) of the ROI
+//(in sensor coordinates), so the black level stays RAW_BLACK_LEVEL for the
+//merge. Clipped samples stay clipped, others never become clipped
+void dark_subtract (
+		    const dark_t* dark,
+		    const roi_t* roi,
+		    int top,
+		    int rows,
+		    unsigned short* pixels){
+  const dark_v4 weight = (dark_v4){ 0 } + dark->weight;
+  const dark_v4 black = (dark_v4){ 0 } +
+    ((RAW_BLACK_LEVEL << DARK_FRACTION_BITS) + (1 << (DARK_FRACTION_BITS - 1)));
+  const dark_v4 white = (dark_v4){ 0 } + RAW_WHITE_LEVEL;
+  const dark_v4 highest = (dark_v4){ 0 } + (RAW_WHITE_LEVEL - 1);
+  int x, y, k;
+  for (y=0; y<rows; y++){
+    size_t row = (size_t)(roi->top + top + y)*dark->width + roi->left;
+    const uint16_t* d0 = dark->master[0] + row;
+    const uint16_t* d1 = dark->master[1] + row;
+    unsigned short* p = pixels + (size_t)y*roi->width;
+    //The ROI width is a multiple of 4
+    for (x=0; x<roi->width; x += DARK_LANES){
+      dark_v4 v = { p[x], p[x + 1], p[x + 2], p[x + 3] };
+      dark_v4 a = { d0[x], d0[x + 1], d0[x + 2], d0[x + 3] };
+      dark_v4 b = { d1[x], d1[x + 1], d1[x + 2], d1[x + 3] };
+      dark_v4 d = a + (((b - a)*weight) >> 8);
+      dark_v4 r = ((v << DARK_FRACTION_BITS) - d + black) >> DARK_FRACTION_BITS;
+      //Comparisons give -1 for true
+      r &= r > 0;
+      r = (r & (r <= highest)) | (highest & (r > highest));
+      dark_v4 clipped = v >= white;
+      r = (r & ~clipped) | (v & clipped);
+      for (k=0; k<DARK_LANES; k++) p[x + k] = r[k];
+    }
+  }
+}
+
+void dark_dump (const dark_library_t* library){
+  int e, i, t;
+  if (!library->data) return;
+  printf ("| exposure us | iso bucket | temperature | frames |\n");
+  for (e=0; e<DARK_EXPOSURE_BUCKETS; e++){
+    for (i=0; i<DARK_ISO_BUCKETS; i++){
+      for (t=0; t<DARK_TEMPERATURE_BUCKETS; t++){
+	const dark_entry_t* entry = &library->header->table[e][i][t];
+	if (!entry->offset) continue;
+	printf ("| %11u | %10i | %8i-%-2i | %6u |\n", entry->exposure, i,
+		t*DARK_TEMPERATURE_STEP, (t + 1)*DARK_TEMPERATURE_STEP - 1,
+		entry->count);
+      }
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef DARK_H
+#define DARK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "raw.h"
+
+//Library of master dark frames in the current directory
+#define DARK_LIBRARY "darks.lib"
+#define DARK_MAGIC "DARK"
+#define DARK_VERSION 2
+//Keys: exposure rounded to a power of 2 us (up to 8 s), ISO rounded to a
+//power of 2, temperature in steps of DARK_TEMPERATURE_STEP from 0 degrees
+#define DARK_EXPOSURE_BUCKETS 24
+#define DARK_ISO_BUCKETS 16
+#define DARK_TEMPERATURE_BUCKETS 16
+#define DARK_TEMPERATURE_STEP 5
+//Masters start on a page so they can be mapped and read in place
+#define DARK_ALIGNMENT 4096
+//Masters hold the mean dark level in 1/16 DN, followed by the 32 bit sums of
+//the frames averaged into them so the mean stays exact however many there are
+#define DARK_FRACTION_BITS 4
+//SoC temperature, the sensor has none the firmware reports
+#define DARK_THERMAL_ZONE "/sys/class/thermal/thermal_zone0/temp"
+
+typedef struct {
+  //Of the master in the file, 0 if there is none
+  uint64_t offset;
+  //Frames averaged into the master
+  uint32_t count;
+  //Mean exposure of those frames in us, and their sum
+  uint32_t exposure;
+  uint64_t exposure_sum;
+} dark_entry_t;
+
+//Header at the start of the library. The table is addressed directly by the
+//key, so a lookup is one index operation whatever the size of the library
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  dark_entry_t table[DARK_EXPOSURE_BUCKETS][DARK_ISO_BUCKETS]
+  [DARK_TEMPERATURE_BUCKETS];
+} dark_header_t;
+
+typedef struct {
+  char filename[256];
+  int fd;
+  int writable;
+  unsigned char* data;
+  size_t size;
+  dark_header_t* header;
+} dark_library_t;
+
+//The masters selected for a frame: the two exposures closest to the one of
+//the frame, interpolated (or extrapolated) linearly in the exposure time
+typedef struct {
+  const uint16_t* master[2];
+  //Weight of master[1] in 1/256
+  int weight;
+  int width;
+} dark_t;
+
+int dark_temperature ();
+int dark_open (dark_library_t* library, const char* filename, int writable);
+void dark_close (dark_library_t* library);
+void dark_add (
+	       dark_library_t* library,
+	       const unsigned short* pixels,
+	       int exposure,
+	       int iso,
+	       int temperature);
+int dark_lookup (
+		 const dark_library_t* library,
+		 int exposure,
+		 int iso,
+		 int temperature,
+		 dark_t* dark);
+void dark_subtract (
+		    const dark_t* dark,
+		    const roi_t* roi,
+		    int top,
+		    int rows,
+		    unsigned short* pixels);
+void dark_dump (const dark_library_t* library);
+
+#endif
@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defect.h"
+#include "budget.h"
+
+//4 defects per operation, NEON on the Pi, SSE2 elsewhere
+typedef int32_t defect_v4 __attribute__ ((vector_size (16)));
+
+#define DEFECT_LANES 4
+//Magic and sensor size in front of the counts
+#define DEFECT_COUNTS_HEADER 12
+
+static uint32_t defect_coord (int x, int y){
+  return (uint32_t)y << 16 | (uint32_t)x;
+}
+
+//Index of the first entry at or after the coordinate
+static int defect_lower_bound (const defect_map_t* map, uint32_t coord){
+  int lo = 0, hi = map->count;
+  while (lo < hi){
+    int mid = (lo + hi)/2;
+    if (map->coords[mid] < coord) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+int defect_find (const defect_map_t* map, int x, int y){
+  uint32_t coord = defect_coord (x, y);
+  int i = defect_lower_bound (map, coord);
+  return i < map->count && map->coords[i] == coord;
+}
+
+//Reads the map, a missing one gives 0 and an empty map
+int defect_load (defect_map_t* map, const char* filename){
+  char magic[4];
+  uint32_t header[2];
+  FILE* f = fopen (filename, "rb");
+  memset (map, 0, sizeof (*map));
+  if (!f) return 0;
+  if (fread (magic, 4, 1, f) != 1 || memcmp (magic, DEFECT_MAGIC, 4) ||
+      fread (header, sizeof (header), 1, f) != 1 ||
+      header[0] != DEFECT_VERSION){
+    fprintf (stderr, "error: %s is not a defect map\n", filename);
+    exit (1);
+  }
+  map->count = header[1];
+  if (map->count){
+    if (!(map->coords = budget_malloc (BUDGET_CALIBRATION,
+					     map->count*sizeof (uint32_t)))){
+      fprintf (stderr, "error: out of memory\n");
+      exit (1);
+    }
+    if (fread (map->coords, sizeof (uint32_t), map->count, f) !=
+	(size_t)map->count){
+      fprintf (stderr, "error: %s is truncated\n", filename);
+      exit (1);
+    }
+  }
+  fclose (f);
+  return 1;
+}
+
+void defect_save (const defect_map_t* map, const char* filename){
+  uint32_t header[2] = { DEFECT_VERSION, map->count };
+  FILE* f = fopen (filename, "wb");
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  if (fwrite (DEFECT_MAGIC, 4, 1, f) != 1 ||
+      fwrite (header, sizeof (header), 1, f) != 1 ||
+      fwrite (map->coords, sizeof (uint32_t), map->count, f) !=
+      (size_t)map->count){
+    fprintf (stderr, "error: fwrite %s\n", filename);
+    exit (1);
+  }
+  fclose (f);
+}
+
+void defect_free (defect_map_t* map){
+  budget_free (map->coords);
+  map->coords = NULL;
+  map->count = 0;
+}
+
+void defect_builder_init (defect_builder_t* builder, const roi_t* roi){
+  size_t n = (size_t)roi->width*roi->height;
+  builder->roi = *roi;
+  builder->frames = 0;
+  builder->hot_tests = budget_calloc (BUDGET_CALIBRATION, n, 1);
+  builder->hot_hits = budget_calloc (BUDGET_CALIBRATION, n, 1);
+  builder->dead_tests = budget_calloc (BUDGET_CALIBRATION, n, 1);
+  builder->dead_hits = budget_calloc (BUDGET_CALIBRATION, n, 1);
+  if (!builder->hot_tests || !builder->hot_hits || !builder->dead_tests ||
+      !builder->dead_hits){
+    fprintf (stderr, "error: out of memory\n");
+    exit (1);
+  }
+}
+
+void defect_builder_free (defect_builder_t* builder){
+  budget_free (builder->hot_tests);
+  budget_free (builder->hot_hits);
+  budget_free (builder->dead_tests);
+  budget_free (builder->dead_hits);
+  builder->hot_tests = builder->hot_hits = NULL;
+  builder->dead_tests = builder->dead_hits = NULL;
+}
+
+static uint8_t* defect_plane (const defect_builder_t* builder, int plane){
+  uint8_t* const planes[4] = { builder->hot_tests, builder->hot_hits,
+			       builder->dead_tests, builder->dead_hits };
+  return planes[plane];
+}
+
+static long defect_row_offset (const defect_builder_t* builder, int plane,
+			       int y){
+  const roi_t* roi = &builder->roi;
+  return DEFECT_COUNTS_HEADER + ((long)plane*RAW_HEIGHT + roi->top + y)*RAW_WIDTH + roi->left;
+}
+
+//Adds the counts of the earlier series in the ROI, a missing file leaves
+//them at 0
+void defect_builder_load (defect_builder_t* builder, const char* filename){
+  char magic[4];
+  uint32_t header[2];
+  int plane, y;
+  FILE* f = fopen (filename, "rb");
+  if (!f) return;
+  if (fread (magic, 4, 1, f) != 1 || memcmp (magic, DEFECT_COUNTS_MAGIC, 4) ||
+      fread (header, sizeof (header), 1, f) != 1 ||
+      header[0] != RAW_WIDTH || header[1] != RAW_HEIGHT){
+    fprintf (stderr, "error: %s is not a defect count file\n", filename);
+    exit (1);
+  }
+  for (plane=0; plane<4; plane++){
+    for (y=0; y<builder->roi.height; y++){
+      uint8_t* row = defect_plane (builder, plane) +
+	(size_t)y*builder->roi.width;
+      //A short read is a row not written yet
+      if (fseek (f, defect_row_offset (builder, plane, y), SEEK_SET) ||
+	  fread (row, 1, builder->roi.width, f) != (size_t)builder->roi.width)
+	memset (row, 0, builder->roi.width);
+    }
+  }
+  fclose (f);
+}
+
+//Writes the counts of the ROI back, the rest of the sensor stays
+void defect_builder_save (const defect_builder_t* builder,
+			  const char* filename){
+  const uint32_t header[2] = { RAW_WIDTH, RAW_HEIGHT };
+  int plane, y;
+  FILE* f = fopen (filename, "r+b");
+  if (!f) f = fopen (filename, "w+b");
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  if (fwrite (DEFECT_COUNTS_MAGIC, 4, 1, f) != 1 ||
+      fwrite (header, sizeof (header), 1, f) != 1){
+    fprintf (stderr, "error: fwrite %s\n", filename);
+    exit (1);
+  }
+  for (plane=0; plane<4; plane++){
+    for (y=0; y<builder->roi.height; y++){
+      const uint8_t* row = defect_plane (builder, plane) +
+	(size_t)y*builder->roi.width;
+      if (fseek (f, defect_row_offset (builder, plane, y), SEEK_SET) ||
+	  fwrite (row, 1, builder->roi.width, f) !=
+	  (size_t)builder->roi.width){
+	fprintf (stderr, "error: fwrite %s\n", filename);
+	exit (1);
+      }
+    }
+  }
+  fclose (f);
+}
+
+static void defect_count (uint8_t* count){
+  if (*count < 255) (*count)++;
+}
+
+//Compares every pixel of an unpacked ROI frame with its 8 same colour
+//neighbours. Pixels whose neighbours are clipped are not tested, nor are the
+//2 pixel border of the ROI
+void defect_builder_add (
+			 defect_builder_t* builder,
+			 const unsigned short* pixels){
+  int w = builder->roi.width;
+  int h = builder->roi.height;
+  int x, y, k;
+  const int offsets[8] = { -2*w - 2, -2*w, -2*w + 2, -2, 2,
+			   2*w - 2, 2*w, 2*w + 2 };
+  for (y=2; y<h - 2; y++){
+    for (x=2; x<w - 2; x++){
+      size_t i = (size_t)y*w + x;
+      const unsigned short* p = pixels + i;
+      int lo = p[offsets[0]], hi = p[offsets[0]];
+      for (k=1; k<8; k++){
+	int n = p[offsets[k]];
+	if (n < lo) lo = n;
+	if (n > hi) hi = n;
+      }
+      if (hi >= RAW_WHITE_LEVEL) continue;
+      int v = *p - RAW_BLACK_LEVEL;
+      lo -= RAW_BLACK_LEVEL;
+      hi -= RAW_BLACK_LEVEL;
+      if (hi < DEFECT_MIN_SIGNAL){
+	defect_count (&builder->hot_tests[i]);
+	if (v > 2*(hi > 0 ? hi : 0) + DEFECT_MARGIN)
+	  defect_count (&builder->hot_hits[i]);
+      }
+      if (lo >= DEFECT_MIN_SIGNAL){
+	defect_count (&builder->dead_tests[i]);
+	if (2*v + DEFECT_MARGIN < lo) defect_count (&builder->dead_hits[i]);
+      }
+    }
+  }
+  builder->frames++;
+}
+
+static int defect_consistent (int tests, int hits){
+  return tests >= DEFECT_MIN_TESTS && hits >= DEFECT_CONSISTENCY*tests;
+}
+
+static int defect_compare (const void* a, const void* b){
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+//A pixel not tested often enough either way keeps what the map says
+static int defect_undecided (const defect_builder_t* builder, size_t i){
+  return builder->hot_tests[i] < DEFECT_MIN_TESTS &&
+    builder->dead_tests[i] < DEFECT_MIN_TESTS;
+}
+
+//Replaces the entries of the map inside the ROI of the builder by the pixels
+//found defective over all the series counted, the ones outside the ROI and
+//the undecided ones stay. Returns the number found
+int defect_builder_finish (defect_builder_t* builder, defect_map_t* map){
+  const roi_t* roi = &builder->roi;
+  size_t i, n = (size_t)roi->width*roi->height;
+  int found = 0, kept = 0, k;
+
+  for (i=0; i<n; i++){
+    found += defect_consistent (builder->hot_tests[i], builder->hot_hits[i]) ||
+      defect_consistent (builder->dead_tests[i], builder->dead_hits[i]);
+  }
+  size_t size = (map->count + found + 1)*sizeof (uint32_t);
+  uint32_t* coords = budget_malloc (BUDGET_CALIBRATION, size);
+  if (!coords){
+    fprintf (stderr, "error: out of memory\n");
+    exit (1);
+  }
+  for (k=0; k<map->count; k++){
+    int x = map->coords[k] & 0xffff, y = map->coords[k] >> 16;
+    if (x < roi->left || x >= roi->left + roi->width ||
+	y < roi->top || y >= roi->top + roi->height ||
+	defect_undecided (builder, (size_t)(y - roi->top)*roi->width +
+			  x - roi->left))
+      coords[kept++] = map->coords[k];
+  }
+  int count = kept;
+  for (i=0; i<n; i++){
+    if (defect_consistent (builder->hot_tests[i], builder->hot_hits[i]) ||
+	defect_consistent (builder->dead_tests[i], builder->dead_hits[i]))
+      coords[count++] = defect_coord (roi->left + i%roi->width,
+				      roi->top + i/roi->width);
+  }
+  //Both parts are sorted, but they interleave by row
+  qsort (coords, count, sizeof (uint32_t), defect_compare);
+  budget_free (map->coords);
+  map->coords = coords;
+  map->count = count;
+  return found;
+}
+
+//Replaces the defects in rows [top, top + rows) of the ROI (in sensor
+//coordinates) by the mean of their nearest same colour neighbours in the
+//rows, left, right, above and below, that are not defects themselves. If one
+//of them is clipped the defect is clipped too, without any it becomes black
+//so the merge skips it. The rows are found by a binary search of the map, so
+//the cost is that of the defects, not of the frame
+void defect_correct (
+		     const defect_map_t* map,
+		     const roi_t* roi,
+		     int top,
+		     int rows,
+		     unsigned short* pixels){
+  const int dx[4] = { -2, 2, 0, 0 };
+  const int dy[4] = { 0, 0, -2, 2 };
+  const defect_v4 zero = { 0 };
+  const defect_v4 white = zero + RAW_WHITE_LEVEL;
+  const defect_v4 black = zero + RAW_BLACK_LEVEL;
+  int y0 = roi->top + top;
+  int first = defect_lower_bound (map, defect_coord (0, y0));
+  int last = defect_lower_bound (map, defect_coord (0, y0 + rows));
+  int i, j, k, lanes;
+
+  for (i=first; i<last; i += lanes){
+    //Defects in the lanes, transposed neighbours and their validity
+    defect_v4 samples[4] = { zero, zero, zero, zero };
+    defect_v4 valid[4] = { zero, zero, zero, zero };
+    unsigned short* targets[DEFECT_LANES] = { NULL };
+    lanes = last - i < DEFECT_LANES ? last - i : DEFECT_LANES;
+    for (k=0; k<lanes; k++){
+      int x = (map->coords[i + k] & 0xffff) - roi->left;
+      int y = (map->coords[i + k] >> 16) - y0;
+      if (x < 0 || x >= roi->width) continue;
+      targets[k] = pixels + (size_t)y*roi->width + x;
+      for (j=0; j<4; j++){
+	int nx = x + dx[j], ny = y + dy[j];
+	if (nx < 0 || nx >= roi->width || ny < 0 || ny >= rows ||
+	    defect_find (map, roi->left + nx, y0 + ny))
+	  continue;
+	samples[j][k] = pixels[(size_t)ny*roi->width + nx];
+	valid[j][k] = -1;
+      }
+    }
+    //Comparisons give -1 for true
+    defect_v4 sum = zero, count = zero, clipped = zero;
+    for (j=0; j<4; j++){
+      sum += samples[j] & valid[j];
+      count -= valid[j];
+      clipped |= valid[j] & (samples[j] >= white);
+    }
+    defect_v4 none = count == 0;
+    defect_v4 mean = (sum + (count >> 1))/(count | (none & 1));
+    mean = (mean & ~none) | (black & none);
+    mean = (mean & ~clipped) | (white & clipped);
+    for (k=0; k<lanes; k++)
+      if (targets[k]) *targets[k] = mean[k];
+  }
+}
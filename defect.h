@@ -0,0 +1,69 @@
+#ifndef DEFECT_H
+#define DEFECT_H
+
+#include <stdint.h>
+
+#include "raw.h"
+
+//Defective pixels of the sensor in the current directory
+#define DEFECT_MAP "defects.map"
+#define DEFECT_MAGIC "DEFS"
+#define DEFECT_VERSION 1
+//Counts of the tests and hits of every sensor pixel over all the series
+//detected so far, 4 planes of RAW_WIDTH*RAW_HEIGHT bytes after the header.
+//Rows never written read as zero
+#define DEFECT_COUNTS "defects.counts"
+#define DEFECT_COUNTS_MAGIC "DEFC"
+//A pixel is hot in a frame if its signal above black is more than twice the
+//largest of its 8 same colour neighbours plus the margin, dead if it is less
+//than half the smallest minus the margin. Hot pixels are only tested where
+//the neighbours are below DEFECT_MIN_SIGNAL and dead ones where they are at
+//or above it, so a dark series counts towards the one and a bright series
+//towards the other without diluting each other
+#define DEFECT_MARGIN 24
+#define DEFECT_MIN_SIGNAL 64
+//It is defective if it was tested in this many frames and found hot (or
+//dead) in DEFECT_CONSISTENCY of them over all the series, noise does not
+//repeat and neither does a highlight of one scene
+#define DEFECT_MIN_TESTS 4
+#define DEFECT_CONSISTENCY 0.75
+
+//Sorted list of the defective pixels in sensor coordinates, y << 16 | x, so a
+//band of rows is a contiguous range of it
+typedef struct {
+  uint32_t* coords;
+  int count;
+} defect_map_t;
+
+//Per pixel counts of the ROI, saturating, loaded from and saved to the
+//counts of earlier series. frames are the ones added since the load
+typedef struct {
+  roi_t roi;
+  int frames;
+  uint8_t* hot_tests;
+  uint8_t* hot_hits;
+  uint8_t* dead_tests;
+  uint8_t* dead_hits;
+} defect_builder_t;
+
+int defect_load (defect_map_t* map, const char* filename);
+void defect_save (const defect_map_t* map, const char* filename);
+void defect_free (defect_map_t* map);
+int defect_find (const defect_map_t* map, int x, int y);
+void defect_builder_init (defect_builder_t* builder, const roi_t* roi);
+void defect_builder_free (defect_builder_t* builder);
+void defect_builder_load (defect_builder_t* builder, const char* filename);
+void defect_builder_save (const defect_builder_t* builder,
+			  const char* filename);
+void defect_builder_add (
+			 defect_builder_t* builder,
+			 const unsigned short* pixels);
+int defect_builder_finish (defect_builder_t* builder, defect_map_t* map);
+void defect_correct (
+		     const defect_map_t* map,
+		     const roi_t* roi,
+		     int top,
+		     int rows,
+		     unsigned short* pixels);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deghost.h"
+#include "budget.h"
+#include "hdr.h"
+#include "raw.h"
+
+void deghost_init (deghost_t* deghost, int width){
+  size_t n = (size_t)width*DEGHOST_BAND_ROWS;
+  memset (deghost, 0, sizeof (*deghost));
+  deghost->width = width;
+  deghost->signal = budget_malloc (BUDGET_MERGE, n*sizeof (float));
+  deghost->time = budget_malloc (BUDGET_MERGE, n*sizeof (float));
+  if (!deghost->signal || !deghost->time){
+    fprintf (stderr, "error: deghost_init: out of memory\n");
+    exit (1);
+  }
+}
+
+void deghost_free (deghost_t* deghost){
+  budget_free (deghost->signal);
+  budget_free (deghost->time);
+  deghost->signal = deghost->time = NULL;
+}
+
+//Starts a band of rows <= DEGHOST_BAND_ROWS
+void deghost_begin (deghost_t* deghost, int rows){
+  size_t n = (size_t)deghost->width*rows;
+  deghost->rows = rows;
+  memset (deghost->signal, 0, n*sizeof (float));
+  memset (deghost->time, 0, n*sizeof (float));
+}
+
+//radiance is the band of the first pass, pixels the band of one frame
+void deghost_add (
+		  deghost_t* deghost,
+		  const float* radiance,
+		  const unsigned short* pixels,
+		  int exposure){
+  size_t n = (size_t)deghost->width*deghost->rows;
+  float t = exposure + HDR_EXPOSURE_OFFSET;
+  float read = DEGHOST_READ_NOISE*DEGHOST_READ_NOISE;
+  float scale = 1/(DEGHOST_SCALE*DEGHOST_SCALE);
+  size_t i, samples = 0, outliers = 0;
+  for (i=0; i<n; i++){
+    int v = pixels[i] - RAW_BLACK_LEVEL;
+    if (v < HDR_MIN_SIGNAL || pixels[i] >= RAW_WHITE_LEVEL) continue;
+    float expected = radiance[i]*t;
+    float d = v - expected;
+    float w = 1/(1 + d*d*scale/(read + DEGHOST_SHOT_NOISE*expected));
+    deghost->signal[i] += w*v;
+    deghost->time[i] += w*t;
+    samples++;
+    outliers += w < 0.5f;
+  }
+  deghost->samples += samples;
+  deghost->outliers += outliers;
+}
+
+//Replaces the band of the first pass. Pixels where every sample was an
+//outlier keep their first pass value
+void deghost_end (deghost_t* deghost, float* radiance){
+  size_t n = (size_t)deghost->width*deghost->rows;
+  size_t i;
+  for (i=0; i<n; i++){
+    if (deghost->time[i] > 0) radiance[i] = deghost->signal[i]/deghost->time[i];
+  }
+}
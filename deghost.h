@@ -0,0 +1,41 @@
+#ifndef DEGHOST_H
+#define DEGHOST_H
+
+#include <stddef.h>
+
+//Rows of the ROI reweighted at once. Only the accumulators of a band are
+//resident, every frame is read band by band from its file
+#define DEGHOST_BAND_ROWS 64
+//Noise of a sample in DN: read noise, and shot noise variance per DN of
+//signal above black (IMX219 at unity analog gain)
+#define DEGHOST_READ_NOISE 2.0f
+#define DEGHOST_SHOT_NOISE 1.0f
+//Deviation in standard deviations at which a sample gets half the weight
+#define DEGHOST_SCALE 3.0f
+
+//Second pass of the merge. Every sample is compared with the radiance of the
+//first pass scaled to its exposure and weighted down the more it deviates
+//beyond the noise (Cauchy weights), so objects that moved during the series
+//only count in the frames where they agree with the majority
+typedef struct {
+  int width;
+  int rows;
+  //Weighted signal and exposure time of the band
+  float* signal;
+  float* time;
+  //Valid samples and those that got less than half the weight, for the log
+  size_t samples;
+  size_t outliers;
+} deghost_t;
+
+void deghost_init (deghost_t* deghost, int width);
+void deghost_free (deghost_t* deghost);
+void deghost_begin (deghost_t* deghost, int rows);
+void deghost_add (
+		  deghost_t* deghost,
+		  const float* radiance,
+		  const unsigned short* pixels,
+		  int exposure);
+void deghost_end (deghost_t* deghost, float* radiance);
+
+#endif
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "demosaic.h"
+#include "budget.h"
+#include "role.h"
+
+//The green pass needs 2 samples around the tile, the colour pass 1 more.
+//Even, so a tile has the CFA order of the image
+#define DEMOSAIC_BORDER 4
+#define DEMOSAIC_PADDED_WIDTH (DEMOSAIC_TILE_WIDTH + 2*DEMOSAIC_BORDER)
+#define DEMOSAIC_PADDED_HEIGHT (DEMOSAIC_TILE_HEIGHT + 2*DEMOSAIC_BORDER)
+#define DEMOSAIC_LANES 4
+//Keeps the directional weights finite in flat areas
+#define DEMOSAIC_EPSILON 1e-20f
+
+//4 floats per operation, NEON on the Pi, SSE elsewhere
+typedef float demosaic_v4 __attribute__ ((vector_size (16)));
+typedef int32_t demosaic_i4 __attribute__ ((vector_size (16)));
+
+typedef struct {
+  const float* cfa;
+  int width;
+  int height;
+  cfa_t order;
+  demosaic_mode_t mode;
+  const float* matrix;
+  float* rgb;
+  //Rows of the band
+  int top;
+  int bottom;
+} demosaic_band_t;
+
+int demosaic_parse_mode (const char* name, demosaic_mode_t* mode){
+  if (!strcmp (name, "bilinear")){
+    *mode = DEMOSAIC_BILINEAR;
+  } else if (!strcmp (name, "edge")){
+    *mode = DEMOSAIC_EDGE;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+const char* demosaic_mode_name (demosaic_mode_t mode){
+  return mode == DEMOSAIC_EDGE ? "edge" : "bilinear";
+}
+
+static inline demosaic_v4 demosaic_load (const float* p){
+  demosaic_v4 v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline void demosaic_store (float* p, demosaic_v4 v){
+  memcpy (p, &v, sizeof (v));
+}
+
+static inline demosaic_v4 demosaic_abs (demosaic_v4 v){
+  return (demosaic_v4)((demosaic_i4)v & 0x7FFFFFFF);
+}
+
+//Mirrors around the first and last sample, which keeps the CFA phase
+static int demosaic_reflect (int i, int n){
+  if (n == 1) return 0;
+  while (i < 0 || i >= n){
+    if (i < 0) i = -i;
+    if (i >= n) i = 2*(n - 1) - i;
+  }
+  return i;
+}
+
+static void demosaic_load_tile (
+				const demosaic_band_t* band,
+				int x0,
+				int y0,
+				int tw,
+				int th,
+				float* tile){
+  int pw = tw + 2*DEMOSAIC_BORDER;
+  int px, py;
+  for (py=0; py<th + 2*DEMOSAIC_BORDER; py++){
+    int y = demosaic_reflect (y0 + py - DEMOSAIC_BORDER, band->height);
+    const float* row = band->cfa + (size_t)y*band->width;
+    float* out = tile + py*DEMOSAIC_PADDED_WIDTH;
+    if (x0 >= DEMOSAIC_BORDER && x0 + tw + DEMOSAIC_BORDER <= band->width){
+      memcpy (out, row + x0 - DEMOSAIC_BORDER, pw*sizeof (float));
+      continue;
+    }
+    for (px=0; px<pw; px++){
+      out[px] = row[demosaic_reflect (x0 + px - DEMOSAIC_BORDER, band->width)];
+    }
+  }
+}
+
+//Green at a non-green sample, one vector of a row
+static inline demosaic_v4 demosaic_green (
+					  const float* c,
+					  demosaic_mode_t mode){
+  const int s = DEMOSAIC_PADDED_WIDTH;
+  demosaic_v4 w = demosaic_load (c - 1);
+  demosaic_v4 e = demosaic_load (c + 1);
+  demosaic_v4 n = demosaic_load (c - s);
+  demosaic_v4 so = demosaic_load (c + s);
+  if (mode == DEMOSAIC_BILINEAR) return (w + e + n + so)*0.25f;
+
+  demosaic_v4 c2 = demosaic_load (c)*2.0f;
+  demosaic_v4 lap_h = c2 - demosaic_load (c - 2) - demosaic_load (c + 2);
+  demosaic_v4 lap_v = c2 - demosaic_load (c - 2*s) - demosaic_load (c + 2*s);
+  demosaic_v4 gh = (w + e)*0.5f + lap_h*0.25f;
+  demosaic_v4 gv = (n + so)*0.5f + lap_v*0.25f;
+  demosaic_v4 dh = demosaic_abs (w - e) + demosaic_abs (lap_h) +
+    DEMOSAIC_EPSILON;
+  demosaic_v4 dv = demosaic_abs (n - so) + demosaic_abs (lap_v) +
+    DEMOSAIC_EPSILON;
+  //Each direction weighted with the gradient of the other one
+  demosaic_v4 g = (gh*dv + gv*dh)/(dh + dv);
+  //The Laplacian correction can overshoot below 0
+  return (g + demosaic_abs (g))*0.5f;
+}
+
+//Green over the tile and 2 samples around it
+static void demosaic_green_pass (
+				 const float* tile,
+				 float* green,
+				 int tw,
+				 int th,
+				 cfa_t order,
+				 demosaic_mode_t mode){
+  //Green where x + y has this parity
+  int green_parity = order == CFA_RGGB || order == CFA_BGGR;
+  int x0 = DEMOSAIC_BORDER - 2;
+  int x1 = DEMOSAIC_BORDER + tw + 2;
+  int px, py, k;
+  for (py=DEMOSAIC_BORDER - 2; py<DEMOSAIC_BORDER + th + 2; py++){
+    const float* c = tile + py*DEMOSAIC_PADDED_WIDTH;
+    float* g = green + py*DEMOSAIC_PADDED_WIDTH;
+    //x0 is even, lane k has the parity of k
+    demosaic_v4 is_green;
+    for (k=0; k<DEMOSAIC_LANES; k++){
+      is_green[k] = ((k + py) & 1) == green_parity;
+    }
+    for (px=x0; px + DEMOSAIC_LANES <= x1; px += DEMOSAIC_LANES){
+      demosaic_v4 v = demosaic_load (c + px);
+      demosaic_v4 interpolated = demosaic_green (c + px, mode);
+      demosaic_store (g + px, is_green*v + (1.0f - is_green)*interpolated);
+    }
+    for (; px<x1; px++){
+      float interpolated[DEMOSAIC_LANES];
+      demosaic_store (interpolated, demosaic_green (c + px, mode));
+      g[px] = ((px + py) & 1) == green_parity ? c[px] : interpolated[0];
+    }
+  }
+}
+
+//Writes a row interleaved, transformed by the colour matrix on the way
+static void demosaic_interleave (
+				 const float* red,
+				 const float* green,
+				 const float* blue,
+				 int width,
+				 const float* matrix,
+				 float* out){
+  int k, lane;
+  for (k=0; k<width; k += DEMOSAIC_LANES){
+    demosaic_v4 r = demosaic_load (red + k);
+    demosaic_v4 g = demosaic_load (green + k);
+    demosaic_v4 b = demosaic_load (blue + k);
+    if (matrix){
+      demosaic_v4 r0 = r, g0 = g, b0 = b;
+      r = matrix[0]*r0 + matrix[1]*g0 + matrix[2]*b0;
+      g = matrix[3]*r0 + matrix[4]*g0 + matrix[5]*b0;
+      b = matrix[6]*r0 + matrix[7]*g0 + matrix[8]*b0;
+    }
+    int lanes = width - k < DEMOSAIC_LANES ? width - k : DEMOSAIC_LANES;
+    for (lane=0; lane<lanes; lane++){
+      out[3*(k + lane)] = r[lane];
+      out[3*(k + lane) + 1] = g[lane];
+      out[3*(k + lane) + 2] = b[lane];
+    }
+  }
+}
+
+//Red and blue of the tile, written interleaved with green to rgb. With the
+//edge mode the colour differences to green are interpolated, with bilinear
+//the samples themselves (base is 0)
+static void demosaic_colour_pass (
+				  const float* tile,
+				  const float* green,
+				  int tw,
+				  int th,
+				  cfa_t order,
+				  demosaic_mode_t mode,
+				  const float* matrix,
+				  float* rgb,
+				  int rgb_stride){
+  const int s = DEMOSAIC_PADDED_WIDTH;
+  float base_weight = mode == DEMOSAIC_EDGE ? 1.0f : 0.0f;
+  float out_x[DEMOSAIC_TILE_WIDTH + DEMOSAIC_LANES];
+  float out_y[DEMOSAIC_TILE_WIDTH + DEMOSAIC_LANES];
+  int px, py, k;
+
+  for (py=DEMOSAIC_BORDER; py<DEMOSAIC_BORDER + th; py++){
+    //The colour sampled in this row (x) and the one of the rows around (y)
+    int red_row = (py & 1) == ((order >> 1) & 1);
+    int x_column = red_row ? order & 1 : !(order & 1);
+    demosaic_v4 is_x;
+    for (k=0; k<DEMOSAIC_LANES; k++) is_x[k] = (k & 1) == x_column;
+    demosaic_v4 is_g = 1.0f - is_x;
+
+    const float* c = tile + py*s;
+    const float* g = green + py*s;
+    //The vectors may run past the tile into the border, never past the
+    //padded row
+    for (px=DEMOSAIC_BORDER; px<DEMOSAIC_BORDER + tw; px += DEMOSAIC_LANES){
+      const float* cp = c + px;
+      const float* gp = g + px;
+#define DIFF(o) (demosaic_load (cp + (o)) - base_weight*demosaic_load (gp + (o)))
+      demosaic_v4 base = base_weight*demosaic_load (gp);
+      demosaic_v4 horizontal = (DIFF (-1) + DIFF (1))*0.5f;
+      demosaic_v4 vertical = (DIFF (-s) + DIFF (s))*0.5f;
+      demosaic_v4 diagonal = (DIFF (-s - 1) + DIFF (-s + 1) + DIFF (s - 1) +
+			      DIFF (s + 1))*0.25f;
+#undef DIFF
+      demosaic_v4 x = is_x*demosaic_load (cp) + is_g*(base + horizontal);
+      demosaic_v4 y = is_x*(base + diagonal) + is_g*(base + vertical);
+      if (mode == DEMOSAIC_EDGE){
+	//Differences to an overshooting green too
+	x = (x + demosaic_abs (x))*0.5f;
+	y = (y + demosaic_abs (y))*0.5f;
+      }
+      demosaic_store (out_x + px - DEMOSAIC_BORDER, x);
+      demosaic_store (out_y + px - DEMOSAIC_BORDER, y);
+    }
+
+    const float* red = red_row ? out_x : out_y;
+    const float* blue = red_row ? out_y : out_x;
+    demosaic_interleave (red, g + DEMOSAIC_BORDER, blue, tw, matrix,
+			 rgb + (size_t)(py - DEMOSAIC_BORDER)*rgb_stride);
+  }
+}
+
+static void* demosaic_band (void* arg){
+  demosaic_band_t* band = arg;
+  //Cleared, the vectors at the right edge of a narrow tile read a few samples
+  //past it
+  float* tile = budget_calloc (BUDGET_DEMOSAIC,
+			       2*DEMOSAIC_PADDED_WIDTH*DEMOSAIC_PADDED_HEIGHT,
+			       sizeof (float));
+  if (!tile){
+    fprintf (stderr, "error: demosaic: out of memory\n");
+    exit (1);
+  }
+  float* green = tile + DEMOSAIC_PADDED_WIDTH*DEMOSAIC_PADDED_HEIGHT;
+  int x, y;
+  for (y=band->top; y<band->bottom; y += DEMOSAIC_TILE_HEIGHT){
+    int th = band->bottom - y;
+    if (th > DEMOSAIC_TILE_HEIGHT) th = DEMOSAIC_TILE_HEIGHT;
+    for (x=0; x<band->width; x += DEMOSAIC_TILE_WIDTH){
+      int tw = band->width - x;
+      if (tw > DEMOSAIC_TILE_WIDTH) tw = DEMOSAIC_TILE_WIDTH;
+      demosaic_load_tile (band, x, y, tw, th, tile);
+      demosaic_green_pass (tile, green, tw, th, band->order, band->mode);
+      demosaic_colour_pass (tile, green, tw, th, band->order, band->mode,
+			    band->matrix, band->rgb + 3*((size_t)y*band->width + x),
+			    3*band->width);
+    }
+  }
+  budget_free (tile);
+  return NULL;
+}
+
+//cfa holds one sample per pixel in the given order, rgb receives 3
+//interleaved floats per pixel. width and height must be even. matrix is the
+//row major colour transform of the output (see colour.h), applied in the same
+//pass, NULL for camera RGB. Negative results are kept, they are colours
+//outside the gamut and not noise
+void demosaic (
+	       const float* cfa,
+	       int width,
+	       int height,
+	       cfa_t order,
+	       demosaic_mode_t mode,
+	       const float* matrix,
+	       int threads,
+	       float* rgb){
+  demosaic_band_t bands[DEMOSAIC_MAX_THREADS];
+  pthread_t ids[DEMOSAIC_MAX_THREADS];
+  int i;
+
+  if ((width & 1) || (height & 1)){
+    fprintf (stderr, "error: demosaic: %ix%i is not even\n", width, height);
+    exit (1);
+  }
+  if (threads < 1) threads = 1;
+  if (threads > DEMOSAIC_MAX_THREADS) threads = DEMOSAIC_MAX_THREADS;
+  //Bands start on even rows to keep the CFA order
+  int rows = ((height/2 + threads - 1)/threads)*2;
+
+  for (i=0; i<threads; i++){
+    bands[i].cfa = cfa;
+    bands[i].width = width;
+    bands[i].height = height;
+    bands[i].order = order;
+    bands[i].mode = mode;
+    bands[i].matrix = matrix;
+    bands[i].rgb = rgb;
+    bands[i].top = i*rows < height ? i*rows : height;
+    bands[i].bottom = (i + 1)*rows < height ? (i + 1)*rows : height;
+  }
+  //The calling thread takes the first band
+  for (i=1; i<threads; i++){
+    if (role_spawn (&ids[i], ROLE_POOL, demosaic_band, &bands[i])){
+      fprintf (stderr, "error: demosaic: pthread_create\n");
+      exit (1);
+    }
+  }
+  demosaic_band (&bands[0]);
+  for (i=1; i<threads; i++) pthread_join (ids[i], NULL);
+}
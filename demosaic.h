@@ -0,0 +1,32 @@
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include "raw.h"
+
+//Each thread works on a band of rows, tile by tile. A tile and its border
+//stay in L1/L2 while all passes run over it
+#define DEMOSAIC_TILE_WIDTH 256
+#define DEMOSAIC_TILE_HEIGHT 32
+#define DEMOSAIC_MAX_THREADS 16
+
+typedef enum {
+  //Average of the nearest samples of each colour
+  DEMOSAIC_BILINEAR,
+  //Green along the direction of the smaller gradient with a Laplacian
+  //correction, red and blue from the colour differences to green
+  DEMOSAIC_EDGE
+} demosaic_mode_t;
+
+int demosaic_parse_mode (const char* name, demosaic_mode_t* mode);
+const char* demosaic_mode_name (demosaic_mode_t mode);
+void demosaic (
+	       const float* cfa,
+	       int width,
+	       int height,
+	       cfa_t order,
+	       demosaic_mode_t mode,
+	       const float* matrix,
+	       int threads,
+	       float* rgb);
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "exif.h"
+#include "dump.h"
+#include "omx.h"
+
+void exif_init (exif_t* exif, OMX_HANDLETYPE handle, OMX_U32 port){
+  exif->handle = handle;
+  exif->port = port;
+  exif->count = 0;
+}
+
+//See firmware/documentation/ilcomponents/image_decode.html for valid keys
+int exif_add (exif_t* exif, const char* key){
+  int key_length = strlen (key);
+  if (exif->count == EXIF_MAX_ITEMS ||
+      key_length > sizeof (exif->items[0].metadata_st.nKey)){
+    fprintf (stderr, "error: exif_add: %s\n", key);
+    exit (1);
+  }
+
+  exif_item_t* item = &exif->items[exif->count];
+  OMX_INIT_STRUCTURE (item->metadata_st);
+  item->metadata_st.nSize = offsetof (exif_item_t, dirty);
+  item->metadata_st.eScopeMode = OMX_MetadataScopePortLevel;
+  item->metadata_st.nScopeSpecifier = exif->port;
+  item->metadata_st.eKeyCharset = OMX_MetadataCharsetASCII;
+  item->metadata_st.nKeySizeUsed = key_length;
+  memcpy (item->metadata_st.nKey, key, key_length);
+  item->metadata_st.eValueCharset = OMX_MetadataCharsetASCII;
+  item->metadata_st.nValueMaxSize = sizeof (item->metadata_padding);
+  item->metadata_st.nValueSizeUsed = 0;
+  item->dirty = 0;
+
+  return exif->count++;
+}
+
+void exif_set (exif_t* exif, int index, const char* value){
+  exif_item_t* item = &exif->items[index];
+  char* current = (char*)item->metadata_st.nValue;
+  int value_length = strlen (value);
+  if (value_length > sizeof (item->metadata_padding)){
+    fprintf (stderr, "error: exif_set: %s too long\n", value);
+    exit (1);
+  }
+  if (value_length == item->metadata_st.nValueSizeUsed &&
+      !memcmp (current, value, value_length)){
+    return;
+  }
+  memcpy (current, value, value_length);
+  item->metadata_st.nValueSizeUsed = value_length;
+  item->dirty = 1;
+}
+
+//Returns the number of items pushed
+int exif_commit (exif_t* exif){
+  OMX_ERRORTYPE error;
+  int pushed = 0;
+  int i;
+  for (i=0; i<exif->count; i++){
+    exif_item_t* item = &exif->items[i];
+    if (!item->dirty) continue;
+    if ((error = OMX_SetConfig (exif->handle, OMX_IndexConfigMetadataItem,
+				&item->metadata_st))){
+      fprintf (stderr, "error: OMX_SetConfig %.*s: %s\n",
+	       item->metadata_st.nKeySizeUsed, item->metadata_st.nKey,
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+    item->dirty = 0;
+    pushed++;
+  }
+  return pushed;
+}
@@ -0,0 +1,34 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <stddef.h>
+#include <IL/OMX_Broadcom.h>
+
+#define EXIF_MAX_ITEMS 16
+//Longest value of an item, e.g. "YYYY:MM:DD HH:MM:SS"
+#define EXIF_VALUE_SIZE 32
+
+//An OMX_IndexConfigMetadataItem blob, built once with its key. Only the value
+//is rewritten and only when it changes
+typedef struct {
+  //These two fields need to be together
+  OMX_CONFIG_METADATAITEMTYPE metadata_st;
+  char metadata_padding[EXIF_VALUE_SIZE];
+  int dirty;
+} exif_item_t;
+
+//Metadata items of the encoder output port. Values are staged with exif_set()
+//and the changed ones are pushed together by exif_commit() once per capture
+typedef struct {
+  OMX_HANDLETYPE handle;
+  OMX_U32 port;
+  int count;
+  exif_item_t items[EXIF_MAX_ITEMS];
+} exif_t;
+
+void exif_init (exif_t* exif, OMX_HANDLETYPE handle, OMX_U32 port);
+int exif_add (exif_t* exif, const char* key);
+void exif_set (exif_t* exif, int item, const char* value);
+int exif_commit (exif_t* exif);
+
+#endif
@@ -0,0 +1,260 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fusion.h"
+#include "budget.h"
+
+//Keeps the weights of frames that are bad everywhere from summing to 0
+#define FUSION_EPSILON 1e-12f
+
+static float* fusion_alloc (size_t floats){
+  float* p = budget_calloc (BUDGET_FUSION, floats, sizeof (float));
+  if (!p){
+    fprintf (stderr, "error: fusion: out of memory\n");
+    exit (1);
+  }
+  return p;
+}
+
+//Sizes the levels without allocating them
+static void fusion_plan (fusion_t* fusion, int width, int height){
+  memset (fusion, 0, sizeof (*fusion));
+  fusion->width = width;
+  fusion->height = height;
+  while (fusion->levels < FUSION_MAX_LEVELS && width >= FUSION_MIN_SIZE &&
+	 height >= FUSION_MIN_SIZE){
+    fusion->widths[fusion->levels] = width;
+    fusion->heights[fusion->levels] = height;
+    fusion->levels++;
+    width = (width + 1)/2;
+    height = (height + 1)/2;
+  }
+  if (!fusion->levels){
+    fprintf (stderr, "error: fusion: %ix%i is too small\n", fusion->width,
+	     fusion->height);
+    exit (1);
+  }
+}
+
+void fusion_init (fusion_t* fusion, int width, int height){
+  int i;
+  fusion_plan (fusion, width, height);
+  for (i=0; i<fusion->levels; i++){
+    size_t pixels = (size_t)fusion->widths[i]*fusion->heights[i];
+    fusion->result[i] = fusion_alloc (3*pixels);
+    fusion->weight_sum[i] = fusion_alloc (pixels);
+    fusion->image[i] = fusion_alloc (3*pixels);
+    fusion->weight[i] = fusion_alloc (pixels);
+  }
+}
+
+void fusion_free (fusion_t* fusion){
+  int i;
+  for (i=0; i<fusion->levels; i++){
+    budget_free (fusion->result[i]);
+    budget_free (fusion->weight_sum[i]);
+    budget_free (fusion->image[i]);
+    budget_free (fusion->weight[i]);
+  }
+}
+
+size_t fusion_memory (const fusion_t* fusion){
+  size_t floats = 0;
+  int i;
+  for (i=0; i<fusion->levels; i++){
+    floats += 8*(size_t)fusion->widths[i]*fusion->heights[i];
+  }
+  return floats*sizeof (float);
+}
+
+//What fusion_init() allocates for a frame of this size, so it can be checked
+//against the budget before the series is captured
+size_t fusion_size (int width, int height){
+  fusion_t fusion;
+  fusion_plan (&fusion, width, height);
+  return fusion_memory (&fusion);
+}
+
+static inline int fusion_clamp (int i, int n){
+  return i < 0 ? 0 : i >= n ? n - 1 : i;
+}
+
+//5 tap binomial filter and decimation by 2 in both directions
+static void fusion_down (
+			 const float* src,
+			 int width,
+			 int height,
+			 int channels,
+			 float* dst,
+			 int dst_width,
+			 int dst_height){
+  static const float k[5] = { 1/16.0f, 4/16.0f, 6/16.0f, 4/16.0f, 1/16.0f };
+  int x, y, c, i;
+  for (y=0; y<dst_height; y++){
+    //Vertical pass over the 5 source columns, then horizontal into dst
+    float tmp[5][3];
+    for (x=0; x<dst_width; x++){
+      for (i=0; i<5; i++){
+	int sx = fusion_clamp (2*x + i - 2, width);
+	for (c=0; c<channels; c++){
+	  float sum = 0;
+	  int j;
+	  for (j=0; j<5; j++){
+	    int sy = fusion_clamp (2*y + j - 2, height);
+	    sum += k[j]*src[((size_t)sy*width + sx)*channels + c];
+	  }
+	  tmp[i][c] = sum;
+	}
+      }
+      for (c=0; c<channels; c++){
+	float sum = 0;
+	for (i=0; i<5; i++) sum += k[i]*tmp[i][c];
+	dst[((size_t)y*dst_width + x)*channels + c] = sum;
+      }
+    }
+  }
+}
+
+//Upsamples a level to the size of the one below (bilinear on the centres of
+//the samples) and subtracts it from dst, which turns a Gaussian level into a
+//Laplacian one. sign -1 adds instead, for the collapse
+static void fusion_up (
+		       const float* src,
+		       int src_width,
+		       int src_height,
+		       float* dst,
+		       int width,
+		       int height,
+		       float sign){
+  int x, y, c;
+  for (y=0; y<height; y++){
+    float fy = (y - 0.5f)*0.5f;
+    int y0 = floorf (fy);
+    float ay = fy - y0;
+    int ya = fusion_clamp (y0, src_height), yb = fusion_clamp (y0 + 1, src_height);
+    for (x=0; x<width; x++){
+      float fx = (x - 0.5f)*0.5f;
+      int x0 = floorf (fx);
+      float ax = fx - x0;
+      int xa = fusion_clamp (x0, src_width), xb = fusion_clamp (x0 + 1, src_width);
+      const float* p00 = src + 3*((size_t)ya*src_width + xa);
+      const float* p01 = src + 3*((size_t)ya*src_width + xb);
+      const float* p10 = src + 3*((size_t)yb*src_width + xa);
+      const float* p11 = src + 3*((size_t)yb*src_width + xb);
+      float* d = dst + 3*((size_t)y*width + x);
+      for (c=0; c<3; c++){
+	float v = (1 - ay)*((1 - ax)*p00[c] + ax*p01[c]) +
+	  ay*((1 - ax)*p10[c] + ax*p11[c]);
+	d[c] -= sign*v;
+      }
+    }
+  }
+}
+
+static inline float fusion_grey (const float* image, int width, int height,
+				 int x, int y){
+  const float* p = image + 3*((size_t)fusion_clamp (y, height)*width +
+			      fusion_clamp (x, width));
+  return (p[0] + p[1] + p[2])*(1/3.0f);
+}
+
+//Contrast (Laplacian of the grey image), saturation (deviation of the
+//channels) and well-exposedness (closeness to 0.5), multiplied
+static void fusion_weights (const fusion_t* fusion, float* weight){
+  const float* image = fusion->image[0];
+  int width = fusion->width, height = fusion->height;
+  float s2 = 2*FUSION_SIGMA*FUSION_SIGMA;
+  int x, y, c;
+  for (y=0; y<height; y++){
+    for (x=0; x<width; x++){
+      const float* p = image + 3*((size_t)y*width + x);
+      float mean = (p[0] + p[1] + p[2])*(1/3.0f);
+      float contrast = fabsf (fusion_grey (image, width, height, x - 1, y) +
+			      fusion_grey (image, width, height, x + 1, y) +
+			      fusion_grey (image, width, height, x, y - 1) +
+			      fusion_grey (image, width, height, x, y + 1) -
+			      4*mean);
+      float variance = 0, exposedness = 1;
+      for (c=0; c<3; c++){
+	variance += (p[c] - mean)*(p[c] - mean);
+	exposedness *= expf (-(p[c] - 0.5f)*(p[c] - 0.5f)/s2);
+      }
+      weight[(size_t)y*width + x] = contrast*sqrtf (variance/3)*exposedness +
+	FUSION_EPSILON;
+    }
+  }
+}
+
+//rgb is 8 bit, 3 bytes per pixel, rows stride bytes apart
+void fusion_add (fusion_t* fusion, const unsigned char* rgb, int stride){
+  int x, y, i;
+  float* image = fusion->image[0];
+  for (y=0; y<fusion->height; y++){
+    const unsigned char* in = rgb + (size_t)y*stride;
+    float* out = image + 3*(size_t)y*fusion->width;
+    for (x=0; x<3*fusion->width; x++) out[x] = in[x]*(1/255.0f);
+  }
+  fusion_weights (fusion, fusion->weight[0]);
+
+  //Gaussian pyramids, then the image one turned into a Laplacian one from the
+  //bottom up, each level still needs the Gaussian level above it
+  for (i=1; i<fusion->levels; i++){
+    fusion_down (fusion->image[i - 1], fusion->widths[i - 1],
+		 fusion->heights[i - 1], 3, fusion->image[i], fusion->widths[i],
+		 fusion->heights[i]);
+    fusion_down (fusion->weight[i - 1], fusion->widths[i - 1],
+		 fusion->heights[i - 1], 1, fusion->weight[i], fusion->widths[i],
+		 fusion->heights[i]);
+  }
+  for (i=0; i<fusion->levels - 1; i++){
+    fusion_up (fusion->image[i + 1], fusion->widths[i + 1],
+	       fusion->heights[i + 1], fusion->image[i], fusion->widths[i],
+	       fusion->heights[i], 1);
+  }
+
+  for (i=0; i<fusion->levels; i++){
+    size_t p, pixels = (size_t)fusion->widths[i]*fusion->heights[i];
+    const float* l = fusion->image[i];
+    const float* w = fusion->weight[i];
+    float* r = fusion->result[i];
+    float* s = fusion->weight_sum[i];
+    for (p=0; p<pixels; p++){
+      r[3*p] += w[p]*l[3*p];
+      r[3*p + 1] += w[p]*l[3*p + 1];
+      r[3*p + 2] += w[p]*l[3*p + 2];
+      s[p] += w[p];
+    }
+  }
+  fusion->frames++;
+}
+
+//Normalises each level, collapses the pyramid and writes 8 bit RGB
+void fusion_finish (fusion_t* fusion, unsigned char* out, int stride){
+  int x, y, i;
+  for (i=0; i<fusion->levels; i++){
+    size_t p, pixels = (size_t)fusion->widths[i]*fusion->heights[i];
+    float* r = fusion->result[i];
+    const float* s = fusion->weight_sum[i];
+    for (p=0; p<pixels; p++){
+      float norm = s[p] > 0 ? 1/s[p] : 0;
+      r[3*p] *= norm;
+      r[3*p + 1] *= norm;
+      r[3*p + 2] *= norm;
+    }
+  }
+  for (i=fusion->levels - 2; i>=0; i--){
+    fusion_up (fusion->result[i + 1], fusion->widths[i + 1],
+	       fusion->heights[i + 1], fusion->result[i], fusion->widths[i],
+	       fusion->heights[i], -1);
+  }
+  for (y=0; y<fusion->height; y++){
+    const float* in = fusion->result[0] + 3*(size_t)y*fusion->width;
+    unsigned char* o = out + (size_t)y*stride;
+    for (x=0; x<3*fusion->width; x++){
+      float v = in[x]*255 + 0.5f;
+      o[x] = v <= 0 ? 0 : v >= 255 ? 255 : v;
+    }
+  }
+}
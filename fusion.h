@@ -0,0 +1,40 @@
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stddef.h>
+
+//Levels stop when the smaller side gets below this
+#define FUSION_MIN_SIZE 8
+#define FUSION_MAX_LEVELS 12
+//Spread of the well-exposedness weight around 0.5
+#define FUSION_SIGMA 0.2f
+
+//Streaming Mertens exposure fusion. Each frame is turned into a Laplacian
+//pyramid and a Gaussian pyramid of its weights, which are accumulated and
+//dropped before the next frame is added. The weights are normalised per
+//level when the result is collapsed instead of per pixel up front, so the
+//frames do not have to be known in advance. Memory does not depend on the
+//number of frames
+typedef struct {
+  int width;
+  int height;
+  int levels;
+  int widths[FUSION_MAX_LEVELS];
+  int heights[FUSION_MAX_LEVELS];
+  //Sum of weight*Laplacian (RGB) and of the weights, per level
+  float* result[FUSION_MAX_LEVELS];
+  float* weight_sum[FUSION_MAX_LEVELS];
+  //Pyramids of the frame being added
+  float* image[FUSION_MAX_LEVELS];
+  float* weight[FUSION_MAX_LEVELS];
+  int frames;
+} fusion_t;
+
+void fusion_init (fusion_t* fusion, int width, int height);
+void fusion_free (fusion_t* fusion);
+size_t fusion_memory (const fusion_t* fusion);
+size_t fusion_size (int width, int height);
+void fusion_add (fusion_t* fusion, const unsigned char* rgb, int stride);
+void fusion_finish (fusion_t* fusion, unsigned char* out, int stride);
+
+#endif
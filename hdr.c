@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hdr.h"
+#include "budget.h"
+#include "raw.h"
+
+void hdr_init (hdr_t* hdr, int width, int height){
+  size_t n = (size_t)width*height;
+  hdr->width = width;
+  hdr->height = height;
+  hdr->signal = budget_calloc (BUDGET_MERGE, n, sizeof (float));
+  hdr->time = budget_calloc (BUDGET_MERGE, n, sizeof (float));
+  if (!hdr->signal || !hdr->time){
+    fprintf (stderr, "error: hdr_init: out of memory\n");
+    exit (1);
+  }
+}
+
+void hdr_free (hdr_t* hdr){
+  budget_free (hdr->signal);
+  budget_free (hdr->time);
+  hdr->signal = hdr->time = NULL;
+}
+
+//The raw data is linear, so the maximum likelihood estimate of the radiance
+//of a pixel is the sum of its photo counts divided by the sum of the exposure
+//times of the frames where it is neither underexposed nor clipped
+void hdr_add (hdr_t* hdr, const unsigned short* pixels, int exposure){
+  size_t n = (size_t)hdr->width*hdr->height;
+  float t = exposure + HDR_EXPOSURE_OFFSET;
+  size_t i;
+  for (i=0; i<n; i++){
+    int v = pixels[i] - RAW_BLACK_LEVEL;
+    int valid = v >= HDR_MIN_SIGNAL && pixels[i] < RAW_WHITE_LEVEL;
+    hdr->signal[i] += valid ? v : 0;
+    hdr->time[i] += valid ? t : 0;
+  }
+}
+
+//Radiance in counts per microsecond. Pixels without any valid sample are 0
+void hdr_radiance (hdr_t* hdr, float* radiance){
+  size_t n = (size_t)hdr->width*hdr->height;
+  size_t i;
+  for (i=0; i<n; i++){
+    radiance[i] = hdr->time[i] > 0 ? hdr->signal[i]/hdr->time[i] : 0;
+  }
+}
+
+//Portable float map, channels is 1 (Pf, grey) or 3 (PF, interleaved RGB).
+//Rows are stored bottom to top
+void hdr_write_pfm (
+		    const char* filename,
+		    int width,
+		    int height,
+		    int channels,
+		    const float* data){
+  FILE* f = fopen (filename, "wb");
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  //Negative scale means little endian
+  fprintf (f, "%s\n%d %d\n-1.0\n", channels == 3 ? "PF" : "Pf", width,
+	   height);
+  size_t row = (size_t)width*channels;
+  int y;
+  for (y=height - 1; y>=0; y--){
+    if (fwrite (data + y*row, sizeof (float), row, f) != row){
+      fprintf (stderr, "error: fwrite %s\n", filename);
+      exit (1);
+    }
+  }
+  if (fclose (f)){
+    fprintf (stderr, "error: fclose %s\n", filename);
+    exit (1);
+  }
+}
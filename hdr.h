@@ -0,0 +1,31 @@
+#ifndef HDR_H
+#define HDR_H
+
+//The reported exposure time is off by this amount, see docs/README.md
+#define HDR_EXPOSURE_OFFSET 16 //us
+//Values below black+HDR_MIN_SIGNAL are too noisy to contribute
+#define HDR_MIN_SIGNAL 2
+
+//Streaming radiance merge. The frames of a series are added one by one, only
+//the accumulators of the ROI are resident
+typedef struct {
+  int width;
+  int height;
+  //Sum of the black-corrected signal of the valid samples
+  float* signal;
+  //Sum of the exposure times of the valid samples
+  float* time;
+} hdr_t;
+
+void hdr_init (hdr_t* hdr, int width, int height);
+void hdr_free (hdr_t* hdr);
+void hdr_add (hdr_t* hdr, const unsigned short* pixels, int exposure);
+void hdr_radiance (hdr_t* hdr, float* radiance);
+void hdr_write_pfm (
+		    const char* filename,
+		    int width,
+		    int height,
+		    int channels,
+		    const float* data);
+
+#endif
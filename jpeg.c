@@ -29,9 +29,15 @@
 */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bcm_host.h>
 #include <interface/vcos/vcos.h>
@@ -39,17 +45,33 @@
 
 #include <sys/types.h>
 #include "dump.h"
+#include "omx.h"
+#include "exif.h"
+#include "raw.h"
+#include "hdr.h"
+#include "arena.h"
+#include "meta.h"
+#include "jpegindex.h"
+#include "thumbs.h"
+#include "stats.h"
+#include "bracket.h"
+#include "demosaic.h"
+#include "colour.h"
+#include "tonemap.h"
+#include "fusion.h"
+#include "align.h"
+#include "deghost.h"
+#include "response.h"
+#include "dark.h"
+#include "defect.h"
+#include "stack.h"
+#include "compress.h"
+#include "ring.h"
+#include "schedule.h"
+#include "role.h"
+#include "budget.h"
 #include <sys/syscall.h>
 
-#define OMX_INIT_STRUCTURE(a)				\
-  memset (&(a), 0, sizeof (a));				\
-  (a).nSize = sizeof (a);				\
-  (a).nVersion.nVersion = OMX_VERSION;			\
-  (a).nVersion.s.nVersionMajor = OMX_VERSION_MAJOR;	\
-  (a).nVersion.s.nVersionMinor = OMX_VERSION_MINOR;	\
-  (a).nVersion.s.nRevision = OMX_VERSION_REVISION;	\
-  (a).nVersion.s.nStep = OMX_VERSION_STEP
-
 struct tm *tmp;
 
 #define JPEG_QUALITY 75 //1 .. 100
@@ -61,6 +83,9 @@ struct tm *tmp;
 #define JPEG_PREVIEW OMX_FALSE
 
 #define RAW_BAYER OMX_TRUE
+//Format of the still port in raw-only mode (-n), 10 bit packed like the BRCM
+//block appended to the JPEG
+#define RAW_ONLY_COLOR_FORMAT OMX_COLOR_FormatRawBayer10bit
 
 //Some settings doesn't work well
 #define CAM_WIDTH 3280
@@ -72,6 +97,11 @@ struct tm *tmp;
 #define CAM_SHUTTER_SPEED_AUTO OMX_FALSE
 //In microseconds, (1/8)*1e6
 #define CAM_SHUTTER_SPEED 1 //1 ..
+//Difference between the requested and the reported exposure that is still
+//the same exposure: relative, plus one line of the sensor in us it rounds
+//to. More means the reported settings belong to another frame
+#define CAM_EXPOSURE_TOLERANCE 0.1
+#define CAM_LINE_TIME 19
 #define CAM_ISO_AUTO OMX_FALSE
 #define CAM_ISO 54 //582 //100 .. 800
 #define CAM_EXPOSURE OMX_ExposureControlAuto
@@ -95,6 +125,67 @@ struct tm *tmp;
 #define CAM_ROI_HEIGHT 100 //0 .. 100
 #define CAM_DRC OMX_DynRangeExpOff
 
+//Number of frames of an exposure series
+#define SERIES_LENGTH 19
+//Frames of a series with every step stacked
+#define MAX_FRAMES (SERIES_LENGTH*STACK_MAX_FRAMES)
+
+//Demosaic of the merged radiance map
+#define DEMOSAIC_THREADS 4
+//Tone mapping of the demosaiced radiance map
+#define TONEMAP_THREADS 4
+//Alignment of the raw frames before the merge
+#define ALIGN_THREADS 4
+//Lossless compression of the raw frames
+#define COMPRESS_THREADS 4
+//A frame becomes the reference of the delta coded ones (-Z) if this share
+//of its samples is usable, at least DELTA_MIN_SIGNAL above black and below
+//white. Every DELTA_SAMPLE_STEP-th row is looked at
+#define DELTA_MIN_USABLE 0.5
+#define DELTA_MIN_SIGNAL 32
+#define DELTA_SAMPLE_STEP 8
+//Frame period of the sensor in us when the camera does not report its
+//framerate. In burst mode (-u) the steps shorter than a period are captured
+//without the camera leaving capture mode between them
+#define BURST_FRAME_PERIOD 33333
+//Rows per input slice when the tone mapped image is encoded
+#define ENCODE_SLICE_HEIGHT 16
+//Bytes per input buffer of image_decode, the JPEG is fed in chunks of this
+#define DECODE_CHUNK_SIZE (256*1024)
+
+//Frame slots handed to the output port with OMX_UseBuffer. A slot is large
+//enough for the JPEG plus the appended raw block (or a raw-only frame), so a
+//frame arrives in one buffer and is never copied. A frame is processed and
+//written before the next one is armed, so a second slot would never be
+//filled, only registered and pinned
+#define ARENA_SLOTS 1
+#define ARENA_SLOT_SIZE (16*1024*1024)
+
+//Streaming from the video port (-v): buffers handed to the port, framerate
+//unless -F is given, H.264 bitrate and seconds between its sync frames, so
+//a saved event loses at most that much of the start of its window
+#define STREAM_BUFFERS 4
+#define STREAM_FRAMERATE 30
+#define STREAM_BITRATE 17000000
+#define STREAM_INTRA_PERIOD 1
+//How long the writer waits for a buffer before it looks at the signals again
+#define STREAM_POLL_MS 50
+//Largest frame of the H.264 encoder
+#define STREAM_H264_MAX_WIDTH 1920
+#define STREAM_H264_MAX_HEIGHT 1080
+//Pre-trigger store (-P): entries it holds at most, how many times the bytes
+//of the bitrate an encoded stream is given for its peaks, and seconds of the
+//live stream still appended to an event after its trigger
+#define STREAM_RING_ENTRIES 65536
+#define STREAM_RING_HEADROOM 2
+#define STREAM_POST_TRIGGER 2
+
+//Time-lapse (-I): the bracket is thinned until its frames, at the time per
+//frame of the previous series, take at most this share of the interval
+#define SCHEDULE_BUDGET 0.9
+//One line per series of a time-lapse: slot, start jitter, stride, duration
+#define SCHEDULE_LOG "schedule.log"
+
 /*
   Possible values:
 
@@ -165,6 +256,9 @@ struct tm *tmp;
   OMX_DynRangeExpHigh
 */
 
+//Bits of component_event
+#define EVENT_BITS 14
+
 //Data of each component
 typedef struct {
   //The handle is obtained with OMX_GetHandle() and is used on every function
@@ -175,6 +269,9 @@ typedef struct {
   VCOS_EVENT_FLAGS_T flags;
   //The fullname of the component
   OMX_STRING name;
+  //When each event was last set, by its bit, for the wakeup latency of the
+  //waiter. Written by the callback threads under wake_lock
+  int64_t woken_ns[EVENT_BITS];
 } component_t;
 
 //Events used with vcos_event_flags_get() and vcos_event_flags_set()
@@ -207,6 +304,10 @@ OMX_ERRORTYPE FillBufferDone (
 			      OMX_IN OMX_HANDLETYPE hComponent,
 			      OMX_IN OMX_PTR pAppData,
 			      OMX_IN OMX_BUFFERHEADERTYPE* pBuffer);
+OMX_ERRORTYPE EmptyBufferDone (
+			       OMX_IN OMX_HANDLETYPE hComponent,
+			       OMX_IN OMX_PTR pAppData,
+			       OMX_IN OMX_BUFFERHEADERTYPE* pBuffer);
 void wake (component_t* component, VCOS_UNSIGNED event);
 void wait (
 	   component_t* component,
@@ -218,16 +319,279 @@ void load_camera_drivers (component_t* component);
 void change_state (component_t* component, OMX_STATETYPE state);
 void enable_port (component_t* component, OMX_U32 port);
 void disable_port (component_t* component, OMX_U32 port);
-void enable_encoder_output_port (
-				 component_t* encoder,
-				 OMX_BUFFERHEADERTYPE** encoder_output_buffer);
-void disable_encoder_output_port (
-				  component_t* encoder,
-				  OMX_BUFFERHEADERTYPE* encoder_output_buffer);
+void enable_output_port (
+			 component_t* component,
+			 OMX_U32 port,
+			 arena_t* arena,
+			 OMX_BUFFERHEADERTYPE** output_buffers);
+void disable_output_port (
+			  component_t* component,
+			  OMX_U32 port,
+			  arena_t* arena,
+			  OMX_BUFFERHEADERTYPE** output_buffers);
 void set_camera_settings (component_t* camera);
+void set_jpeg_quality (component_t* encoder);
 void set_jpeg_settings (component_t* encoder);
 
-void dump_cam_exp(component_t* camera)
+//Runtime settings, see usage()
+//ROI in percent of the sensor: left, top, width, height
+double roi_percentages[4] = {
+  CAM_ROI_LEFT, CAM_ROI_TOP, CAM_ROI_WIDTH, CAM_ROI_HEIGHT
+};
+//Merge the raw data of the series into a radiance map
+int merge_series = 0;
+//Capture the raw data from the still port without the encoder
+int raw_only = 0;
+//Back the frame arena with huge pages
+int huge_pages = 0;
+//Lock the frame arena and the pre-trigger store in RAM
+int lock_buffers = 0;
+//Memory the stages may use in MB, 0 for a share of what is available
+double memory_budget = 0;
+//Write a <frame>.meta sidecar next to every frame
+int write_sidecars = 0;
+//Stop or extend the series from the statistics of the frames
+int adaptive_bracketing = 0;
+//Also write the merged radiance map demosaiced to RGB
+int demosaic_merge = 0;
+demosaic_mode_t demosaic_mode;
+//Tone map the demosaiced radiance map to 8 bit, encode it with image_encode
+//instead of writing a PPM
+int tonemap_merge = 0;
+tonemap_operator_t tonemap_operator;
+int encode_tonemapped = 0;
+//Compensate camera motion between the frames before merging them
+int align_series = 0;
+//Reweight the merge against motion in a second pass over the frames
+int deghost_merge = 0;
+//Merge the JPEGs of the series into a radiance map through the response
+//curve, cached per camera settings. Solve the curve again even if cached
+int merge_jpegs = 0;
+int recalibrate_response = 0;
+//Average the frames (taken with the lens capped) into the dark frame
+//library, subtract the masters of the library before merging
+int dark_capture = 0;
+int dark_subtraction = 0;
+dark_library_t dark_library;
+//Full sensor frame of the dark capture
+unsigned short* dark_pixels;
+//Find the pixels of the ROI that are consistently hot or dead over the
+//series and record them in the defect map, correct the pixels of the map
+//before merging
+int defect_detection = 0;
+int defect_correction = 0;
+defect_map_t defect_map;
+defect_builder_t defect_builder;
+unsigned short* defect_pixels;
+//Capture every exposure step this many times and merge the mean of the raw
+//frames of the step, optionally sigma clipped
+int stack_frames = 1;
+int stack_clip = 0;
+stack_accumulator_t series_stack;
+//Archive the raw data of every frame losslessly compressed in
+//<frame>.rawz, in raw-only mode instead of the .raw file
+int compress_frames = 0;
+unsigned short* compress_pixels;
+//Code the frames against the first well exposed one of the series, scaled
+//by the exposure ratio, the reference is always coded on its own
+int delta_archive = 0;
+int delta_has_reference = 0;
+compress_reference_t delta_reference;
+unsigned short* delta_pixels;
+//Fuse the JPEGs of the series into <series>-fused.ppm (or .jpg with -j)
+int fuse_series = 0;
+//Capture the steps shorter than a frame period with the camera kept in
+//burst mode, the exposure changes between the frames
+int burst_capture = 0;
+int burst_enabled = 0;
+//Stream the video port instead of capturing a series, see streamVideo()
+typedef enum {
+  STREAM_NONE,
+  STREAM_RAW,
+  STREAM_H264,
+  STREAM_MJPEG
+} stream_mode_t;
+stream_mode_t stream_mode = STREAM_NONE;
+double stream_framerate = STREAM_FRAMERATE;
+//Seconds held in memory and saved when triggered, 0 writes everything
+double pre_trigger = 0;
+//Start a series every this many seconds on a fixed grid, this many times
+//(0 until stopped), with the component graph kept between them
+double series_interval = 0;
+int series_count = 0;
+//Slot of the series in progress, -1 outside a time-lapse. The names carry
+//it, the time in them has 1 s resolution and the interval can be shorter
+long long series_slot = -1;
+
+//ROI in sensor pixels, derived from roi_percentages. The camera crops to it,
+//the still and encoder ports are sized to it and the raw stages only unpack it
+roi_t roi;
+
+//Frames of the current series
+typedef struct {
+  char filename[255];
+  //Requested exposure in us
+  int exposure;
+  frame_meta_t meta;
+  //Fed with the encoder slices as they arrive
+  jpeg_parser_t parser;
+  //Exposure statistics of the raw data, adaptive bracketing only
+  raw_stats_t stats;
+  //Collected from the slices for the contact sheet
+  thumbs_entry_t thumbnail;
+  //Offset to the series in sensor pixels, see align.h
+  float align_dx;
+  float align_dy;
+  //Degrees Celsius when the frame arrived, key of the dark frames
+  int temperature;
+  //Masters of the dark frame library for the frame, looked up once
+  int dark_state;
+  dark_t dark;
+  //Captured in burst mode
+  int burst;
+} frame_t;
+frame_t frames[MAX_FRAMES];
+int frame_count = 0;
+char series_name[255];
+
+//Raw-only frames are handed to this callback as soon as they are complete. The
+//data belongs to the camera and is only valid during the call
+typedef void (*frame_consumer_t) (
+				  frame_t* frame,
+				  const OMX_U8* data,
+				  OMX_U32 size);
+void consumeRawFrame (frame_t* frame, const OMX_U8* data, OMX_U32 size);
+frame_consumer_t frame_consumer = consumeRawFrame;
+//Bytes per packed row delivered by the still port in raw-only mode
+int raw_only_stride;
+//The still port delivers the ROI only
+roi_t raw_only_roi;
+
+//EXIF items of the encoder, see set_jpeg_settings()
+exif_t jpeg_exif;
+int exif_datetime;
+int exif_datetime_original;
+int exif_exposure;
+int exif_iso;
+
+//Per-frame metadata of the series, see meta.h
+FILE* series_index;
+//Contact sheet <series>.thumbs with the embedded thumbnail of every JPEG
+FILE* series_thumbs;
+//Latest camera settings. Refreshed from the event handler whenever the camera
+//reports a change, so the capture loop only copies them
+OMX_CONFIG_CAMERASETTINGSTYPE cam_settings;
+pthread_mutex_t cam_settings_lock = PTHREAD_MUTEX_INITIALIZER;
+//Read once during setup
+OMX_U32 preview_framerate;
+OMX_U32 sensor_mode;
+//Model, revision and serial number of the camera module, part of the key of
+//the cached response curve
+char camera_identity[96] = "unknown";
+
+//Frames per second achieved in either capture mode, from a capture being
+//armed to its EOS, so the processing between the frames does not count.
+//The one-shot frames shorter than a frame period are the ones burst mode
+//would take, run without -u to compare the two on the same steps
+typedef struct {
+  int frames;
+  int64_t ns;
+} capture_rate_t;
+capture_rate_t burst_rate;
+capture_rate_t oneshot_short_rate;
+capture_rate_t oneshot_long_rate;
+
+//Buffers filled by the streaming port, in the order they arrived. The port
+//never has more than STREAM_BUFFERS, so the queue cannot overflow
+typedef struct {
+  OMX_BUFFERHEADERTYPE* buffers[STREAM_BUFFERS];
+  int first;
+  int count;
+  //When the last buffer came, for the wakeup latency of the writer
+  int64_t pushed_ns;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+} stream_queue_t;
+stream_queue_t stream_queue = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .filled = PTHREAD_COND_INITIALIZER
+};
+//Component whose filled buffers go to the queue instead of waking a waiter
+component_t* stream_source = NULL;
+//Set by SIGINT or SIGTERM to end the stream or the time-lapse, and by
+//SIGUSR1 to save the pre-trigger store
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t trigger_requested = 0;
+
+void handleSignal(int number)
+{
+  if (number == SIGUSR1) trigger_requested = 1;
+  else stop_requested = 1;
+}
+
+void streamPush(OMX_BUFFERHEADERTYPE* buffer)
+{
+  pthread_mutex_lock(&stream_queue.lock);
+  stream_queue.buffers[(stream_queue.first + stream_queue.count++)%
+                       STREAM_BUFFERS] = buffer;
+  stream_queue.pushed_ns = meta_now(CLOCK_MONOTONIC);
+  pthread_cond_signal(&stream_queue.filled);
+  pthread_mutex_unlock(&stream_queue.lock);
+}
+
+//Next filled buffer, NULL if a signal came or none was filled within
+//STREAM_POLL_MS. The handler cannot signal the condition, so the wait is
+//bounded to see the signals while the port is slow or stalled
+OMX_BUFFERHEADERTYPE* streamPop()
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += STREAM_POLL_MS*1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&stream_queue.lock);
+  int waited = !stream_queue.count;
+  while (!stream_queue.count && !stop_requested && !trigger_requested &&
+         !pthread_cond_timedwait(&stream_queue.filled, &stream_queue.lock,
+                                 &deadline));
+  if (!stream_queue.count) {
+    pthread_mutex_unlock(&stream_queue.lock);
+    return NULL;
+  }
+  if (waited)
+    role_wakeup(ROLE_CONTROL,
+                meta_now(CLOCK_MONOTONIC) - stream_queue.pushed_ns);
+  OMX_BUFFERHEADERTYPE* buffer = stream_queue.buffers[stream_queue.first];
+  stream_queue.first = (stream_queue.first + 1)%STREAM_BUFFERS;
+  stream_queue.count--;
+  pthread_mutex_unlock(&stream_queue.lock);
+  return buffer;
+}
+
+//Reads what identifies the camera module once the drivers are loaded. The
+//serial number is empty on modules without an EEPROM, those are only told
+//apart by model and revision
+void readCameraIdentity(component_t* camera)
+{
+  OMX_ERRORTYPE error;
+  OMX_CONFIG_CAMERAINFOTYPE info;
+  OMX_INIT_STRUCTURE (info);
+  if ((error = OMX_GetConfig (camera->handle, OMX_IndexConfigCameraInfo,
+                              &info))){
+    printf("no camera info (%s), the response curve is not keyed by the "
+           "camera\n", dump_OMX_ERRORTYPE (error));
+    return;
+  }
+  snprintf(camera_identity, sizeof (camera_identity), "%.*s %i %i %.*s",
+           (int)sizeof (info.cameraname), (const char*)info.cameraname,
+           info.nModelId, info.nRevNum,
+           (int)sizeof (info.sSerialNumber), (const char*)info.sSerialNumber);
+  printf("camera %s\n", camera_identity);
+}
+
+void update_cam_settings(component_t* camera)
 {
   OMX_ERRORTYPE error;
   OMX_CONFIG_CAMERASETTINGSTYPE camconfig;
@@ -239,6 +603,9 @@ void dump_cam_exp(component_t* camera)
              dump_OMX_ERRORTYPE (error));
     exit (1);
   }
+  pthread_mutex_lock (&cam_settings_lock);
+  cam_settings = camconfig;
+  pthread_mutex_unlock (&cam_settings_lock);
   printf("| exp    | analog gain | digital gain | lux | AWB R | AWB B | focus |\n");
   printf("| %6i | %5i       | %5i        | %3i | %3i   | %3i   | %3i   |\n",
          camconfig.nExposure, camconfig.nAnalogGain, camconfig.nDigitalGain,
@@ -268,6 +635,7 @@ OMX_ERRORTYPE event_handler (
 			     OMX_IN OMX_U32 data2,
 			     OMX_IN OMX_PTR event_data){
   component_t* component = (component_t*)app_data;
+  role_enter (ROLE_CALLBACK);
 #ifdef DBG_PID
   pid_t pid = getpid();
   pid_t tid = syscall(SYS_gettid);
@@ -331,8 +699,9 @@ OMX_ERRORTYPE event_handler (
     case OMX_IndexConfigCameraSettings:
       printf ("event: %s, OMX_EventParamOrConfigChanged, state: %s\n",
 	      component->name, dump_OMX_INDEXTYPE (data2));
+      //Stored before the waiter is woken, so it reads the new values
+      update_cam_settings(component);
       wake (component, EVENT_STATE_SET);
-      dump_cam_exp(component);
       /* OMX_CONFIG_CAMERASETTINGSTYPE* camconfig = (OMX_CONFIG_CAMERASETTING  STYPE*)event_data; */
       /* printf("| exp    | analog gain | digital gain | lux | AWB R | AWB B   | focus |\n"); */
       /* printf("| %6i | %5i       | %5i        | %3i | %3i   | %3i   | %3i     |\n", */
@@ -372,19 +741,48 @@ OMX_ERRORTYPE fill_buffer_done (
 				OMX_IN OMX_PTR app_data,
 				OMX_IN OMX_BUFFERHEADERTYPE* buffer){
   component_t* component = (component_t*)app_data;
+  role_enter (ROLE_CALLBACK);
 
+  if (component == stream_source){
+    streamPush (buffer);
+    return OMX_ErrorNone;
+  }
   printf ("event: %s, fill_buffer_done\n", component->name);
   wake (component, EVENT_FILL_BUFFER_DONE);
 
   return OMX_ErrorNone;
 }
 
+//Function that is called when a component consumed an input buffer
+OMX_ERRORTYPE empty_buffer_done (
+				 OMX_IN OMX_HANDLETYPE comp,
+				 OMX_IN OMX_PTR app_data,
+				 OMX_IN OMX_BUFFERHEADERTYPE* buffer){
+  component_t* component = (component_t*)app_data;
+  role_enter (ROLE_CALLBACK);
+
+  printf ("event: %s, empty_buffer_done\n", component->name);
+  wake (component, EVENT_EMPTY_BUFFER_DONE);
+
+  return OMX_ErrorNone;
+}
+
+//The times of the events are 64 bit, a plain store can be torn on 32-bit ARM
+pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void wake (component_t* component, VCOS_UNSIGNED event){
 #ifdef DBG_PID
   pid_t pid = getpid();
   pid_t tid = syscall(SYS_gettid);
   printf("wake pid = %i tid = %i\n", pid, tid);
 #endif
+  int64_t now = meta_now (CLOCK_MONOTONIC);
+  int bit;
+  pthread_mutex_lock (&wake_lock);
+  for (bit=0; bit<EVENT_BITS; bit++){
+    if (event & (1 << bit)) component->woken_ns[bit] = now;
+  }
+  pthread_mutex_unlock (&wake_lock);
   vcos_event_flags_set (&component->flags, event, VCOS_OR);
 }
 
@@ -393,11 +791,24 @@ void wait (
 	   VCOS_UNSIGNED events,
 	   VCOS_UNSIGNED* retrieved_events){
   VCOS_UNSIGNED set;
+  int64_t start = meta_now (CLOCK_MONOTONIC);
   if (vcos_event_flags_get (&component->flags, events | EVENT_ERROR,
 			    VCOS_OR_CONSUME, VCOS_SUSPEND, &set)){
     fprintf (stderr, "error: vcos_event_flags_get\n");
     exit (1);
   }
+  //The first of the events retrieved that came while blocked woke us, the
+  //ones set before did not
+  int64_t woken = 0;
+  int bit;
+  pthread_mutex_lock (&wake_lock);
+  for (bit=0; bit<EVENT_BITS; bit++){
+    int64_t t = component->woken_ns[bit];
+    if ((set & (1 << bit)) && t > start && (!woken || t < woken)) woken = t;
+  }
+  pthread_mutex_unlock (&wake_lock);
+  if (woken)
+    role_wakeup (ROLE_CONTROL, meta_now (CLOCK_MONOTONIC) - woken);
   if (set == EVENT_ERROR){
     exit (1);
   }
@@ -410,6 +821,7 @@ void init_component (component_t* component){
   printf ("initializing component '%s'\n", component->name);
 
   OMX_ERRORTYPE error;
+  memset (component->woken_ns, 0, sizeof (component->woken_ns));
 
   //Create the event flags
   if (vcos_event_flags_create (&component->flags, "component")){
@@ -417,9 +829,11 @@ void init_component (component_t* component){
     exit (1);
   }
 
-  //Each component has an event_handler and fill_buffer_done functions
+  //Each component has an event_handler, fill_buffer_done and
+  //empty_buffer_done functions
   OMX_CALLBACKTYPE callbacks_st;
   callbacks_st.EventHandler = event_handler;
+  callbacks_st.EmptyBufferDone = empty_buffer_done;
   callbacks_st.FillBufferDone = fill_buffer_done;
 
   //Get the handle
@@ -561,50 +975,81 @@ void disable_port (component_t* component, OMX_U32 port){
   }
 }
 
-void enable_encoder_output_port (
-				 component_t* encoder,
-				 OMX_BUFFERHEADERTYPE** encoder_output_buffer){
-  //The port is not enabled until the buffer is allocated
+void enable_output_port (
+			 component_t* component,
+			 OMX_U32 port,
+			 arena_t* arena,
+			 OMX_BUFFERHEADERTYPE** output_buffers){
+  //The port is not enabled until the buffers are allocated
   OMX_ERRORTYPE error;
 
-  enable_port (encoder, 341);
-
+  //One buffer per arena slot, each as big as the slot
   OMX_PARAM_PORTDEFINITIONTYPE def_st;
   OMX_INIT_STRUCTURE (def_st);
-  def_st.nPortIndex = 341;
-  if ((error = OMX_GetParameter (encoder->handle, OMX_IndexParamPortDefinition,
-				 &def_st))){
+  def_st.nPortIndex = port;
+  if ((error = OMX_GetParameter (component->handle,
+				 OMX_IndexParamPortDefinition, &def_st))){
     fprintf (stderr, "error: OMX_GetParameter: %s\n",
 	     dump_OMX_ERRORTYPE (error));
     exit (1);
   }
-  printf ("allocating %s output buffer\n", encoder->name);
-  if ((error = OMX_AllocateBuffer (encoder->handle, encoder_output_buffer, 341,
-				   0, def_st.nBufferSize))){
-    fprintf (stderr, "error: OMX_AllocateBuffer: %s\n",
+  if (def_st.nBufferCountMin > arena->slots ||
+      def_st.nBufferSize > arena->slot_size ||
+      arena->slot_size % (def_st.nBufferAlignment ? def_st.nBufferAlignment : 1)){
+    fprintf (stderr, "error: port %d needs %d buffers of %d bytes aligned to "
+	     "%d\n", port, def_st.nBufferCountMin, def_st.nBufferSize,
+	     def_st.nBufferAlignment);
+    exit (1);
+  }
+  def_st.nBufferCountActual = arena->slots;
+  def_st.nBufferSize = arena->slot_size;
+  if ((error = OMX_SetParameter (component->handle,
+				 OMX_IndexParamPortDefinition, &def_st))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
 	     dump_OMX_ERRORTYPE (error));
     exit (1);
   }
 
-  wait (encoder, EVENT_PORT_ENABLE, 0);
+  enable_port (component, port);
+
+  printf ("using arena for %s output buffers\n", component->name);
+  int i;
+  for (i=0; i<arena->slots; i++){
+    if ((error = OMX_UseBuffer (component->handle, &output_buffers[i], port,
+				(OMX_PTR)(intptr_t)i, arena->slot_size,
+				arena_slot (arena, i)))){
+      fprintf (stderr, "error: OMX_UseBuffer: %s\n",
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+  }
+
+  wait (component, EVENT_PORT_ENABLE, 0);
 }
 
-void disable_encoder_output_port (
-				  component_t* encoder,
-				  OMX_BUFFERHEADERTYPE* encoder_output_buffer){
-  //The port is not disabled until the buffer is released
+void disable_output_port (
+			  component_t* component,
+			  OMX_U32 port,
+			  arena_t* arena,
+			  OMX_BUFFERHEADERTYPE** output_buffers){
+  //The port is not disabled until the buffers are released
   OMX_ERRORTYPE error;
 
-  disable_port (encoder, 341);
+  disable_port (component, port);
 
-  //Free encoder output buffer
-  printf ("releasing '%s' output buffer\n", encoder->name);
-  if ((error = OMX_FreeBuffer (encoder->handle, 341, encoder_output_buffer))){
-    fprintf (stderr, "error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
-    exit (1);
+  //Free the buffer headers, the memory belongs to the arena
+  printf ("releasing '%s' output buffers\n", component->name);
+  int i;
+  for (i=0; i<arena->slots; i++){
+    if ((error = OMX_FreeBuffer (component->handle, port,
+				 output_buffers[i]))){
+      fprintf (stderr, "error: OMX_FreeBuffer: %s\n",
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
   }
 
-  wait (encoder, EVENT_PORT_DISABLE, 0);
+  wait (component, EVENT_PORT_DISABLE, 0);
 }
 
 void set_camera_settings (component_t* camera){
@@ -779,10 +1224,10 @@ void set_camera_settings (component_t* camera){
   OMX_CONFIG_INPUTCROPTYPE roi_st;
   OMX_INIT_STRUCTURE (roi_st);
   roi_st.nPortIndex = OMX_ALL;
-  roi_st.xLeft = (CAM_ROI_LEFT << 16)/100;
-  roi_st.xTop = (CAM_ROI_TOP << 16)/100;
-  roi_st.xWidth = (CAM_ROI_WIDTH << 16)/100;
-  roi_st.xHeight = (CAM_ROI_HEIGHT << 16)/100;
+  roi_st.xLeft = ((OMX_U32)roi.left << 16)/RAW_WIDTH;
+  roi_st.xTop = ((OMX_U32)roi.top << 16)/RAW_HEIGHT;
+  roi_st.xWidth = ((OMX_U32)roi.width << 16)/RAW_WIDTH;
+  roi_st.xHeight = ((OMX_U32)roi.height << 16)/RAW_HEIGHT;
   if ((error = OMX_SetConfig (camera->handle,
 			      OMX_IndexConfigInputCropPercentages, &roi_st))){
     fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
@@ -799,8 +1244,8 @@ void set_camera_settings (component_t* camera){
     exit (1);
   }
 
-  //Bayer data
-  if (OMX_TRUE == RAW_BAYER)
+  //Bayer data appended to the JPEG
+  if (OMX_TRUE == RAW_BAYER && !raw_only)
     {
       //The filename is not relevant
       char dummy[] = "dummy";
@@ -821,12 +1266,9 @@ void set_camera_settings (component_t* camera){
 
 }
 
-void set_jpeg_settings (component_t* encoder){
-  printf ("configuring '%s' settings\n", encoder->name);
-
+void set_jpeg_quality (component_t* encoder){
   OMX_ERRORTYPE error;
 
-  //Quality
   OMX_IMAGE_PARAM_QFACTORTYPE quality;
   OMX_INIT_STRUCTURE (quality);
   quality.nPortIndex = 341;
@@ -837,6 +1279,15 @@ void set_jpeg_settings (component_t* encoder){
 	     dump_OMX_ERRORTYPE (error));
     exit (1);
   }
+}
+
+void set_jpeg_settings (component_t* encoder){
+  printf ("configuring '%s' settings\n", encoder->name);
+
+  OMX_ERRORTYPE error;
+
+  //Quality
+  set_jpeg_quality (encoder);
 
   //Disable EXIF tags
   OMX_CONFIG_BOOLEANTYPE exif;
@@ -875,103 +1326,15 @@ void set_jpeg_settings (component_t* encoder){
     exit (1);
   }
 
-  //EXIF tags
-  //See firmware/documentation/ilcomponents/image_decode.html for valid keys
-  char key[] = "IFD0.Make";
-  char value[] = "Raspberry Pi";
-
-  int key_length = strlen (key);
-  int value_length = strlen (value);
-
-  struct {
-    //These two fields need to be together
-    OMX_CONFIG_METADATAITEMTYPE metadata_st;
-    char metadata_padding[value_length];
-  } item;
-
-  OMX_INIT_STRUCTURE (item.metadata_st);
-  item.metadata_st.nSize = sizeof (item);
-  item.metadata_st.eScopeMode = OMX_MetadataScopePortLevel;
-  item.metadata_st.nScopeSpecifier = 341;
-  item.metadata_st.eKeyCharset = OMX_MetadataCharsetASCII;
-  item.metadata_st.nKeySizeUsed = key_length;
-  memcpy (item.metadata_st.nKey, key, key_length);
-  item.metadata_st.eValueCharset = OMX_MetadataCharsetASCII;
-  item.metadata_st.nValueMaxSize = sizeof (item.metadata_padding);
-  item.metadata_st.nValueSizeUsed = value_length;
-  memcpy (item.metadata_st.nValue, value, value_length);
-
-  if ((error = OMX_SetConfig (encoder->handle,
-			      OMX_IndexConfigMetadataItem, &item))){
-    fprintf (stderr, "OMX_SetConfig: %s", dump_OMX_ERRORTYPE (error));
-    exit (1);
-  }
-
-  {
-    //EXIF tags
-    //See firmware/documentation/ilcomponents/image_decode.html for valid keys
-    char key[] = "IFD0.DateTime";
-    char value[255];
-
-    if (0 == strftime(value, 255, "%Y:%m:%d %H:%M:%S",
-                      tmp))
-      {
-	fprintf(stderr, "localtime2");
-	exit(1);
-      }
-
-    fprintf(stderr, "TIME: %s\n", value);
-
-    int key_length = strlen (key);
-    int value_length = strlen (value);
-
-    struct {
-      //These two fields need to be together
-      OMX_CONFIG_METADATAITEMTYPE metadata_st;
-      char metadata_padding[value_length];
-    } item;
-
-    OMX_INIT_STRUCTURE (item.metadata_st);
-    item.metadata_st.nSize = sizeof (item);
-    item.metadata_st.eScopeMode = OMX_MetadataScopePortLevel;
-    item.metadata_st.nScopeSpecifier = 341;
-    item.metadata_st.eKeyCharset = OMX_MetadataCharsetASCII;
-    item.metadata_st.nKeySizeUsed = key_length;
-    memcpy (item.metadata_st.nKey, key, key_length);
-    item.metadata_st.eValueCharset = OMX_MetadataCharsetASCII;
-    item.metadata_st.nValueMaxSize = sizeof (item.metadata_padding);
-    item.metadata_st.nValueSizeUsed = value_length;
-    memcpy (item.metadata_st.nValue, value, value_length);
-
-    if ((error = OMX_SetConfig (encoder->handle,
-                                OMX_IndexConfigMetadataItem, &item))){
-      fprintf (stderr, "OMX_SetConfig2: %s", dump_OMX_ERRORTYPE (error));
-      exit (1);
-    }
-
-    char key2[] = "EXIF.DateTimeOriginal";
-    int key2_length = strlen (key2);
-
-    item.metadata_st.nSize = sizeof (item);
-    item.metadata_st.eScopeMode = OMX_MetadataScopePortLevel;
-    item.metadata_st.nScopeSpecifier = 341;
-    item.metadata_st.eKeyCharset = OMX_MetadataCharsetASCII;
-    item.metadata_st.nKeySizeUsed = key2_length;
-    memcpy (item.metadata_st.nKey, key2, key2_length);
-    item.metadata_st.eValueCharset = OMX_MetadataCharsetASCII;
-    item.metadata_st.nValueMaxSize = sizeof (item.metadata_padding);
-    item.metadata_st.nValueSizeUsed = value_length;
-    memcpy (item.metadata_st.nValue, value, value_length);
-
-    if ((error = OMX_SetConfig (encoder->handle,
-                                OMX_IndexConfigMetadataItem, &item))){
-      fprintf (stderr, "OMX_SetConfig2: %s", dump_OMX_ERRORTYPE (error));
-      exit (1);
-    }
-
-
-  }
-
+  //EXIF tags. The items are built once, the values that change per frame are
+  //staged and pushed by updateExif()
+  exif_init (&jpeg_exif, encoder->handle, 341);
+  exif_set (&jpeg_exif, exif_add (&jpeg_exif, "IFD0.Make"), "Raspberry Pi");
+  exif_datetime = exif_add (&jpeg_exif, "IFD0.DateTime");
+  exif_datetime_original = exif_add (&jpeg_exif, "EXIF.DateTimeOriginal");
+  exif_exposure = exif_add (&jpeg_exif, "EXIF.ExposureTime");
+  exif_iso = exif_add (&jpeg_exif, "EXIF.ISOSpeedRatings");
+  exif_commit (&jpeg_exif);
 }
 
 int round_up (int value, int divisor){
@@ -1005,7 +1368,7 @@ void dumpSensorModes(component_t* camera)
 
 int fd;
 
-void openNewFile(int suf)
+frame_t* newFrame(int suf, int index, const char* extension)
 {
   time_t t;
 
@@ -1015,7 +1378,6 @@ void openNewFile(int suf)
     fprintf(stderr, "localtime");
     exit(1);
   }
-  char filename[255];
   char datestr[255];
   if (0 == strftime(datestr, 255, "%Y%m%d_%H%M%S",
                     tmp))
@@ -1023,14 +1385,50 @@ void openNewFile(int suf)
       fprintf(stderr, "localtime2");
       exit(1);
     }
-  sprintf(filename, "%s-%i.jpg", datestr, suf);
+  if (series_slot >= 0)
+    sprintf(datestr + strlen(datestr), "_%lli", series_slot);
+
+  if (frame_count == 0) strcpy(series_name, datestr);
+  frame_t* frame = &frames[frame_count++];
+  if (index) {
+    sprintf(frame->filename, "%s-%i_%i.%s", datestr, suf, index, extension);
+  } else {
+    sprintf(frame->filename, "%s-%i.%s", datestr, suf, extension);
+  }
+  frame->exposure = suf;
+  return frame;
+}
+
+frame_t* openNewFile(int suf, int index)
+{
+  frame_t* frame = newFrame(suf, index, "jpg");
 
   //Open the file
-  fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  fd = open (frame->filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
   if (fd == -1){
     fprintf (stderr, "error: open\n");
     exit (1);
   }
+  return frame;
+}
+
+//Exposure of a step of the series: the shortest possible, then doubling up to
+//1 s
+int stepExposure(int step)
+{
+  return step ? 1000000>>(SERIES_LENGTH - 1 - step) : CAM_SHUTTER_SPEED;
+}
+
+//Creates the frame of a step, the file name carries the exposure except for
+//the first step and the index in the stack of the step except for the first
+//frame
+frame_t* nextFrame(int step, int index)
+{
+  int suffix = step ? stepExposure(step) : 0;
+  frame_t* frame = raw_only ? newFrame(suffix, index, "raw") :
+    openNewFile(suffix, index);
+  frame->exposure = stepExposure(step);
+  return frame;
 }
 
 void closeFile()
@@ -1042,6 +1440,9 @@ void closeFile()
   }
 }
 
+//Shutter speed the camera is set to, in us
+int cam_exposure = CAM_SHUTTER_SPEED;
+
 void setExp(component_t* camera, int expval)
 {
   OMX_ERRORTYPE error;
@@ -1104,9 +1505,10 @@ void setExp(component_t* camera, int expval)
     fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
     exit (1);
   }
+  cam_exposure = expval;
 
-  //Bayer data
-  if (OMX_TRUE == RAW_BAYER)
+  //Bayer data appended to the JPEG
+  if (OMX_TRUE == RAW_BAYER && !raw_only)
     {
       //The filename is not relevant
       char dummy[] = "dummy";
@@ -1126,124 +1528,2094 @@ void setExp(component_t* camera, int expval)
     }
 }
 
-int main (){
+void setCapturing(component_t* camera, OMX_U32 port, OMX_BOOL enabled)
+{
   OMX_ERRORTYPE error;
-  OMX_BUFFERHEADERTYPE* encoder_output_buffer;
-  component_t camera;
-  component_t null_sink;
-  component_t encoder;
-  camera.name = "OMX.broadcom.camera";
-  null_sink.name = "OMX.broadcom.null_sink";
-  encoder.name = "OMX.broadcom.image_encode";
+  OMX_CONFIG_PORTBOOLEANTYPE cameraCapturePort;
+  OMX_INIT_STRUCTURE (cameraCapturePort);
+  //Enable camera capture port. This basically says that the port 72 will be
+  //used to get data from the camera. If you're capturing video, the port 71
+  //must be used
+  printf ("%s '%s' capture port %d\n", enabled ? "enabling" : "disabling",
+          camera->name, port);
+  cameraCapturePort.nPortIndex = port;
+  cameraCapturePort.bEnabled = enabled;
+  if ((error = OMX_SetConfig (camera->handle, OMX_IndexConfigPortCapturing,
+                              &cameraCapturePort))){
+    fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+}
 
-#ifdef DBG_PID
-  pid_t pid = getpid();
-  pid_t tid = syscall(SYS_gettid);
-  //pthread_t tid = pthread_self();
-  printf("main pid = %i tid = %i\n", pid, tid);
-#endif
+void setBurst(component_t* camera, OMX_BOOL enabled)
+{
+  OMX_ERRORTYPE error;
+  OMX_CONFIG_BOOLEANTYPE burst;
+  OMX_INIT_STRUCTURE (burst);
+  printf ("%s '%s' burst capture\n", enabled ? "enabling" : "disabling",
+          camera->name);
+  burst.bEnabled = enabled;
+  if ((error = OMX_SetConfig (camera->handle, OMX_IndexConfigBurstCapture,
+                              &burst))){
+    fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  burst_enabled = enabled;
+}
 
-  openNewFile(0);
+//Frame period of the sensor in us, from the framerate it reports
+int framePeriod()
+{
+  return preview_framerate ?
+    (int)(1000000LL*(1 << 16)/preview_framerate) : BURST_FRAME_PERIOD;
+}
 
-  //Initialize Broadcom's VideoCore APIs
-  bcm_host_init ();
+//Adds the time since the frame was armed to its mode, at its EOS
+void countCapture(frame_t* frame, int64_t now)
+{
+  capture_rate_t* rate = frame->burst ? &burst_rate :
+    frame->exposure < framePeriod() ? &oneshot_short_rate : &oneshot_long_rate;
+  rate->frames++;
+  rate->ns += now - frame->meta.monotonic_ns;
+}
 
-  //Initialize OpenMAX IL
-  if ((error = OMX_Init ())){
-    fprintf (stderr, "error: OMX_Init: %s\n", dump_OMX_ERRORTYPE (error));
-    exit (1);
-  }
+void dumpCaptureRate(const char* mode, const capture_rate_t* rate)
+{
+  if (!rate->frames) return;
+  printf("%s: %i frames, %.1f ms per frame, %.2f frames/s\n", mode,
+         rate->frames, rate->ns*1e-6/rate->frames, rate->frames*1e9/rate->ns);
+}
 
-  //Initialize components
-  init_component (&camera);
-  init_component (&null_sink);
-  init_component (&encoder);
+void startCapture(component_t* camera, frame_t* frame)
+{
+  //Short frames go in burst, the camera stays in capture mode and only the
+  //exposure changes. The mode is switched whenever the step crosses the
+  //frame period: once for an ascending bracket, more often with -a
+  frame->burst = burst_capture && frame->exposure < framePeriod();
+  if (frame->burst != burst_enabled) setBurst(camera, frame->burst);
+  memset(&frame->meta, 0, sizeof (frame->meta));
+  frame->meta.monotonic_ns = meta_now(CLOCK_MONOTONIC);
+  frame->meta.wall_ns = meta_now(CLOCK_REALTIME);
+  jpeg_parser_init(&frame->parser);
+  setCapturing(camera, 72, OMX_TRUE);
+}
 
-  //Initialize camera drivers
-  load_camera_drivers (&camera);
+//Stages the EXIF values of the next frame and pushes the ones that changed
+//in one go, so the gap between frames does not grow with the number of tags
+void updateExif(frame_t* frame)
+{
+  char value[EXIF_VALUE_SIZE];
 
-  //Configure camera sensor
-  printf ("configuring '%s' sensor\n", camera.name);
-  OMX_PARAM_SENSORMODETYPE sensor;
-  OMX_INIT_STRUCTURE (sensor);
-  sensor.nPortIndex = OMX_ALL;
-  OMX_INIT_STRUCTURE (sensor.sFrameSize);
-  sensor.sFrameSize.nPortIndex = OMX_ALL;
-  if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamCommonSensorMode,
-				 &sensor))){
+  //tmp is the time the file of the frame was opened
+  if (0 == strftime(value, sizeof (value), "%Y:%m:%d %H:%M:%S", tmp))
+    {
+      fprintf(stderr, "localtime2");
+      exit(1);
+    }
+  exif_set(&jpeg_exif, exif_datetime, value);
+  exif_set(&jpeg_exif, exif_datetime_original, value);
+  sprintf(value, "%i/1000000", frame->exposure);
+  exif_set(&jpeg_exif, exif_exposure, value);
+  sprintf(value, "%i", CAM_ISO);
+  exif_set(&jpeg_exif, exif_iso, value);
+
+  printf("EXIF: %i items updated\n", exif_commit(&jpeg_exif));
+}
+
+uint32_t metaOffset(int64_t offset)
+{
+  return offset < 0 ? META_NO_OFFSET : offset;
+}
+
+//With -z the raw block is archived in the .rawz and cut from the JPEG once
+//processed, unless the deghosting reads it again
+int archiveTruncates()
+{
+  return compress_frames && !raw_only && !deghost_merge;
+}
+
+//Whether the exposure the camera reported last is the one of this frame.
+//The settings event is not tied to a capture and can come after the EOS
+//of the frame, the settings of the frame before are then still cached
+int reportedExposure(frame_t* frame)
+{
+  int reported = frame->meta.exposure;
+  return reported && abs(reported - frame->exposure) <=
+    frame->exposure*CAM_EXPOSURE_TOLERANCE + CAM_LINE_TIME;
+}
+
+//Completes the metadata of a frame once its last buffer arrived and emits it.
+//The camera values come from settings cached earlier, no OMX call is made
+//here; only the dark frames read the temperature from sysfs
+void finishFrame(frame_t* frame, OMX_BUFFERHEADERTYPE* buffer, OMX_U32 bytes)
+{
+  frame_meta_t* meta = &frame->meta;
+
+  pthread_mutex_lock(&cam_settings_lock);
+  meta->exposure = cam_settings.nExposure;
+  meta->analog_gain = cam_settings.nAnalogGain;
+  meta->digital_gain = cam_settings.nDigitalGain;
+  meta->lux = cam_settings.nLux;
+  meta->awb_red = cam_settings.nRedGain;
+  meta->awb_blue = cam_settings.nBlueGain;
+  meta->focus = cam_settings.nFocusPosition;
+  pthread_mutex_unlock(&cam_settings_lock);
+
+  meta->requested_exposure = frame->exposure;
+  meta->framerate = preview_framerate;
+  meta->sensor_mode = sensor_mode;
+  meta->omx_timestamp = ((int64_t)buffer->nTimeStamp.nHighPart << 32) |
+    buffer->nTimeStamp.nLowPart;
+  meta->bytes = bytes;
+
+  jpeg_index_t* index = &frame->parser.index;
+  meta->app1_offset = metaOffset(index->app1);
+  meta->app1_size = metaOffset(index->app1_size);
+  meta->thumbnail_offset = metaOffset(index->thumbnail);
+  meta->thumbnail_size = metaOffset(index->thumbnail_size);
+  meta->sos_offset = metaOffset(index->sos);
+  meta->eoi_offset = metaOffset(index->eoi);
+  meta->brcm_offset = archiveTruncates() ? META_NO_OFFSET :
+    metaOffset(index->brcm);
+  countCapture(frame, meta_now(CLOCK_MONOTONIC));
+
+  //A read of sysfs, only the dark frames are keyed by it
+  if (dark_capture || dark_subtraction) frame->temperature = dark_temperature();
+
+  if (meta->exposure && !reportedExposure(frame))
+    printf("reported exposure %i us is not the requested %i us, the settings "
+           "are of another frame, weighting with the requested one\n",
+           meta->exposure, frame->exposure);
+
+  meta_dump(meta);
+  meta_index_append(series_index, frame->filename, meta);
+  if (write_sidecars) meta_write_sidecar(frame->filename, meta);
+}
+
+//Exposure to weight the frame with: the one reported by the camera if it
+//belongs to the frame, the requested one otherwise
+int frameExposure(frame_t* frame)
+{
+  return reportedExposure(frame) ? frame->meta.exposure : frame->exposure;
+}
+
+hdr_t series_hdr;
+unsigned short* merge_pixels;
+align_t series_align;
+unsigned short* aligned_pixels;
+
+//Encodes an 8 bit RGB image into a JPEG with an image_encode instance of its
+//own, fed from memory. rows has stride bytes per row and holds height rounded
+//up to ENCODE_SLICE_HEIGHT rows
+void encodeImage(const unsigned char* rows, int width, int height, int stride,
+                 const char* filename)
+{
+  OMX_ERRORTYPE error;
+  component_t encoder;
+  OMX_BUFFERHEADERTYPE* input;
+  OMX_BUFFERHEADERTYPE* output;
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+
+  encoder.name = "OMX.broadcom.image_encode";
+  init_component (&encoder);
+
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 340;
+  if ((error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
     fprintf (stderr, "error: OMX_GetParameter: %s\n",
-	     dump_OMX_ERRORTYPE (error));
+             dump_OMX_ERRORTYPE (error));
     exit (1);
   }
-  sensor.bOneShot = OMX_TRUE;
-  sensor.sFrameSize.nWidth = CAM_WIDTH;
-  sensor.sFrameSize.nHeight = CAM_HEIGHT;
-  if ((error = OMX_SetParameter (camera.handle, OMX_IndexParamCommonSensorMode,
-				 &sensor))){
-    fprintf (stderr, "error: OMX_SetParameter6: %s\n",
-	     dump_OMX_ERRORTYPE (error));
+  port_def.format.image.nFrameWidth = width;
+  port_def.format.image.nFrameHeight = height;
+  port_def.format.image.nStride = stride;
+  port_def.format.image.nSliceHeight = ENCODE_SLICE_HEIGHT;
+  port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+  //Broadcom's BGR888 is R, G, B in memory
+  port_def.format.image.eColorFormat = OMX_COLOR_Format24bitBGR888;
+  port_def.nBufferCountActual = 1;
+  if ((error = OMX_SetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def)) ||
+      (error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
     exit (1);
   }
-
-  OMX_CONFIG_FRAMERATETYPE framerate;
-  OMX_INIT_STRUCTURE(framerate);
-  framerate.nPortIndex = 70;
-  /* framerate.xEncodeFramerate = (1<<16)/6; */
-  if ((error = OMX_GetParameter (camera.handle, OMX_IndexConfigVideoFramerate,
-                                 &framerate))){
-    fprintf (stderr, "error: OMX_SetParameter6b: %s\n",
-             dump_OMX_ERRORTYPE (error));
+  OMX_U32 input_size = port_def.nBufferSize;
+  OMX_U32 slice_size = stride*ENCODE_SLICE_HEIGHT;
+  if (input_size < slice_size) {
+    fprintf (stderr, "error: encodeImage: input buffer of %i bytes\n",
+             input_size);
     exit (1);
   }
 
-  fprintf(stderr, "xEncodeFramerate = %g\n", framerate.xEncodeFramerate/(double)(1<<16));
-
-  /* OMX_CONFIG_FRAMERATETYPE framerate; */
-  /* OMX_INIT_STRUCTURE(framerate); */
-  /* framerate.nPortIndex = 70; */
-  /* framerate.xEncodeFramerate = (1<<16)/6; */
-  /* if ((error = OMX_SetParameter (camera.handle, OMX_IndexConfigVideoFramerate, */
-  /*     &framerate))){ */
-  /*   fprintf (stderr, "error: OMX_SetParameter6b: %s\n", */
-  /*       dump_OMX_ERRORTYPE (error)); */
-  /*   exit (1); */
-  /* } */
-
-  dumpSensorModes(&camera);
-
-  //Configure camera port definition
-  printf ("configuring '%s' port definition\n", camera.name);
-  OMX_PARAM_PORTDEFINITIONTYPE port_def;
   OMX_INIT_STRUCTURE (port_def);
-  port_def.nPortIndex = 72;
-  if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamPortDefinition,
-				 &port_def))){
+  port_def.nPortIndex = 341;
+  if ((error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
     fprintf (stderr, "error: OMX_GetParameter: %s\n",
-	     dump_OMX_ERRORTYPE (error));
+             dump_OMX_ERRORTYPE (error));
     exit (1);
   }
-  port_def.format.image.nFrameWidth = CAM_WIDTH;
-  port_def.format.image.nFrameHeight = CAM_HEIGHT;
-  port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
-  port_def.format.image.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
-  //Stride is byte-per-pixel*width, YUV has 1 byte per pixel, so the stride is
-  //the width (rounded up to the nearest multiple of 16).
-  //See mmal/util/mmal_util.c, mmal_encoding_width_to_stride()
-  port_def.format.image.nStride = round_up (CAM_WIDTH, 32);
-  if ((error = OMX_SetParameter (camera.handle, OMX_IndexParamPortDefinition,
-				 &port_def))){
-    fprintf (stderr, "error: OMX_SetParameter7: %s\n",
-	     dump_OMX_ERRORTYPE (error));
+  port_def.format.image.nFrameWidth = width;
+  port_def.format.image.nFrameHeight = height;
+  port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+  port_def.format.image.eColorFormat = OMX_COLOR_FormatUnused;
+  port_def.nBufferCountActual = 1;
+  if ((error = OMX_SetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def)) ||
+      (error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
     exit (1);
   }
+  OMX_U32 output_size = port_def.nBufferSize;
+  set_jpeg_quality (&encoder);
 
-  //Configure preview port
-  //In theory the fastest resolution and framerate are 1920x1080 @30fps because
-  //these are the default settings for the preview port, so the frames don't
-  //need to be resized. In practice, this is not true. The fastest way to
-  //produce stills is setting the lowest resolution, that is, 640x480 @30fps.
-  //The difference between 1920x1080 @30fps and 640x480 @30fps is a speed boost
-  //of ~4%, from ~1083ms to ~1039ms
+  change_state (&encoder, OMX_StateIdle);
+  wait (&encoder, EVENT_STATE_SET, 0);
+  enable_port (&encoder, 340);
+  if ((error = OMX_AllocateBuffer (encoder.handle, &input, 340, 0,
+                                   input_size))){
+    fprintf (stderr, "error: OMX_AllocateBuffer: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&encoder, EVENT_PORT_ENABLE, 0);
+  enable_port (&encoder, 341);
+  if ((error = OMX_AllocateBuffer (encoder.handle, &output, 341, 0,
+                                   output_size))){
+    fprintf (stderr, "error: OMX_AllocateBuffer: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&encoder, EVENT_PORT_ENABLE, 0);
+  change_state (&encoder, OMX_StateExecuting);
+  wait (&encoder, EVENT_STATE_SET, 0);
+
+  int out = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out == -1){
+    fprintf (stderr, "error: open %s\n", filename);
+    exit (1);
+  }
+
+  //Whole slices are fed while the output is drained, the encoder stalls if
+  //either side is not served
+  size_t total = (size_t)stride*round_up(height, ENCODE_SLICE_HEIGHT);
+  size_t sent = 0;
+  int input_free = 1;
+  int done = 0;
+  if ((error = OMX_FillThisBuffer (encoder.handle, output))){
+    fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  while (!done){
+    if (input_free && sent < total){
+      size_t n = total - sent;
+      if (n > input_size/slice_size*slice_size)
+        n = input_size/slice_size*slice_size;
+      memcpy (input->pBuffer, rows + sent, n);
+      input->nOffset = 0;
+      input->nFilledLen = n;
+      sent += n;
+      input->nFlags = sent == total ? OMX_BUFFERFLAG_EOS : 0;
+      if ((error = OMX_EmptyThisBuffer (encoder.handle, input))){
+        fprintf (stderr, "error: OMX_EmptyThisBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+      input_free = 0;
+    }
+
+    VCOS_UNSIGNED events;
+    wait (&encoder, EVENT_EMPTY_BUFFER_DONE | EVENT_FILL_BUFFER_DONE, &events);
+    if (events & EVENT_EMPTY_BUFFER_DONE) input_free = 1;
+    if (events & EVENT_FILL_BUFFER_DONE){
+      if (write (out, output->pBuffer + output->nOffset, output->nFilledLen) !=
+          output->nFilledLen){
+        fprintf (stderr, "error: writing %s\n", filename);
+        exit (1);
+      }
+      if (output->nFlags & OMX_BUFFERFLAG_EOS){
+        done = 1;
+      } else if ((error = OMX_FillThisBuffer (encoder.handle, output))){
+        fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+    }
+  }
+  if (close (out)){
+    fprintf (stderr, "error: close %s\n", filename);
+    exit (1);
+  }
+  //Clear the EOS flag
+  wait (&encoder, EVENT_BUFFER_FLAG, 0);
+
+  change_state (&encoder, OMX_StateIdle);
+  wait (&encoder, EVENT_STATE_SET, 0);
+  disable_port (&encoder, 340);
+  if ((error = OMX_FreeBuffer (encoder.handle, 340, input))){
+    fprintf (stderr, "error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&encoder, EVENT_PORT_DISABLE, 0);
+  disable_port (&encoder, 341);
+  if ((error = OMX_FreeBuffer (encoder.handle, 341, output))){
+    fprintf (stderr, "error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&encoder, EVENT_PORT_DISABLE, 0);
+  change_state (&encoder, OMX_StateLoaded);
+  wait (&encoder, EVENT_STATE_SET, 0);
+  deinit_component (&encoder);
+}
+
+//Tone maps the demosaiced radiance map and writes it as <series>-hdr.jpg
+//through image_encode or as <series>-hdr.ppm
+void writeTonemapped(const float* rgb)
+{
+  //The stride and the height are padded for the encoder
+  int stride = round_up(3*roi.width, 32);
+  int rows = round_up(roi.height, ENCODE_SLICE_HEIGHT);
+  unsigned char* image = budget_calloc(BUDGET_OUTPUT, (size_t)stride*rows, 1);
+  if (!image) {
+    fprintf(stderr, "error: writeTonemapped: out of memory\n");
+    exit(1);
+  }
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+  tonemap(rgb, roi.width, roi.height, tonemap_operator, TONEMAP_THREADS,
+          image, stride);
+  printf("tonemap %s: %lli ms\n", tonemap_operator_name(tonemap_operator),
+         (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000);
+
+  char filename[255];
+  if (encode_tonemapped) {
+    sprintf(filename, "%s-hdr.jpg", series_name);
+    printf("encoding %s\n", filename);
+    encodeImage(image, roi.width, roi.height, stride, filename);
+  } else {
+    sprintf(filename, "%s-hdr.ppm", series_name);
+    printf("writing %s\n", filename);
+    tonemap_write_ppm(filename, roi.width, roi.height, image, stride);
+  }
+  budget_free(image);
+}
+
+//Decodes the JPEG part of a frame file with an image_decode instance of its
+//own into 8 bit RGB, stride bytes per row. The decoder delivers YUV 4:2:0
+//slices that are converted as they arrive, so the whole YUV image never
+//exists. size is the number of bytes to feed, the raw block after the end of
+//the image is skipped
+void decodeImage(const char* filename, int64_t size, unsigned char* rgb,
+                 int width, int height, int stride)
+{
+  OMX_ERRORTYPE error;
+  component_t decoder;
+  OMX_BUFFERHEADERTYPE* input;
+  OMX_BUFFERHEADERTYPE* output = NULL;
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+
+  int in = open (filename, O_RDONLY);
+  struct stat st;
+  if (in == -1 || fstat (in, &st)){
+    fprintf (stderr, "error: open %s\n", filename);
+    exit (1);
+  }
+  if (size <= 0 || size > st.st_size) size = st.st_size;
+  const unsigned char* data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+  if (data == MAP_FAILED){
+    fprintf (stderr, "error: mmap %s\n", filename);
+    exit (1);
+  }
+  close (in);
+
+  decoder.name = "OMX.broadcom.image_decode";
+  init_component (&decoder);
+
+  OMX_IMAGE_PARAM_PORTFORMATTYPE format;
+  OMX_INIT_STRUCTURE (format);
+  format.nPortIndex = 320;
+  format.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+  if ((error = OMX_SetParameter (decoder.handle, OMX_IndexParamImagePortFormat,
+                                 &format))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 320;
+  if ((error = OMX_GetParameter (decoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  port_def.nBufferCountActual = 1;
+  port_def.nBufferSize = DECODE_CHUNK_SIZE;
+  if ((error = OMX_SetParameter (decoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def)) ||
+      (error = OMX_GetParameter (decoder.handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  OMX_U32 input_size = port_def.nBufferSize;
+
+  change_state (&decoder, OMX_StateIdle);
+  wait (&decoder, EVENT_STATE_SET, 0);
+  enable_port (&decoder, 320);
+  if ((error = OMX_AllocateBuffer (decoder.handle, &input, 320, 0,
+                                   input_size))){
+    fprintf (stderr, "error: OMX_AllocateBuffer: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&decoder, EVENT_PORT_ENABLE, 0);
+  change_state (&decoder, OMX_StateExecuting);
+  wait (&decoder, EVENT_STATE_SET, 0);
+
+  //The output port is configured once the decoder has parsed the header and
+  //reported the image size. Input is fed and output drained until the end of
+  //stream, the decoder stalls if either side is not served
+  int64_t sent = 0;
+  int input_free = 1;
+  int done = 0;
+  int y_stride = 0, slice_height = 0, row = 0;
+  while (!done){
+    if (input_free && sent < size){
+      OMX_U32 n = size - sent < input_size ? size - sent : input_size;
+      memcpy (input->pBuffer, data + sent, n);
+      input->nOffset = 0;
+      input->nFilledLen = n;
+      sent += n;
+      input->nFlags = sent == size ? OMX_BUFFERFLAG_EOS : 0;
+      if ((error = OMX_EmptyThisBuffer (decoder.handle, input))){
+        fprintf (stderr, "error: OMX_EmptyThisBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+      input_free = 0;
+    }
+
+    VCOS_UNSIGNED events;
+    wait (&decoder, EVENT_EMPTY_BUFFER_DONE | EVENT_FILL_BUFFER_DONE |
+          EVENT_PORT_SETTINGS_CHANGED, &events);
+    if (events & EVENT_EMPTY_BUFFER_DONE) input_free = 1;
+    if (events & EVENT_PORT_SETTINGS_CHANGED){
+      OMX_INIT_STRUCTURE (port_def);
+      port_def.nPortIndex = 321;
+      if ((error = OMX_GetParameter (decoder.handle,
+                                     OMX_IndexParamPortDefinition,
+                                     &port_def))){
+        fprintf (stderr, "error: OMX_GetParameter: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+      if (port_def.format.image.nFrameWidth != width ||
+          port_def.format.image.nFrameHeight != height ||
+          port_def.format.image.eColorFormat !=
+          OMX_COLOR_FormatYUV420PackedPlanar){
+        fprintf (stderr, "error: %s is %ix%i (format %i), expected %ix%i\n",
+                 filename, port_def.format.image.nFrameWidth,
+                 port_def.format.image.nFrameHeight,
+                 port_def.format.image.eColorFormat, width, height);
+        exit (1);
+      }
+      y_stride = port_def.format.image.nStride;
+      slice_height = port_def.format.image.nSliceHeight;
+      enable_port (&decoder, 321);
+      if ((error = OMX_AllocateBuffer (decoder.handle, &output, 321, 0,
+                                       port_def.nBufferSize))){
+        fprintf (stderr, "error: OMX_AllocateBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+      wait (&decoder, EVENT_PORT_ENABLE, 0);
+      if ((error = OMX_FillThisBuffer (decoder.handle, output))){
+        fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+    }
+    if (events & EVENT_FILL_BUFFER_DONE){
+      //One slice: the Y plane, then U and V at half the size
+      const unsigned char* y = output->pBuffer + output->nOffset;
+      const unsigned char* u = y + y_stride*slice_height;
+      const unsigned char* v = u + y_stride/2*slice_height/2;
+      int rows = height - row < slice_height ? height - row : slice_height;
+      if (output->nFilledLen && rows > 0){
+        colour_yuv420_to_rgb(y, u, v, y_stride, y_stride/2, width, rows,
+                             rgb + (size_t)row*stride, stride);
+        row += rows;
+      }
+      if (output->nFlags & OMX_BUFFERFLAG_EOS){
+        done = 1;
+      } else if ((error = OMX_FillThisBuffer (decoder.handle, output))){
+        fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+                 dump_OMX_ERRORTYPE (error));
+        exit (1);
+      }
+    }
+  }
+  munmap ((void*)data, size);
+  if (row < height){
+    fprintf (stderr, "error: %s: %i of %i rows decoded\n", filename, row,
+             height);
+    exit (1);
+  }
+  //Clear the EOS flag
+  wait (&decoder, EVENT_BUFFER_FLAG, 0);
+
+  change_state (&decoder, OMX_StateIdle);
+  wait (&decoder, EVENT_STATE_SET, 0);
+  disable_port (&decoder, 320);
+  if ((error = OMX_FreeBuffer (decoder.handle, 320, input))){
+    fprintf (stderr, "error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&decoder, EVENT_PORT_DISABLE, 0);
+  disable_port (&decoder, 321);
+  if ((error = OMX_FreeBuffer (decoder.handle, 321, output))){
+    fprintf (stderr, "error: OMX_FreeBuffer: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  wait (&decoder, EVENT_PORT_DISABLE, 0);
+  change_state (&decoder, OMX_StateLoaded);
+  wait (&decoder, EVENT_STATE_SET, 0);
+  deinit_component (&decoder);
+}
+
+//Fuses the JPEGs of the series (Mertens) into <series>-fused.jpg through
+//image_encode or <series>-fused.ppm. The frames are decoded and added one at
+//a time, only the accumulated pyramid and the one of the current frame are
+//resident
+//The stride and the height of the fused image, padded for the encoder
+int fusedStride()
+{
+  return round_up(3*roi.width, 32);
+}
+
+int fusedRows()
+{
+  return round_up(roi.height, ENCODE_SLICE_HEIGHT);
+}
+
+void fuseSeries()
+{
+  fusion_t fusion;
+  fusion_init(&fusion, roi.width, roi.height);
+  printf("fusion: %i levels, %zu MB resident\n", fusion.levels,
+         fusion_memory(&fusion) >> 20);
+
+  int stride = fusedStride();
+  int rows = fusedRows();
+  unsigned char* image = budget_calloc(BUDGET_FUSION, (size_t)stride*rows, 1);
+  if (!image) {
+    fprintf(stderr, "error: fuseSeries: out of memory\n");
+    exit(1);
+  }
+
+  int i;
+  for (i=0; i<frame_count; i++) {
+    frame_t* frame = &frames[i];
+    int64_t eoi = frame->parser.index.eoi;
+    int64_t start = meta_now(CLOCK_MONOTONIC);
+    decodeImage(frame->filename, eoi < 0 ? 0 : eoi + 2, image, roi.width,
+                roi.height, stride);
+    int64_t decoded = meta_now(CLOCK_MONOTONIC);
+    fusion_add(&fusion, image, stride);
+    printf("fusing %s: decode %lli ms, pyramids %lli ms\n", frame->filename,
+           (long long)(decoded - start)/1000000,
+           (long long)(meta_now(CLOCK_MONOTONIC) - decoded)/1000000);
+  }
+  fusion_finish(&fusion, image, stride);
+  fusion_free(&fusion);
+
+  char filename[255];
+  if (encode_tonemapped) {
+    sprintf(filename, "%s-fused.jpg", series_name);
+    printf("encoding %s\n", filename);
+    encodeImage(image, roi.width, roi.height, stride, filename);
+  } else {
+    sprintf(filename, "%s-fused.ppm", series_name);
+    printf("writing %s\n", filename);
+    tonemap_write_ppm(filename, roi.width, roi.height, image, stride);
+  }
+  budget_free(image);
+}
+
+//Identifies the camera and the settings that shape the response of the JPEG
+//pipeline, the cached curve of another camera or other settings does not
+//apply (FNV-1a of the values)
+uint32_t responseKey()
+{
+  char settings[255];
+  sprintf(settings, "%s %i %i %i %i %i %i %i %i %i %i %i %i", camera_identity,
+          CAM_ISO, CAM_SHARPNESS, CAM_CONTRAST, CAM_BRIGHTNESS,
+          CAM_SATURATION, CAM_DRC, CAM_WHITE_BALANCE, CAM_WHITE_BALANCE_RED_GAIN,
+          CAM_WHITE_BALANCE_BLUE_GAIN, CAM_IMAGE_FILTER, CAM_COLOR_ENABLE,
+          (int)sensor_mode);
+  uint32_t hash = 2166136261u;
+  const char* p;
+  for (p=settings; *p; p++) hash = (hash ^ (unsigned char)*p)*16777619u;
+  return hash;
+}
+
+//Exposure time of a frame for the JPEG stages, with the offset the raw data
+//showed
+double frameTime(frame_t* frame)
+{
+  return frameExposure(frame) + HDR_EXPOSURE_OFFSET;
+}
+
+//Merges the JPEGs of the series into the radiance map <series>-jpeg.pfm (RGB,
+//relative units). The response curve is read from response-<key>.crf or
+//solved from the series first, which needs one more decode of every frame
+void mergeJpegSeries()
+{
+  int stride = round_up(3*roi.width, 32);
+  unsigned char* image = budget_malloc(BUDGET_MERGE, (size_t)stride*roi.height);
+  if (!image) {
+    fprintf(stderr, "error: mergeJpegSeries: out of memory\n");
+    exit(1);
+  }
+
+  response_t response;
+  char filename[255];
+  int i;
+  sprintf(filename, "response-%08x.crf", responseKey());
+  if (recalibrate_response || !response_load(&response, filename)) {
+    response_samples_t* samples = budget_calloc(BUDGET_CALIBRATION, 1,
+                                                sizeof (response_samples_t));
+    if (!samples) {
+      fprintf(stderr, "error: mergeJpegSeries: out of memory\n");
+      exit(1);
+    }
+    //One frame per step, the stacked ones add nothing to the curve
+    for (i=stack_frames - 1; i<frame_count; i += stack_frames) {
+      int64_t eoi = frames[i].parser.index.eoi;
+      decodeImage(frames[i].filename, eoi < 0 ? 0 : eoi + 2, image,
+                  roi.width, roi.height, stride);
+      response_sample(samples, image, roi.width, roi.height, stride,
+                      frameTime(&frames[i]));
+    }
+    int64_t start = meta_now(CLOCK_MONOTONIC);
+    response_solve(samples, &response);
+    printf("response solved from %i frames in %lli ms, writing %s\n",
+           samples->frames,
+           (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000, filename);
+    response_save(&response, filename);
+    budget_free(samples);
+  } else {
+    printf("response read from %s\n", filename);
+  }
+  response_dump(&response);
+
+  response_merge_t merge;
+  response_merge_init(&merge, roi.width, roi.height);
+  for (i=0; i<frame_count; i++) {
+    int64_t eoi = frames[i].parser.index.eoi;
+    decodeImage(frames[i].filename, eoi < 0 ? 0 : eoi + 2, image, roi.width,
+                roi.height, stride);
+    response_merge_add(&merge, &response, image, stride,
+                       frameTime(&frames[i]));
+  }
+  budget_free(image);
+  //The sums are not needed anymore, reuse them for the result
+  response_merge_finish(&merge, merge.sum);
+  sprintf(filename, "%s-jpeg.pfm", series_name);
+  printf("writing %s\n", filename);
+  hdr_write_pfm(filename, roi.width, roi.height, 3, merge.sum);
+  response_merge_free(&merge);
+}
+
+void initMerge()
+{
+  hdr_init(&series_hdr, roi.width, roi.height);
+  merge_pixels = budget_malloc(BUDGET_MERGE,
+                               sizeof (unsigned short)*roi.width*roi.height);
+  if (!merge_pixels) {
+    fprintf(stderr, "error: initMerge: out of memory\n");
+    exit(1);
+  }
+  if (stack_frames > 1)
+    stack_init(&series_stack, roi.width, roi.height, stack_clip);
+  if (align_series) {
+    align_init(&series_align, roi.width, roi.height, ALIGN_THREADS);
+    aligned_pixels = budget_malloc(BUDGET_ALIGN,
+                                   sizeof (unsigned short)*roi.width*roi.height);
+    if (!aligned_pixels) {
+      fprintf(stderr, "error: initMerge: out of memory\n");
+      exit(1);
+    }
+  }
+}
+
+//Subtracts the dark level from rows [top, top + rows) of the unpacked ROI of
+//a frame. Frames without a master in the library are left alone
+void darkSubtract(frame_t* frame, unsigned short* pixels, int top, int rows)
+{
+  if (!frame->dark_state) {
+    frame->dark_state = dark_lookup(&dark_library, frameExposure(frame),
+                                    CAM_ISO, frame->temperature,
+                                    &frame->dark) ? 1 : -1;
+    if (frame->dark_state < 0) {
+      printf("no dark frame for %s (%i us, ISO %i, %i C)\n", frame->filename,
+             frameExposure(frame), CAM_ISO, frame->temperature);
+    }
+  }
+  if (frame->dark_state > 0) dark_subtract(&frame->dark, &roi, top, rows, pixels);
+}
+
+//Dark level and defects of rows [top, top + rows) of the unpacked ROI
+void correctRawRows(frame_t* frame, unsigned short* pixels, int top, int rows)
+{
+  if (dark_subtraction) darkSubtract(frame, pixels, top, rows);
+  if (defect_correction) defect_correct(&defect_map, &roi, top, rows, pixels);
+}
+
+//Second pass of the merge, see deghost.h. The frames are mapped again and
+//walked in bands of rows, each frame contributes the rows of the current band
+//(plus the margin its alignment shift needs), so nothing but the band
+//accumulators is added to the memory of the merge
+void deghostMerge(float* radiance)
+{
+  raw_map_t map;
+  const roi_t* frame_roi = raw_only ? &raw_only_roi : &roi;
+  int stride = raw_only ? raw_only_stride : RAW_STRIDE;
+  int margin = 0;
+  int i, y;
+
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+  for (i=0; i<frame_count; i++) {
+    if (align_series && align_margin(frames[i].align_dy) > margin)
+      margin = align_margin(frames[i].align_dy);
+  }
+
+  deghost_t deghost;
+  deghost_init(&deghost, roi.width);
+  for (y=0; y<roi.height; y+=DEGHOST_BAND_ROWS) {
+    int rows = roi.height - y < DEGHOST_BAND_ROWS ? roi.height - y :
+      DEGHOST_BAND_ROWS;
+    int top = y - margin > 0 ? y - margin : 0;
+    int bottom = y + rows + margin < roi.height ? y + rows + margin :
+      roi.height;
+    roi_t band = *frame_roi;
+    band.top += top;
+    band.height = bottom - top;
+
+    deghost_begin(&deghost, rows);
+    for (i=0; i<frame_count; i++) {
+      //Mapped for one band at a time, a stacked series has too many frames
+      //to keep them all in the address space of a 32-bit process
+      if (raw_only) {
+        raw_map_file(&map, frames[i].filename);
+      } else {
+        raw_map(&map, frames[i].filename, frames[i].parser.index.brcm);
+      }
+      raw_unpack(map.raw, stride, &band, merge_pixels);
+      raw_unmap(&map);
+      correctRawRows(&frames[i], merge_pixels, top, bottom - top);
+      const unsigned short* pixels = merge_pixels + (size_t)(y - top)*roi.width;
+      if (align_series) {
+        align_shift_rows(&series_align, merge_pixels, top, bottom - top,
+                         frames[i].align_dx, frames[i].align_dy,
+                         aligned_pixels, y, rows);
+        pixels = aligned_pixels;
+      }
+      deghost_add(&deghost, radiance + (size_t)y*roi.width, pixels,
+                  frameExposure(&frames[i]));
+    }
+    deghost_end(&deghost, radiance + (size_t)y*roi.width);
+  }
+  printf("deghost: %.2f%% of %zu samples weighted down, %lli ms\n",
+         deghost.samples ? 100.0*deghost.outliers/deghost.samples : 0.0,
+         deghost.samples, (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000);
+  deghost_free(&deghost);
+}
+
+void finishMerge()
+{
+  if (stack_frames > 1) stack_free(&series_stack);
+  //The signal accumulator is not needed anymore, reuse it for the result
+  hdr_radiance(&series_hdr, series_hdr.signal);
+  if (deghost_merge) deghostMerge(series_hdr.signal);
+
+  budget_free(merge_pixels);
+  if (align_series) {
+    align_free(&series_align);
+    budget_free(aligned_pixels);
+  }
+  char filename[255];
+  sprintf(filename, "%s.pfm", series_name);
+  printf("writing %s (%ix%i at %i,%i)\n", filename, roi.width, roi.height,
+         roi.left, roi.top);
+  hdr_write_pfm(filename, roi.width, roi.height, 1, series_hdr.signal);
+
+  if (demosaic_merge) {
+    float* rgb = budget_malloc(BUDGET_DEMOSAIC,
+                               3*sizeof (float)*roi.width*roi.height);
+    if (!rgb) {
+      fprintf(stderr, "error: finishMerge: out of memory\n");
+      exit(1);
+    }
+    cfa_t order = raw_cfa(CAM_MIRROR == OMX_MirrorHorizontal ||
+                          CAM_MIRROR == OMX_MirrorBoth,
+                          CAM_MIRROR == OMX_MirrorVertical ||
+                          CAM_MIRROR == OMX_MirrorBoth, CAM_ROTATION);
+    //The raw data is not white balanced. The gains the camera reported for
+    //the last frame (Q16) are the ones of the JPEGs, the configured ones if
+    //it reported none
+    frame_meta_t* meta = &frames[frame_count - 1].meta;
+    double red_gain = meta->awb_red ? meta->awb_red/65536.0 :
+      CAM_WHITE_BALANCE_RED_GAIN/1000.0;
+    double blue_gain = meta->awb_blue ? meta->awb_blue/65536.0 :
+      CAM_WHITE_BALANCE_BLUE_GAIN/1000.0;
+    const float ccm[9] = COLOUR_CCM;
+    float matrix[9];
+    colour_matrix(matrix, red_gain, blue_gain, ccm);
+    printf("white balance %.3f %.3f, colour matrix\n", red_gain, blue_gain);
+    colour_dump(matrix);
+
+    int64_t start = meta_now(CLOCK_MONOTONIC);
+    demosaic(series_hdr.signal, roi.width, roi.height, order, demosaic_mode,
+             matrix, DEMOSAIC_THREADS, rgb);
+    printf("demosaic %s: %lli ms\n", demosaic_mode_name(demosaic_mode),
+           (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000);
+    sprintf(filename, "%s-rgb.pfm", series_name);
+    printf("writing %s\n", filename);
+    hdr_write_pfm(filename, roi.width, roi.height, 3, rgb);
+    if (tonemap_merge) writeTonemapped(rgb);
+    budget_free(rgb);
+  }
+  hdr_free(&series_hdr);
+}
+
+//Averages the full sensor raw data of a frame into the dark frame library
+void darkFrame(frame_t* frame, const unsigned char* raw, int stride,
+               const roi_t* frame_roi)
+{
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+  raw_unpack(raw, stride, frame_roi, dark_pixels);
+  dark_add(&dark_library, dark_pixels, frameExposure(frame), CAM_ISO,
+           frame->temperature);
+  printf("dark frame %s (%i us, ISO %i, %i C): %lli ms\n", frame->filename,
+         frameExposure(frame), CAM_ISO, frame->temperature,
+         (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000);
+}
+
+//Counts the hot and dead pixels of the frame for the defect map
+void defectFrame(frame_t* frame, const unsigned char* raw, int stride,
+                 const roi_t* frame_roi)
+{
+  raw_unpack(raw, stride, frame_roi, defect_pixels);
+  defect_builder_add(&defect_builder, defect_pixels);
+}
+
+//Whether enough of the unpacked ROI is well exposed to predict the other
+//frames of the series from it
+int deltaUsable(const unsigned short* pixels)
+{
+  size_t usable = 0, total = 0;
+  int x, y;
+  for (y = 0; y < roi.height; y += DELTA_SAMPLE_STEP) {
+    const unsigned short* row = pixels + (size_t)y*roi.width;
+    for (x = 0; x < roi.width; x++) {
+      usable += row[x] >= RAW_BLACK_LEVEL + DELTA_MIN_SIGNAL &&
+        row[x] < RAW_WHITE_LEVEL;
+    }
+    total += roi.width;
+  }
+  return usable >= DELTA_MIN_USABLE*total;
+}
+
+//Writes the unpacked ROI of a frame losslessly compressed next to it
+void compressFrame(frame_t* frame, const unsigned char* raw, int stride,
+                   const roi_t* frame_roi)
+{
+  char filename[255];
+  compress_t compress;
+  strcpy(filename, frame->filename);
+  char* extension = strrchr(filename, '.');
+  strcpy(extension ? extension : filename + strlen(filename), ".rawz");
+
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+  raw_unpack(raw, stride, frame_roi, compress_pixels);
+  compress_encode(&compress, compress_pixels, frameExposure(frame),
+                  delta_has_reference ? &delta_reference : NULL,
+                  roi.width, roi.height, COMPRESS_THREADS);
+  compress_write(&compress, filename);
+  if (delta_archive && !delta_has_reference &&
+      deltaUsable(compress_pixels)) {
+    //Looked up next to the delta coded frames, by its name only
+    const char* name = strrchr(filename, '/');
+    name = name ? name + 1 : filename;
+    if (strlen(name) < COMPRESS_REFERENCE_SIZE) {
+      memcpy(delta_pixels, compress_pixels,
+             sizeof (unsigned short)*roi.width*roi.height);
+      delta_reference.pixels = delta_pixels;
+      delta_reference.exposure = frameExposure(frame);
+      strcpy(delta_reference.name, name);
+      delta_has_reference = 1;
+      printf("%s is the delta reference\n", name);
+    }
+  }
+  double seconds = (meta_now(CLOCK_MONOTONIC) - start)*1e-9;
+  //Against the packed 10 bit samples
+  double packed = roi.width*roi.height*10/8.0;
+  printf("compressed %s: %.2f:1, %.1f MB/s\n", filename,
+         packed/compress.size, packed/seconds*1e-6);
+  compress_free(&compress);
+}
+
+//Estimates the offset of the unpacked frame to the series and shifts it
+//back, the result is in aligned_pixels
+const unsigned short* alignRawFrame(frame_t* frame)
+{
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+  int usable = align_frame(&series_align, merge_pixels, frameExposure(frame),
+                           &frame->align_dx, &frame->align_dy);
+  align_shift(&series_align, merge_pixels, frame->align_dx, frame->align_dy,
+              aligned_pixels);
+  printf("align %s: %+.2f %+.2f px%s, %lli ms\n", frame->filename,
+         frame->align_dx, frame->align_dy, usable ? "" : " (too flat, kept)",
+         (long long)(meta_now(CLOCK_MONOTONIC) - start)/1000000);
+  return aligned_pixels;
+}
+
+//Merges the packed raw data of a frame, roi is relative to raw
+void mergeRawFrame(frame_t* frame, const unsigned char* raw, int stride,
+                   const roi_t* frame_roi)
+{
+  int i;
+  raw_unpack(raw, stride, frame_roi, merge_pixels);
+  correctRawRows(frame, merge_pixels, 0, roi.height);
+  if (stack_frames > 1) {
+    stack_add(&series_stack, merge_pixels);
+    printf("stacking %s (%i us), %i of %i\n", frame->filename,
+           frameExposure(frame), series_stack.count, stack_frames);
+    if (series_stack.count < stack_frames) return;
+    printf("stack of %i frames: %zu of %zu samples rejected\n", stack_frames,
+           series_stack.rejected,
+           (size_t)roi.width*roi.height*stack_frames);
+    stack_finish(&series_stack, merge_pixels);
+  }
+  printf("merging %s (%i us)\n", frame->filename, frameExposure(frame));
+  hdr_add(&series_hdr, align_series ? alignRawFrame(frame) : merge_pixels,
+          frameExposure(frame));
+  //The frames of the stack share the offset for the deghosting
+  for (i=1; i<stack_frames; i++) {
+    frames[frame_count - 1 - i].align_dx = frame->align_dx;
+    frames[frame_count - 1 - i].align_dy = frame->align_dy;
+  }
+}
+
+//Exposure statistics for the adaptive bracketing, computed before the
+//exposure of the next frame is set
+void analyzeRawFrame(frame_t* frame, const unsigned char* raw, int stride,
+                     const roi_t* frame_roi)
+{
+  stats_compute(raw, stride, frame_roi, &frame->stats);
+  stats_dump(&frame->stats);
+}
+
+//Hands the raw block of a JPEG to the merge and the statistics. It is read
+//from the arena slot if the frame arrived in one buffer (size is not 0),
+//otherwise from the file that was written in slices
+void processJpegFrame(frame_t* frame, const OMX_U8* data, OMX_U32 size)
+{
+  int64_t brcm = frame->parser.index.brcm;
+  const unsigned char* raw;
+  raw_map_t map;
+
+  if (size) {
+    if (brcm < 0 || brcm + RAW_BLOCK_SIZE > size) {
+      fprintf(stderr, "error: %s has no raw data\n", frame->filename);
+      exit(1);
+    }
+    raw = data + brcm + RAW_HEADER_SIZE;
+  } else {
+    raw_map(&map, frame->filename, brcm);
+    raw = map.raw;
+  }
+  if (merge_series) mergeRawFrame(frame, raw, RAW_STRIDE, &roi);
+  if (adaptive_bracketing) analyzeRawFrame(frame, raw, RAW_STRIDE, &roi);
+  if (defect_detection) defectFrame(frame, raw, RAW_STRIDE, &roi);
+  if (compress_frames) compressFrame(frame, raw, RAW_STRIDE, &roi);
+  if (dark_capture) {
+    roi_t sensor = { 0, 0, RAW_WIDTH, RAW_HEIGHT };
+    darkFrame(frame, raw, RAW_STRIDE, &sensor);
+  }
+  if (!size) raw_unmap(&map);
+  //The JPEG ends at its EOI, the raw block after it is in the .rawz now
+  int64_t eoi = frame->parser.index.eoi;
+  if (archiveTruncates() && eoi >= 0 && truncate(frame->filename, eoi + 2)) {
+    fprintf(stderr, "error: truncating %s\n", frame->filename);
+    exit(1);
+  }
+}
+
+//Default consumer of the raw-only mode: merge the frame in memory or store
+//the packed data as it comes from the still port
+void consumeRawFrame(frame_t* frame, const OMX_U8* data, OMX_U32 size)
+{
+  if (dark_capture) darkFrame(frame, data, raw_only_stride, &raw_only_roi);
+  if (defect_detection)
+    defectFrame(frame, data, raw_only_stride, &raw_only_roi);
+  if (merge_series) mergeRawFrame(frame, data, raw_only_stride, &raw_only_roi);
+  if (compress_frames)
+    compressFrame(frame, data, raw_only_stride, &raw_only_roi);
+  //The second pass of the deghosting reads the frames again
+  if ((merge_series || compress_frames) && !deghost_merge) return;
+
+  int out = open (frame->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out == -1 || write (out, data, size) != size || close (out)){
+    fprintf (stderr, "error: writing %s\n", frame->filename);
+    exit (1);
+  }
+}
+
+//Writes one frame into the current file. Returns the size of the frame if
+//it arrived in one buffer, so it can still be read from there, 0 if it was
+//written in slices
+OMX_U32 captureJpegFrame(component_t* camera, component_t* encoder,
+                         OMX_BUFFERHEADERTYPE* encoder_output_buffer,
+                         frame_t* frame)
+{
+  OMX_ERRORTYPE error;
+  VCOS_UNSIGNED end_flags = EVENT_BUFFER_FLAG | EVENT_FILL_BUFFER_DONE;
+  VCOS_UNSIGNED retrieves_events;
+  int fills = 0;
+  OMX_U32 bytes = 0;
+
+  while (1){
+    //Get the buffer data (a slice of the image)
+    if ((error = OMX_FillThisBuffer (encoder->handle, encoder_output_buffer))){
+      fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+               dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+
+    //Wait until it's filled
+    wait (encoder, EVENT_FILL_BUFFER_DONE, &retrieves_events);
+    fills++;
+    const OMX_U8* slice = encoder_output_buffer->pBuffer +
+      encoder_output_buffer->nOffset;
+    jpeg_parser_feed(&frame->parser, slice, encoder_output_buffer->nFilledLen);
+    thumbs_collect(&frame->thumbnail, &frame->parser.index, bytes, slice,
+                   encoder_output_buffer->nFilledLen);
+    bytes += encoder_output_buffer->nFilledLen;
+
+    //Append the buffer into the file
+    if (pwrite (fd, encoder_output_buffer->pBuffer,
+                encoder_output_buffer->nFilledLen,
+                encoder_output_buffer->nOffset) == -1){
+      fprintf (stderr, "error: pwrite\n");
+      exit (1);
+    }
+
+    fprintf(stderr, "LOOP event = %i\n", retrieves_events);
+
+    //When it's the end of the stream, an OMX_EventBufferFlag is emitted in the
+    //camera and image_encode components. Then the FillBufferDone function is
+    //called in the image_encode
+    if (retrieves_events == end_flags){
+      //Clear the EOS flags
+      wait (camera, EVENT_BUFFER_FLAG, 0);
+      wait (encoder, EVENT_BUFFER_FLAG, 0);
+
+      break;
+    }
+  }
+  jpeg_index_dump(&frame->parser.index);
+  finishFrame(frame, encoder_output_buffer, bytes);
+  thumbs_append(series_thumbs, &frame->thumbnail, frame->filename,
+                frameExposure(frame), &frame->parser.index);
+
+  return fills == 1 ? encoder_output_buffer->nFilledLen : 0;
+}
+
+void deliverRawFrame(frame_t* frame, const OMX_U8* data, OMX_U32 size)
+{
+  if (adaptive_bracketing)
+    analyzeRawFrame(frame, data, raw_only_stride, &raw_only_roi);
+  frame_consumer(frame, data, size);
+}
+
+//Fills the still port buffer until the end of the frame and hands the frame
+//to the consumer. A frame that fits in the buffer is passed without a copy
+void captureRawFrame(component_t* camera, OMX_BUFFERHEADERTYPE* buffer,
+                     frame_t* frame)
+{
+  OMX_ERRORTYPE error;
+  OMX_U8* data = NULL;
+  OMX_U32 size = 0;
+
+  while (1) {
+    if ((error = OMX_FillThisBuffer (camera->handle, buffer))){
+      fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+               dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+    wait (camera, EVENT_FILL_BUFFER_DONE, 0);
+
+    int eos = buffer->nFlags & OMX_BUFFERFLAG_EOS;
+    if (eos && !size) {
+      finishFrame(frame, buffer, buffer->nFilledLen);
+      deliverRawFrame(frame, buffer->pBuffer + buffer->nOffset,
+                      buffer->nFilledLen);
+      break;
+    }
+    if (!(data = budget_realloc(BUDGET_OUTPUT,
+                                data, size + buffer->nFilledLen))) {
+      fprintf(stderr, "error: captureRawFrame: out of memory\n");
+      exit(1);
+    }
+    memcpy(data + size, buffer->pBuffer + buffer->nOffset, buffer->nFilledLen);
+    size += buffer->nFilledLen;
+    if (eos) {
+      finishFrame(frame, buffer, size);
+      deliverRawFrame(frame, data, size);
+      break;
+    }
+  }
+  budget_free(data);
+
+  //Clear the EOS flag
+  wait (camera, EVENT_BUFFER_FLAG, 0);
+}
+
+//Configures the encoder of the stream: the input port takes the frames of
+//the video port as they are, the output port gives H.264 or MJPEG
+void setStreamEncoder(component_t* encoder,
+                      const OMX_VIDEO_PORTDEFINITIONTYPE* video)
+{
+  OMX_ERRORTYPE error;
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 200;
+  if ((error = OMX_GetParameter (encoder->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  port_def.format.video = *video;
+  if ((error = OMX_SetParameter (encoder->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 201;
+  if ((error = OMX_GetParameter (encoder->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  port_def.format.video.nFrameWidth = video->nFrameWidth;
+  port_def.format.video.nFrameHeight = video->nFrameHeight;
+  port_def.format.video.eCompressionFormat =
+    stream_mode == STREAM_H264 ? OMX_VIDEO_CodingAVC : OMX_VIDEO_CodingMJPEG;
+  port_def.format.video.eColorFormat = OMX_COLOR_FormatUnused;
+  port_def.format.video.xFramerate = 0;
+  port_def.format.video.nBitrate = STREAM_BITRATE;
+  if ((error = OMX_SetParameter (encoder->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  if (stream_mode != STREAM_H264) return;
+
+  OMX_VIDEO_PARAM_BITRATETYPE bitrate;
+  OMX_INIT_STRUCTURE (bitrate);
+  bitrate.nPortIndex = 201;
+  bitrate.eControlRate = OMX_Video_ControlRateVariable;
+  bitrate.nTargetBitrate = STREAM_BITRATE;
+  if ((error = OMX_SetParameter (encoder->handle, OMX_IndexParamVideoBitrate,
+                                 &bitrate))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  //A saved event starts at its first sync frame
+  OMX_PARAM_U32TYPE period;
+  OMX_INIT_STRUCTURE (period);
+  period.nPortIndex = 201;
+  period.nU32 = stream_framerate*STREAM_INTRA_PERIOD + 0.5;
+  if ((error = OMX_SetConfig (encoder->handle,
+                              OMX_IndexConfigBrcmVideoIntraPeriod, &period))){
+    fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+}
+
+const char* streamExtension()
+{
+  return stream_mode == STREAM_H264 ? "h264" :
+    stream_mode == STREAM_MJPEG ? "mjpeg" : "raw";
+}
+
+//Opens <series>.<ext> for the whole stream or <series>-<event>.<ext> for an
+//event, the H.264 headers go first
+int openStream(int event, const unsigned char* header, size_t header_size)
+{
+  char filename[255];
+  if (event) {
+    sprintf(filename, "%s-%i.%s", series_name, event, streamExtension());
+  } else {
+    sprintf(filename, "%s.%s", series_name, streamExtension());
+  }
+  int out = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out == -1 || write (out, header, header_size) != header_size){
+    fprintf (stderr, "error: writing %s\n", filename);
+    exit (1);
+  }
+  printf("writing %s\n", filename);
+  return out;
+}
+
+void writeStream(int out, const unsigned char* data, size_t size)
+{
+  if (write (out, data, size) != size){
+    fprintf (stderr, "error: writing the stream\n");
+    exit (1);
+  }
+}
+
+//Memory of the pre-trigger store for -P seconds: a port buffer per raw frame
+//of the window, or the bytes of the bitrate for an encoded stream
+size_t streamRingSize(const OMX_PARAM_PORTDEFINITIONTYPE* port_def)
+{
+  if (stream_mode == STREAM_RAW)
+    return ((size_t)(pre_trigger*stream_framerate) + 1)*port_def->nBufferSize;
+  return pre_trigger*STREAM_BITRATE/8*STREAM_RING_HEADROOM;
+}
+
+//Captures the video port continuously until SIGINT or SIGTERM, the raw
+//frames as they are (packed like in raw-only mode) or through video_encode.
+//Without a pre-trigger window everything goes to <series>.<ext>. With one
+//the last pre_trigger seconds are held in memory and SIGUSR1 saves them to
+//<series>-<event>.<ext>, followed by STREAM_POST_TRIGGER seconds of the live
+//stream. Buffers are handed back to the port as soon as they are copied, the
+//file writes are the only thing that can hold it up
+void streamVideo(component_t* camera, component_t* null_sink)
+{
+  OMX_ERRORTYPE error;
+  component_t encoder;
+  encoder.name = "OMX.broadcom.video_encode";
+  int encoded = stream_mode != STREAM_RAW;
+  component_t* source = encoded ? &encoder : camera;
+  OMX_U32 output_port = encoded ? 201 : 71;
+  arena_t stream_arena;
+  OMX_BUFFERHEADERTYPE* buffers[STREAM_BUFFERS];
+  int i;
+
+  time_t t = time(NULL);
+  if (!(tmp = localtime(&t)) ||
+      !strftime(series_name, sizeof (series_name), "%Y%m%d_%H%M%S", tmp)) {
+    fprintf(stderr, "localtime");
+    exit(1);
+  }
+  if (stream_mode == STREAM_H264 && (roi.width > STREAM_H264_MAX_WIDTH ||
+                                     roi.height > STREAM_H264_MAX_HEIGHT)) {
+    fprintf(stderr, "error: H.264 is limited to %ix%i, reduce the ROI with "
+            "-r\n", STREAM_H264_MAX_WIDTH, STREAM_H264_MAX_HEIGHT);
+    exit(1);
+  }
+  if (encoded) init_component (&encoder);
+
+  //Video port: the ROI at the stream framerate
+  printf ("configuring '%s' video port\n", camera->name);
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 71;
+  if ((error = OMX_GetParameter (camera->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  port_def.format.video.nFrameWidth = roi.width;
+  port_def.format.video.nFrameHeight = roi.height;
+  port_def.format.video.xFramerate = stream_framerate*(1 << 16);
+  port_def.format.video.eCompressionFormat = OMX_VIDEO_CodingUnused;
+  port_def.format.video.eColorFormat = encoded ?
+    OMX_COLOR_FormatYUV420PackedPlanar : RAW_ONLY_COLOR_FORMAT;
+  port_def.format.video.nStride = encoded ? round_up (roi.width, 32) :
+    round_up (roi.width*5/4, 32);
+  port_def.format.video.nSliceHeight = round_up (roi.height, 16);
+  if ((error = OMX_SetParameter (camera->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  //The component may pad the stride further
+  if ((error = OMX_GetParameter (camera->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  printf ("video port %ix%i stride %i at %.2f frames/s\n",
+          port_def.format.video.nFrameWidth, port_def.format.video.nFrameHeight,
+          port_def.format.video.nStride,
+          port_def.format.video.xFramerate/(double)(1 << 16));
+  if (encoded) setStreamEncoder(&encoder, &port_def.format.video);
+
+  //Tunnels: camera (preview) -> null_sink, camera (video) -> video_encode
+  printf ("configuring tunnels\n");
+  if ((error = OMX_SetupTunnel (camera->handle, 70, null_sink->handle, 240))){
+    fprintf (stderr, "error: OMX_SetupTunnel: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  if (encoded &&
+      (error = OMX_SetupTunnel (camera->handle, 71, encoder.handle, 200))){
+    fprintf (stderr, "error: OMX_SetupTunnel: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+
+  change_state (camera, OMX_StateIdle);
+  wait (camera, EVENT_STATE_SET, 0);
+  change_state (null_sink, OMX_StateIdle);
+  wait (null_sink, EVENT_STATE_SET, 0);
+  if (encoded){
+    change_state (&encoder, OMX_StateIdle);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
+
+  enable_port (camera, 70);
+  enable_port (null_sink, 240);
+  wait (null_sink, EVENT_PORT_ENABLE, 0);
+  if (encoded){
+    enable_port (camera, 71);
+    wait (camera, EVENT_PORT_ENABLE, 0);
+    enable_port (&encoder, 200);
+    wait (&encoder, EVENT_PORT_ENABLE, 0);
+  }
+  //The pool of the output port, sized by the port
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = output_port;
+  if ((error = OMX_GetParameter (source->handle, OMX_IndexParamPortDefinition,
+                                 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  arena_init(&stream_arena, STREAM_BUFFERS, port_def.nBufferSize, huge_pages);
+  if (lock_buffers) arena_lock(&stream_arena);
+  enable_output_port (source, output_port, &stream_arena, buffers);
+
+  //Sized for the window asked for, before anything is streamed
+  ring_t ring;
+  if (pre_trigger > 0) {
+    size_t size = streamRingSize(&port_def);
+    if (size > budget_room()) {
+      fprintf(stderr, "error: -P %.1f needs %.1f MB for the pre-trigger "
+              "store, %.1f MB of the budget are left\n", pre_trigger,
+              size/(1024.0*1024.0), budget_room()/(1024.0*1024.0));
+      exit(1);
+    }
+    ring_init(&ring, size, STREAM_RING_ENTRIES, pre_trigger*1e9);
+    if (lock_buffers) ring_lock(&ring);
+    printf("holding the last %.1f s in %.1f MB, SIGUSR1 saves them\n",
+           pre_trigger, size/(1024.0*1024.0));
+  }
+
+  change_state (camera, OMX_StateExecuting);
+  wait (camera, EVENT_STATE_SET, 0);
+  change_state (null_sink, OMX_StateExecuting);
+  wait (null_sink, EVENT_STATE_SET, 0);
+  if (encoded){
+    change_state (&encoder, OMX_StateExecuting);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
+
+  //The H.264 headers arrive once, before the first frame, and start every
+  //file written
+  unsigned char* header = NULL;
+  size_t header_size = 0;
+  int out = pre_trigger > 0 ? -1 : openStream(0, NULL, 0);
+  int events = 0;
+  int64_t post_trigger_end = 0;
+  int frame_start = 1;
+  int frames = 0;
+  uint64_t bytes = 0;
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+  signal(SIGUSR1, handleSignal);
+
+  stream_source = source;
+  for (i=0; i<STREAM_BUFFERS; i++){
+    if ((error = OMX_FillThisBuffer (source->handle, buffers[i]))){
+      fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+               dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+  }
+  setCapturing(camera, 71, OMX_TRUE);
+  int64_t start = meta_now(CLOCK_MONOTONIC);
+
+  while (!stop_requested) {
+    OMX_BUFFERHEADERTYPE* buffer = streamPop();
+    int64_t now = meta_now(CLOCK_MONOTONIC);
+    const unsigned char* data = buffer ? buffer->pBuffer + buffer->nOffset :
+      NULL;
+    size_t size = buffer ? buffer->nFilledLen : 0;
+    if (!buffer) {
+      //Only the signals and the end of the post-trigger time to look at
+    } else if (buffer->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+      if (!(header = budget_realloc(BUDGET_STREAM,
+                                    header, header_size + size))) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+      }
+      memcpy(header + header_size, data, size);
+      header_size += size;
+      if (out != -1) writeStream(out, data, size);
+    } else if (size) {
+      int keyframe = stream_mode == STREAM_H264 ?
+        buffer->nFlags & OMX_BUFFERFLAG_SYNCFRAME : frame_start;
+      if (pre_trigger > 0)
+        ring_push(&ring, data, size, now, keyframe ? RING_KEYFRAME : 0);
+      if (out != -1) writeStream(out, data, size);
+      bytes += size;
+      frame_start = buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+      frames += frame_start != 0;
+    }
+    if (buffer && (error = OMX_FillThisBuffer (source->handle, buffer))){
+      fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
+               dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+
+    if (trigger_requested && pre_trigger > 0) {
+      trigger_requested = 0;
+      if (out == -1) {
+        out = openStream(++events, header, header_size);
+        size_t saved = ring_write(&ring, out);
+        printf("event %i: %.1f s before the trigger, %.1f MB\n", events,
+               ring_span(&ring)*1e-9, saved*1e-6);
+      }
+      //A trigger during the post-trigger time extends it
+      post_trigger_end = now + STREAM_POST_TRIGGER*1000000000LL;
+    }
+    if (pre_trigger > 0 && out != -1 && now >= post_trigger_end) {
+      close(out);
+      out = -1;
+    }
+  }
+  double seconds = (meta_now(CLOCK_MONOTONIC) - start)*1e-9;
+  printf("streamed %i frames in %.1f s, %.2f frames/s, %.1f MB/s\n", frames,
+         seconds, frames/seconds, bytes/seconds*1e-6);
+  if (pre_trigger > 0) {
+    printf("%i events saved, %lu buffers dropped from the window for lack "
+           "of memory\n", events, ring.overflows);
+    ring_free(&ring);
+  }
+  if (out != -1) close(out);
+  budget_free(header);
+
+  setCapturing(camera, 71, OMX_FALSE);
+  //The buffers come back with the state change, nobody waits for them
+  stream_source = NULL;
+  change_state (camera, OMX_StateIdle);
+  wait (camera, EVENT_STATE_SET, 0);
+  change_state (null_sink, OMX_StateIdle);
+  wait (null_sink, EVENT_STATE_SET, 0);
+  if (encoded){
+    change_state (&encoder, OMX_StateIdle);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
+
+  if (encoded){
+    disable_port (camera, 71);
+    disable_port (&encoder, 200);
+  }
+  disable_output_port (source, output_port, &stream_arena, buffers);
+  disable_port (camera, 70);
+  disable_port (null_sink, 240);
+
+  change_state (camera, OMX_StateLoaded);
+  wait (camera, EVENT_STATE_SET, 0);
+  change_state (null_sink, OMX_StateLoaded);
+  wait (null_sink, EVENT_STATE_SET, 0);
+  if (encoded){
+    change_state (&encoder, OMX_StateLoaded);
+    wait (&encoder, EVENT_STATE_SET, 0);
+    deinit_component (&encoder);
+  }
+  arena_dump(&stream_arena);
+  arena_free(&stream_arena);
+}
+
+//Creates the first frame of a series, its index and contact sheet, and the
+//merge. A stride above 1 thins the bracket when the time-lapse is behind
+void beginSeries(bracket_t* bracket, int stride)
+{
+  char filename[255];
+  frame_count = 0;
+  bracket_init(bracket, SERIES_LENGTH, stride, adaptive_bracketing);
+  nextFrame(bracket->step, 0);
+  sprintf(filename, "%s.idx", series_name);
+  series_index = meta_index_open(filename);
+  if (!raw_only) {
+    sprintf(filename, "%s.thumbs", series_name);
+    series_thumbs = thumbs_open(filename);
+  }
+  if (merge_series) initMerge();
+  //Every series has a delta reference and capture rates of its own
+  delta_has_reference = 0;
+  memset(&burst_rate, 0, sizeof (burst_rate));
+  memset(&oneshot_short_rate, 0, sizeof (oneshot_short_rate));
+  memset(&oneshot_long_rate, 0, sizeof (oneshot_long_rate));
+}
+
+//Captures the frames of a series with the component graph running, every
+//step as many times as it is stacked
+void captureSeries(component_t* camera, component_t* encoder,
+                   arena_t* frame_arena, OMX_BUFFERHEADERTYPE** output_buffers,
+                   bracket_t* bracket)
+{
+  int stacked = 1;
+
+  //Start consuming the buffers
+  if (frames[0].exposure != cam_exposure) setExp(camera, frames[0].exposure);
+  if (!raw_only) updateExif(&frames[0]);
+  budget_gate(1);
+  startCapture(camera, &frames[0]);
+
+  while (1){
+    frame_t* frame = &frames[frame_count - 1];
+    int slot = arena_acquire(frame_arena);
+    if (slot < 0) {
+      fprintf(stderr, "error: no free arena slot\n");
+      exit(1);
+    }
+    OMX_BUFFERHEADERTYPE* buffer = output_buffers[slot];
+    if (raw_only){
+      captureRawFrame(camera, buffer, frame);
+    } else {
+      OMX_U32 size = captureJpegFrame(camera, encoder, buffer, frame);
+      closeFile();
+      if (merge_series || adaptive_bracketing || dark_capture ||
+          defect_detection || compress_frames) {
+        processJpegFrame(frame, buffer->pBuffer + buffer->nOffset, size);
+      }
+    }
+    arena_release(frame_arena, slot);
+    //Not back-pressure: the frame was processed on this thread and the pool
+    //is joined, nothing is left to free. If the memory the last frame took
+    //is not there for the next one, the series ends instead
+    if (!budget_gate(0)) {
+      printf("budget: no room for another frame, the series ends here\n");
+      break;
+    }
+    if (stacked < stack_frames) {
+      //The next frame of the stack, the exposure stays
+      printf ("------NEXT FRAME OF THE STACK-----------------------------\n");
+      frame = nextFrame(bracket->step, stacked++);
+    } else {
+      //The step ends on the statistics of its last frame
+      int step = bracket_next(bracket, &frame->stats);
+      if (step < 0) break;
+      printf ("------NEXT FRAME------------------------------------------\n");
+      frame = nextFrame(step, 0);
+      stacked = 1;
+      setExp(camera, frame->exposure);
+    }
+    if (!raw_only) updateExif(frame);
+
+    startCapture(camera, frame);
+  }
+  printf ("------------------------------------------------\n");
+  dumpCaptureRate("burst", &burst_rate);
+  dumpCaptureRate("one-shot, shorter than a frame", &oneshot_short_rate);
+  dumpCaptureRate("one-shot, longer than a frame", &oneshot_long_rate);
+}
+
+//Closes the index and the contact sheet and runs what needs all the frames
+//of the series
+void endSeries()
+{
+  meta_index_close(series_index);
+  if (!raw_only) thumbs_close(series_thumbs);
+  if (merge_series) finishMerge();
+  if (fuse_series) fuseSeries();
+  if (merge_jpegs) mergeJpegSeries();
+}
+
+//Stride of the next bracket so its frames, at the time per frame of the
+//series that just ended (its processing included), fit in the budget of the
+//interval. Goes back down by itself once the series are fast enough
+int seriesStride(int64_t duration_ns, int frames)
+{
+  double per_frame = (double)duration_ns/frames;
+  int stride;
+  for (stride = 1; stride < SERIES_LENGTH - 1; stride++) {
+    int steps = (SERIES_LENGTH - 1 + stride - 1)/stride + 1;
+    if (steps*stack_frames*per_frame <=
+        series_interval*1e9*SCHEDULE_BUDGET) break;
+  }
+  return stride;
+}
+
+//Appends the start of a series of the time-lapse to the schedule log
+void logSeries(const schedule_t* schedule, int stride, int64_t duration_ns)
+{
+  FILE* log = fopen(SCHEDULE_LOG, "a");
+  if (!log) {
+    fprintf(stderr, "error: fopen %s\n", SCHEDULE_LOG);
+    exit(1);
+  }
+  fprintf(log, "%s slot %lli jitter_us %lli stride %i frames %i "
+          "duration_ms %lli skipped %i\n", series_name,
+          (long long)schedule->slot, (long long)schedule->jitter_ns/1000,
+          stride, frame_count, (long long)duration_ns/1000000,
+          schedule->skipped);
+  fclose(log);
+  printf("series %s: slot %lli, start jitter %.3f ms, stride %i, %i frames "
+         "in %.1f s\n", series_name, (long long)schedule->slot,
+         schedule->jitter_ns*1e-6, stride, frame_count, duration_ns*1e-9);
+}
+
+void usage(const char* name)
+{
+  fprintf(stderr,
+          "usage: %s [-r left,top,width,height] [-m] [-n] [-H] [-s] [-a]\n"
+          "          [-d bilinear|edge] [-t reinhard|filmic|local] [-j] [-f] [-A] [-g]\n"
+          "          [-J] [-R] [-D] [-k] [-B] [-b] [-S frames] [-c] [-z] [-Z] [-u]\n"
+          "          [-v raw|h264|mjpeg] [-F fps] [-P seconds]\n"
+          "          [-I seconds [-C count]] [-T role,priority[,cpu...]] [-L]\n"
+          "          [-M megabytes]\n"
+          "  -r  region of interest in percent of the sensor (default %i,%i,%i,%i)\n"
+          "  -m  merge the raw data of the series into <date>.pfm\n"
+          "  -n  raw-only, capture the still port without the JPEG encoder\n"
+          "  -H  back the frame arena with huge pages\n"
+          "  -L  lock the frame arena and the pre-trigger store (-P) in RAM\n"
+          "  -s  write a <frame>.meta sidecar next to every frame\n"
+          "  -a  adaptive bracketing, stop when frames add no information\n"
+          "  -d  merge (-m) and demosaic the radiance map into <date>-rgb.pfm\n"
+          "  -t  demosaic (-d, bilinear by default) and tone map into <date>-hdr.ppm\n"
+          "  -j  encode the tone mapped (or fused) image with image_encode into .jpg\n"
+          "  -f  fuse the JPEGs of the series into <date>-fused.ppm\n"
+          "  -A  merge (-m) with the frames aligned to compensate camera motion\n"
+          "  -g  merge (-m) with a second pass weighting down moving objects\n"
+          "  -J  merge the JPEGs through the cached response into <date>-jpeg.pfm\n"
+          "  -R  solve the response curve from this series and cache it (-J)\n"
+          "  -D  average the frames into the dark frame library (cap the lens)\n"
+          "  -k  merge (-m) with the dark frames of the library subtracted\n"
+          "  -B  detect the hot and dead pixels of the ROI into the defect map\n"
+          "  -b  merge (-m) with the pixels of the defect map interpolated\n"
+          "  -S  capture every exposure this many times and merge their mean\n"
+          "  -c  reject outliers from the mean of the stacked frames (-S)\n"
+          "  -z  archive the raw data losslessly compressed in <frame>.rawz\n"
+          "  -Z  archive (-z) the frames as deltas to a well exposed one\n"
+          "  -u  capture the exposures shorter than a frame in burst mode\n"
+          "  -v  stream the video port into <date>.<format> until interrupted\n"
+          "  -F  framerate of the stream (-v, default %i)\n"
+          "  -P  hold the last seconds of the stream (-v), SIGUSR1 saves them\n"
+          "  -I  time-lapse, start a series every this many seconds until stopped\n"
+          "  -C  number of series of the time-lapse (-I)\n"
+          "  -T  run the control, callback or pool threads with this SCHED_FIFO\n"
+          "      priority (0 for none) on these CPUs (default any)\n"
+          "  -M  memory of the frames and the processing stages, the capture waits\n"
+          "      for it (default %i%% of the available memory)\n",
+          name, CAM_ROI_LEFT, CAM_ROI_TOP, CAM_ROI_WIDTH, CAM_ROI_HEIGHT,
+          STREAM_FRAMERATE, (int)(BUDGET_FRACTION*100));
+  exit(1);
+}
+
+//-T role,priority[,cpu...]
+void parseRole(const char* spec, const char* name)
+{
+  char role_name[16];
+  int priority, length, cpu;
+  unsigned long cpus = 0;
+  if (sscanf(spec, "%15[^,],%i%n", role_name, &priority, &length) != 2 ||
+      role_find(role_name) < 0 || priority < 0 || priority > 99)
+    usage(name);
+  spec += length;
+  while (*spec) {
+    if (sscanf(spec, ",%i%n", &cpu, &length) != 1 || cpu < 0 ||
+        cpu >= 8*(int)sizeof (cpus))
+      usage(name);
+    cpus |= 1UL << cpu;
+    spec += length;
+  }
+  role_configure(role_find(role_name), priority, cpus);
+}
+
+int main (int argc, char** argv){
+  OMX_ERRORTYPE error;
+  //Output buffers of the encoder (or of the camera in raw-only mode), one per
+  //arena slot
+  arena_t frame_arena;
+  OMX_BUFFERHEADERTYPE* output_buffers[ARENA_SLOTS];
+  component_t camera;
+  component_t null_sink;
+  component_t encoder;
+  camera.name = "OMX.broadcom.camera";
+  null_sink.name = "OMX.broadcom.null_sink";
+  encoder.name = "OMX.broadcom.image_encode";
+
+#ifdef DBG_PID
+  pid_t pid = getpid();
+  pid_t tid = syscall(SYS_gettid);
+  //pthread_t tid = pthread_self();
+  printf("main pid = %i tid = %i\n", pid, tid);
+#endif
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:mnHLsad:t:jfAgJRDkBbS:czZuv:F:P:I:C:T:M:")) != -1) {
+    switch (opt) {
+    case 'r':
+      if (sscanf(optarg, "%lf,%lf,%lf,%lf", &roi_percentages[0],
+                 &roi_percentages[1], &roi_percentages[2],
+                 &roi_percentages[3]) != 4)
+        usage(argv[0]);
+      break;
+    case 'm':
+      merge_series = 1;
+      break;
+    case 'n':
+      raw_only = 1;
+      break;
+    case 'H':
+      huge_pages = 1;
+      break;
+    case 'L':
+      lock_buffers = 1;
+      break;
+    case 's':
+      write_sidecars = 1;
+      break;
+    case 'a':
+      adaptive_bracketing = 1;
+      break;
+    case 'd':
+      if (demosaic_parse_mode(optarg, &demosaic_mode)) usage(argv[0]);
+      demosaic_merge = 1;
+      merge_series = 1;
+      break;
+    case 't':
+      if (tonemap_parse_operator(optarg, &tonemap_operator)) usage(argv[0]);
+      tonemap_merge = 1;
+      demosaic_merge = 1;
+      merge_series = 1;
+      break;
+    case 'j':
+      encode_tonemapped = 1;
+      break;
+    case 'f':
+      fuse_series = 1;
+      break;
+    case 'A':
+      align_series = 1;
+      merge_series = 1;
+      break;
+    case 'g':
+      deghost_merge = 1;
+      merge_series = 1;
+      break;
+    case 'J':
+      merge_jpegs = 1;
+      break;
+    case 'R':
+      recalibrate_response = 1;
+      merge_jpegs = 1;
+      break;
+    case 'D':
+      dark_capture = 1;
+      break;
+    case 'k':
+      dark_subtraction = 1;
+      merge_series = 1;
+      break;
+    case 'B':
+      defect_detection = 1;
+      break;
+    case 'b':
+      defect_correction = 1;
+      merge_series = 1;
+      break;
+    case 'S':
+      stack_frames = atoi(optarg);
+      if (stack_frames < 1 || stack_frames > STACK_MAX_FRAMES) usage(argv[0]);
+      break;
+    case 'c':
+      stack_clip = 1;
+      break;
+    case 'z':
+      compress_frames = 1;
+      break;
+    case 'Z':
+      compress_frames = 1;
+      delta_archive = 1;
+      break;
+    case 'u':
+      burst_capture = 1;
+      break;
+    case 'v':
+      if (!strcmp(optarg, "raw")) stream_mode = STREAM_RAW;
+      else if (!strcmp(optarg, "h264")) stream_mode = STREAM_H264;
+      else if (!strcmp(optarg, "mjpeg")) stream_mode = STREAM_MJPEG;
+      else usage(argv[0]);
+      break;
+    case 'F':
+      stream_framerate = atof(optarg);
+      if (stream_framerate <= 0) usage(argv[0]);
+      break;
+    case 'P':
+      pre_trigger = atof(optarg);
+      if (pre_trigger <= 0) usage(argv[0]);
+      break;
+    case 'I':
+      series_interval = atof(optarg);
+      if (series_interval <= 0) usage(argv[0]);
+      break;
+    case 'C':
+      series_count = atoi(optarg);
+      if (series_count < 1) usage(argv[0]);
+      break;
+    case 'T':
+      parseRole(optarg, argv[0]);
+      break;
+    case 'M':
+      memory_budget = atof(optarg);
+      if (memory_budget <= 0) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (series_count && series_interval <= 0) usage(argv[0]);
+  if ((fuse_series || merge_jpegs) && raw_only) {
+    fprintf(stderr, "error: -f and -J need the JPEGs, they cannot be used "
+            "with -n\n");
+    exit(1);
+  }
+  if (encode_tonemapped && !tonemap_merge && !fuse_series) {
+    fprintf(stderr, "error: -j encodes the tone mapped or fused image, it "
+            "needs -t or -f\n");
+    exit(1);
+  }
+  //Only the merge takes the mean of a stack, nothing else is made of it
+  if (stack_frames > 1 && !merge_series) {
+    fprintf(stderr, "error: -S stacks the frames for the merge, it needs -m "
+            "or an option implying it\n");
+    exit(1);
+  }
+  if (stream_mode != STREAM_NONE &&
+      (raw_only || merge_series || fuse_series || merge_jpegs || dark_capture ||
+       defect_detection || compress_frames || adaptive_bracketing ||
+       burst_capture || stack_frames > 1 || series_interval > 0)) {
+    fprintf(stderr, "error: -v streams the video port, it cannot be used "
+            "with the options of a series\n");
+    exit(1);
+  }
+  budget_init(memory_budget*1024*1024);
+  raw_roi_from_percentages(&roi, roi_percentages[0], roi_percentages[1],
+                           roi_percentages[2], roi_percentages[3]);
+  printf("ROI %ix%i at %i,%i\n", roi.width, roi.height, roi.left, roi.top);
+  //The fusion runs after the whole series, find out now if it cannot
+  if (fuse_series) {
+    size_t size = fusion_size(roi.width, roi.height) +
+      (size_t)fusedStride()*fusedRows();
+    if (size > budget_room()) {
+      fprintf(stderr, "error: -f needs %.1f MB for the ROI, %.1f MB of the "
+              "budget are left; reduce the ROI with -r or raise -M\n",
+              size/(1024.0*1024.0), budget_room()/(1024.0*1024.0));
+      exit(1);
+    }
+  }
+
+  if (dark_capture) {
+    //The masters cover the sensor, raw-only frames only cover the ROI
+    if (raw_only && (roi.width != RAW_WIDTH || roi.height != RAW_HEIGHT)) {
+      fprintf(stderr, "error: -D with -n needs the full sensor as ROI\n");
+      exit(1);
+    }
+    dark_open(&dark_library, DARK_LIBRARY, 1);
+    dark_pixels = budget_malloc(BUDGET_CALIBRATION,
+                                sizeof (unsigned short)*RAW_WIDTH*RAW_HEIGHT);
+    if (!dark_pixels) {
+      fprintf(stderr, "error: out of memory\n");
+      exit(1);
+    }
+  } else if (dark_subtraction && !dark_open(&dark_library, DARK_LIBRARY, 0)) {
+    printf("no dark frame library %s, nothing is subtracted\n", DARK_LIBRARY);
+  }
+  if (defect_detection || defect_correction) {
+    if (!defect_load(&defect_map, DEFECT_MAP) && defect_correction)
+      printf("no defect map %s, nothing is corrected\n", DEFECT_MAP);
+    printf("%i defective pixels in %s\n", defect_map.count, DEFECT_MAP);
+  }
+  if (defect_detection) {
+    defect_builder_init(&defect_builder, &roi);
+    defect_builder_load(&defect_builder, DEFECT_COUNTS);
+    defect_pixels = budget_malloc(BUDGET_CALIBRATION,
+                                  sizeof (unsigned short)*roi.width*roi.height);
+    if (!defect_pixels) {
+      fprintf(stderr, "error: out of memory\n");
+      exit(1);
+    }
+  }
+  if (compress_frames) {
+    compress_pixels = budget_malloc(BUDGET_COMPRESS,
+                                    sizeof (unsigned short)*roi.width*roi.height);
+    if (delta_archive)
+      delta_pixels = budget_malloc(BUDGET_COMPRESS,
+                                   sizeof (unsigned short)*roi.width*roi.height);
+    if (!compress_pixels || (delta_archive && !delta_pixels)) {
+      fprintf(stderr, "error: out of memory\n");
+      exit(1);
+    }
+  }
+
+  //A stream has buffers of its own and no frames
+  if (stream_mode == STREAM_NONE) {
+    arena_init(&frame_arena, ARENA_SLOTS, ARENA_SLOT_SIZE, huge_pages);
+    if (lock_buffers) arena_lock(&frame_arena);
+  }
+
+  //Initialize Broadcom's VideoCore APIs
+  bcm_host_init ();
+
+  //Initialize OpenMAX IL
+  if ((error = OMX_Init ())){
+    fprintf (stderr, "error: OMX_Init: %s\n", dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  //After the threads of the OMX core are started, they keep the default
+  //scheduling unless they run the callbacks
+  role_enter (ROLE_CONTROL);
+
+  //Initialize components
+  init_component (&camera);
+  init_component (&null_sink);
+  if (!raw_only && stream_mode == STREAM_NONE) init_component (&encoder);
+
+  //Initialize camera drivers
+  load_camera_drivers (&camera);
+  readCameraIdentity(&camera);
+
+  //Configure camera sensor
+  printf ("configuring '%s' sensor\n", camera.name);
+  OMX_PARAM_SENSORMODETYPE sensor;
+  OMX_INIT_STRUCTURE (sensor);
+  sensor.nPortIndex = OMX_ALL;
+  OMX_INIT_STRUCTURE (sensor.sFrameSize);
+  sensor.sFrameSize.nPortIndex = OMX_ALL;
+  if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamCommonSensorMode,
+				 &sensor))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+	     dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  //A stream runs the sensor continuously
+  sensor.bOneShot = stream_mode == STREAM_NONE ? OMX_TRUE : OMX_FALSE;
+  sensor.sFrameSize.nWidth = CAM_WIDTH;
+  sensor.sFrameSize.nHeight = CAM_HEIGHT;
+  if ((error = OMX_SetParameter (camera.handle, OMX_IndexParamCommonSensorMode,
+				 &sensor))){
+    fprintf (stderr, "error: OMX_SetParameter6: %s\n",
+	     dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+
+  OMX_CONFIG_FRAMERATETYPE framerate;
+  OMX_INIT_STRUCTURE(framerate);
+  framerate.nPortIndex = 70;
+  /* framerate.xEncodeFramerate = (1<<16)/6; */
+  if ((error = OMX_GetParameter (camera.handle, OMX_IndexConfigVideoFramerate,
+                                 &framerate))){
+    fprintf (stderr, "error: OMX_SetParameter6b: %s\n",
+             dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+
+  fprintf(stderr, "xEncodeFramerate = %g\n", framerate.xEncodeFramerate/(double)(1<<16));
+
+  /* OMX_CONFIG_FRAMERATETYPE framerate; */
+  /* OMX_INIT_STRUCTURE(framerate); */
+  /* framerate.nPortIndex = 70; */
+  /* framerate.xEncodeFramerate = (1<<16)/6; */
+  /* if ((error = OMX_SetParameter (camera.handle, OMX_IndexConfigVideoFramerate, */
+  /*     &framerate))){ */
+  /*   fprintf (stderr, "error: OMX_SetParameter6b: %s\n", */
+  /*       dump_OMX_ERRORTYPE (error)); */
+  /*   exit (1); */
+  /* } */
+
+  dumpSensorModes(&camera);
+
+  //Configure camera port definition
+  printf ("configuring '%s' port definition\n", camera.name);
+  OMX_PARAM_PORTDEFINITIONTYPE port_def;
+  OMX_INIT_STRUCTURE (port_def);
+  port_def.nPortIndex = 72;
+  if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamPortDefinition,
+				 &port_def))){
+    fprintf (stderr, "error: OMX_GetParameter: %s\n",
+	     dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  //The still port delivers the cropped ROI unscaled
+  port_def.format.image.nFrameWidth = roi.width;
+  port_def.format.image.nFrameHeight = roi.height;
+  port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+  port_def.format.image.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+  //Stride is byte-per-pixel*width, YUV has 1 byte per pixel, so the stride is
+  //the width (rounded up to the nearest multiple of 16).
+  //See mmal/util/mmal_util.c, mmal_encoding_width_to_stride()
+  port_def.format.image.nStride = round_up (roi.width, 32);
+  if (raw_only){
+    //Without the encoder the still port is read directly, 4 pixels in 5 bytes
+    port_def.format.image.eColorFormat = RAW_ONLY_COLOR_FORMAT;
+    port_def.format.image.nStride = round_up (roi.width*5/4, 32);
+  }
+  if ((error = OMX_SetParameter (camera.handle, OMX_IndexParamPortDefinition,
+				 &port_def))){
+    fprintf (stderr, "error: OMX_SetParameter7: %s\n",
+	     dump_OMX_ERRORTYPE (error));
+    exit (1);
+  }
+  if (raw_only){
+    //The component may pad the stride further
+    if ((error = OMX_GetParameter (camera.handle, OMX_IndexParamPortDefinition,
+				   &port_def))){
+      fprintf (stderr, "error: OMX_GetParameter: %s\n",
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+    raw_only_stride = port_def.format.image.nStride;
+    raw_only_roi.width = roi.width;
+    raw_only_roi.height = roi.height;
+    printf ("raw-only stride %i, buffer size %i\n", raw_only_stride,
+	    port_def.nBufferSize);
+  }
+
+  //Configure preview port
+  //In theory the fastest resolution and framerate are 1920x1080 @30fps because
+  //these are the default settings for the preview port, so the frames don't
+  //need to be resized. In practice, this is not true. The fastest way to
+  //produce stills is setting the lowest resolution, that is, 640x480 @30fps.
+  //The difference between 1920x1080 @30fps and 640x480 @30fps is a speed boost
+  //of ~4%, from ~1083ms to ~1039ms
   port_def.nPortIndex = 70;
   port_def.format.video.eCompressionFormat = OMX_IMAGE_CodingUnused;
   port_def.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
@@ -1251,7 +3623,8 @@ int main (){
   //The higher the speed, the higher the capture time
   //  if (CAM_SHUTTER_SPEED > 1000000)
   {
-    port_def.format.video.xFramerate = (1<<16);
+    port_def.format.video.xFramerate = stream_mode == STREAM_NONE ? (1<<16) :
+      stream_framerate*(1<<16);
     port_def.format.video.nFrameWidth = 1920;
     port_def.format.video.nFrameHeight = 1080;
     port_def.format.video.nStride = 1920;
@@ -1271,33 +3644,52 @@ int main (){
   //Configure camera settings
   set_camera_settings (&camera);
 
-  //Configure encoder port definition
-  printf ("configuring '%s' port definition\n", encoder.name);
-  OMX_INIT_STRUCTURE (port_def);
-  port_def.nPortIndex = 341;
-  if ((error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
-				 &port_def))){
-    fprintf (stderr, "error: OMX_SetParameter8: %s\n",
-	     dump_OMX_ERRORTYPE (error));
-    exit (1);
-  }
-  port_def.format.image.nFrameWidth = CAM_WIDTH;
-  port_def.format.image.nFrameHeight = CAM_HEIGHT;
-  port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
-  port_def.format.image.eColorFormat = OMX_COLOR_FormatUnused;
-  if ((error = OMX_SetParameter (encoder.handle, OMX_IndexParamPortDefinition,
-				 &port_def))){
-    fprintf (stderr, "error: OMX_SetParameter9: %s\n",
-	     dump_OMX_ERRORTYPE (error));
-    exit (1);
-  }
+  if (stream_mode != STREAM_NONE){
+    streamVideo (&camera, &null_sink);
+    deinit_component (&camera);
+    deinit_component (&null_sink);
+    if ((error = OMX_Deinit ())){
+      fprintf (stderr, "error: OMX_Deinit: %s\n", dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+    bcm_host_deinit ();
+    role_dump ();
+    budget_dump ();
+    printf ("ok\n");
+    return 0;
+  }
+
+  if (!raw_only){
+    //Configure encoder port definition
+    printf ("configuring '%s' port definition\n", encoder.name);
+    OMX_INIT_STRUCTURE (port_def);
+    port_def.nPortIndex = 341;
+    if ((error = OMX_GetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+				   &port_def))){
+      fprintf (stderr, "error: OMX_SetParameter8: %s\n",
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
+    port_def.format.image.nFrameWidth = roi.width;
+    port_def.format.image.nFrameHeight = roi.height;
+    port_def.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+    port_def.format.image.eColorFormat = OMX_COLOR_FormatUnused;
+    if ((error = OMX_SetParameter (encoder.handle, OMX_IndexParamPortDefinition,
+				   &port_def))){
+      fprintf (stderr, "error: OMX_SetParameter9: %s\n",
+	       dump_OMX_ERRORTYPE (error));
+      exit (1);
+    }
 
-  //Configure JPEG settings
-  set_jpeg_settings (&encoder);
+    //Configure JPEG settings
+    set_jpeg_settings (&encoder);
+  }
 
   //Setup tunnels: camera (still) -> image_encode, camera (preview) -> null_sink
+  //In raw-only mode the still port is not tunneled, its buffer is read directly
   printf ("configuring tunnels\n");
-  if ((error = OMX_SetupTunnel (camera.handle, 72, encoder.handle, 340))){
+  if (!raw_only &&
+      (error = OMX_SetupTunnel (camera.handle, 72, encoder.handle, 340))){
     fprintf (stderr, "error: OMX_SetupTunnel: %s\n",
 	     dump_OMX_ERRORTYPE (error));
     exit (1);
@@ -1313,8 +3705,10 @@ int main (){
   wait (&camera, EVENT_STATE_SET, 0);
   change_state (&null_sink, OMX_StateIdle);
   wait (&null_sink, EVENT_STATE_SET, 0);
-  change_state (&encoder, OMX_StateIdle);
-  wait (&encoder, EVENT_STATE_SET, 0);
+  if (!raw_only){
+    change_state (&encoder, OMX_StateIdle);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
 
   //  sleep(120);
 
@@ -1331,6 +3725,15 @@ int main (){
     }
 
     fprintf(stderr, "xEncodeFramerate = %g\n", framerate.xEncodeFramerate/(double)(1<<16));
+    preview_framerate = framerate.xEncodeFramerate;
+
+    //Not every firmware reports the sensor mode, 0 is recorded then
+    OMX_PARAM_U32TYPE mode;
+    OMX_INIT_STRUCTURE(mode);
+    mode.nPortIndex = OMX_ALL;
+    if (!OMX_GetParameter (camera.handle, OMX_IndexParamCameraCustomSensorConfig,
+                           &mode))
+      sensor_mode = mode.nU32;
   }
   /* { */
   /* OMX_CONFIG_FRAMERATETYPE framerate; */
@@ -1351,11 +3754,15 @@ int main (){
   enable_port (&null_sink, 240);
   wait (&null_sink, EVENT_PORT_ENABLE, 0);
 
-  enable_port (&camera, 72);
-  wait (&camera, EVENT_PORT_ENABLE, 0);
-  enable_port (&encoder, 340);
-  wait (&encoder, EVENT_PORT_ENABLE, 0);
-  enable_encoder_output_port (&encoder, &encoder_output_buffer);
+  if (raw_only){
+    enable_output_port (&camera, 72, &frame_arena, output_buffers);
+  } else {
+    enable_port (&camera, 72);
+    wait (&camera, EVENT_PORT_ENABLE, 0);
+    enable_port (&encoder, 340);
+    wait (&encoder, EVENT_PORT_ENABLE, 0);
+    enable_output_port (&encoder, 341, &frame_arena, output_buffers);
+  }
 
   /* { */
   /* OMX_CONFIG_FRAMERATETYPE framerate; */
@@ -1375,117 +3782,101 @@ int main (){
   wait (&camera, EVENT_STATE_SET, 0);
   change_state (&null_sink, OMX_StateExecuting);
   wait (&null_sink, EVENT_STATE_SET, 0);
-  change_state (&encoder, OMX_StateExecuting);
-  wait (&encoder, EVENT_STATE_SET, 0);
-
-  OMX_CONFIG_PORTBOOLEANTYPE cameraCapturePort;
-  OMX_INIT_STRUCTURE (cameraCapturePort);
-  sleep(2);
-  //Start consuming the buffers
-  VCOS_UNSIGNED end_flags = EVENT_BUFFER_FLAG | EVENT_FILL_BUFFER_DONE;
-  VCOS_UNSIGNED retrieves_events;
-  //Enable camera capture port. This basically says that the port 72 will be
-  //used to get data from the camera. If you're capturing video, the port 71
-  //must be used
-  printf ("enabling '%s' capture port\n", camera.name);
-  cameraCapturePort.nPortIndex = 72;
-  cameraCapturePort.bEnabled = OMX_TRUE;
-  if ((error = OMX_SetConfig (camera.handle, OMX_IndexConfigPortCapturing,
-			      &cameraCapturePort))){
-    fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
-    exit (1);
+  if (!raw_only){
+    change_state (&encoder, OMX_StateExecuting);
+    wait (&encoder, EVENT_STATE_SET, 0);
   }
 
-  int i = 0;
+  sleep(2);
+  schedule_t schedule;
+  if (series_interval > 0) {
+    //A stop ends the time-lapse after the series in progress
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    schedule_init(&schedule, series_interval*1e9);
+    printf("time-lapse every %.1f s, the first series starts in %.1f s\n",
+           series_interval,
+           (schedule.origin_ns - meta_now(CLOCK_MONOTONIC))*1e-9);
+  }
+  bracket_t bracket;
+  int stride = 1;
+  int series = 0;
+  int64_t series_start = 0;
+  //The last series is finished once the graph is down, like a single one
+  int last_series = 0;
   while (1){
-    while (1){
-      //Get the buffer data (a slice of the image)
-      if ((error = OMX_FillThisBuffer (encoder.handle, encoder_output_buffer))){
-        fprintf (stderr, "error: OMX_FillThisBuffer: %s\n",
-                 dump_OMX_ERRORTYPE (error));
-        exit (1);
-      }
-
-      //Wait until it's filled
-      wait (&encoder, EVENT_FILL_BUFFER_DONE, &retrieves_events);
-
-      //Append the buffer into the file
-      if (pwrite (fd, encoder_output_buffer->pBuffer,
-                  encoder_output_buffer->nFilledLen,
-                  encoder_output_buffer->nOffset) == -1){
-        fprintf (stderr, "error: pwrite\n");
-        exit (1);
-      }
-
-      fprintf(stderr, "LOOP event = %i\n", retrieves_events);
-
-      //When it's the end of the stream, an OMX_EventBufferFlag is emitted in the
-      //camera and image_encode components. Then the FillBufferDone function is
-      //called in the image_encode
-      if (retrieves_events == end_flags){
-        //Clear the EOS flags
-        wait (&camera, EVENT_BUFFER_FLAG, 0);
-        wait (&encoder, EVENT_BUFFER_FLAG, 0);
-
-        break;
-      }
+    if (series_interval > 0) {
+      int64_t slot;
+      while ((slot = schedule_wait(&schedule)) < 0 && !stop_requested);
+      if (slot < 0) break;
+      series_slot = slot;
+      role_wakeup(ROLE_CONTROL, schedule.jitter_ns);
     }
-    closeFile();
-    if (18<++i) break;
-    int speed = 1000000>>(18-i);
-    printf ("------NEXT FRAME------------------------------------------\n");
-    openNewFile(speed);
-
-    setExp(&camera, speed);
-
-    printf ("enabling '%s' capture port\n", camera.name);
-    cameraCapturePort.nPortIndex = 72;
-    cameraCapturePort.bEnabled = OMX_TRUE;
-    if ((error = OMX_SetConfig (camera.handle, OMX_IndexConfigPortCapturing,
-                                &cameraCapturePort))){
-      fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
-      exit (1);
+    beginSeries(&bracket, stride);
+    series_start = meta_now(CLOCK_MONOTONIC);
+    captureSeries(&camera, &encoder, &frame_arena, output_buffers, &bracket);
+    if (series_interval <= 0 || stop_requested ||
+        ++series == series_count) {
+      last_series = 1;
+      break;
     }
-
+    endSeries();
+    int64_t duration = meta_now(CLOCK_MONOTONIC) - series_start;
+    logSeries(&schedule, stride, duration);
+    stride = seriesStride(duration, frame_count);
   }
-  printf ("------------------------------------------------\n");
 
   //Disable camera capture port
-  printf ("disabling '%s' capture port\n", camera.name);
-  cameraCapturePort.bEnabled = OMX_FALSE;
-  if ((error = OMX_SetConfig (camera.handle, OMX_IndexConfigPortCapturing,
-                              &cameraCapturePort))){
-    fprintf (stderr, "error: OMX_SetConfig: %s\n", dump_OMX_ERRORTYPE (error));
-    exit (1);
-  }
+  setCapturing(&camera, 72, OMX_FALSE);
+  if (burst_enabled) setBurst(&camera, OMX_FALSE);
 
   //Change state to IDLE
   change_state (&camera, OMX_StateIdle);
   wait (&camera, EVENT_STATE_SET, 0);
   change_state (&null_sink, OMX_StateIdle);
   wait (&null_sink, EVENT_STATE_SET, 0);
-  change_state (&encoder, OMX_StateIdle);
-  wait (&encoder, EVENT_STATE_SET, 0);
+  if (!raw_only){
+    change_state (&encoder, OMX_StateIdle);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
 
   //Disable the tunnel ports
-  disable_port (&camera, 72);
+  if (raw_only){
+    disable_output_port (&camera, 72, &frame_arena, output_buffers);
+  } else {
+    disable_port (&camera, 72);
+  }
   disable_port (&camera, 70);
   disable_port (&null_sink, 240);
-  disable_port (&encoder, 340);
-  disable_encoder_output_port (&encoder, encoder_output_buffer);
+  if (!raw_only){
+    disable_port (&encoder, 340);
+    disable_output_port (&encoder, 341, &frame_arena, output_buffers);
+  }
 
   //Change state to LOADED
   change_state (&camera, OMX_StateLoaded);
   wait (&camera, EVENT_STATE_SET, 0);
   change_state (&null_sink, OMX_StateLoaded);
   wait (&null_sink, EVENT_STATE_SET, 0);
-  change_state (&encoder, OMX_StateLoaded);
-  wait (&encoder, EVENT_STATE_SET, 0);
+  if (!raw_only){
+    change_state (&encoder, OMX_StateLoaded);
+    wait (&encoder, EVENT_STATE_SET, 0);
+  }
 
   //Deinitialize components
   deinit_component (&camera);
   deinit_component (&null_sink);
-  deinit_component (&encoder);
+  if (!raw_only) deinit_component (&encoder);
+
+  //The frames were merged as they arrived. The tone mapped result may still
+  //need image_encode, the fusion and the JPEG merge image_decode
+  if (last_series) {
+    endSeries();
+    if (series_interval > 0)
+      logSeries(&schedule, stride,
+                meta_now(CLOCK_MONOTONIC) - series_start);
+  }
+  if (series_interval > 0) schedule_dump(&schedule);
 
   //Deinitialize OpenMAX IL
   if ((error = OMX_Deinit ())){
@@ -1496,6 +3887,30 @@ int main (){
   //Deinitialize Broadcom's VideoCore APIs
   bcm_host_deinit ();
 
+  arena_dump(&frame_arena);
+  arena_free(&frame_arena);
+  if (dark_capture) {
+    dark_dump(&dark_library);
+    budget_free(dark_pixels);
+  }
+  dark_close(&dark_library);
+  if (defect_detection) {
+    //Detection replaces the map of the ROI from the counts of this and the
+    //earlier series, the merge above used the old one
+    int found = defect_builder_finish(&defect_builder, &defect_map);
+    printf("%i defective pixels in the ROI, %i frames added, %i in %s\n",
+           found, defect_builder.frames, defect_map.count, DEFECT_MAP);
+    defect_save(&defect_map, DEFECT_MAP);
+    defect_builder_save(&defect_builder, DEFECT_COUNTS);
+    defect_builder_free(&defect_builder);
+    budget_free(defect_pixels);
+  }
+  defect_free(&defect_map);
+  budget_free(compress_pixels);
+  budget_free(delta_pixels);
+  role_dump();
+  budget_dump();
+
   printf ("ok\n");
 
   return 0;
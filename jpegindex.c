@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "jpegindex.h"
+
+enum {
+  STATE_MARKER,
+  STATE_CODE,
+  STATE_LENGTH_HIGH,
+  STATE_LENGTH_LOW,
+  STATE_SEGMENT,
+  STATE_SCAN,
+  STATE_SCAN_FF,
+  STATE_TRAILER,
+  STATE_DONE
+};
+
+void jpeg_parser_init (jpeg_parser_t* parser){
+  memset (parser, 0, sizeof (*parser));
+  parser->state = STATE_MARKER;
+  parser->index.soi = parser->index.app1 = parser->index.app1_size = -1;
+  parser->index.thumbnail = parser->index.thumbnail_size = -1;
+  parser->index.sos = parser->index.eoi = parser->index.brcm = -1;
+}
+
+//Called with the offset of the 0xFF of the marker
+static void jpeg_parser_marker (jpeg_parser_t* parser, int marker,
+				int64_t offset){
+  parser->marker = marker;
+  switch (marker){
+  case 0xD8:
+    if (parser->index.soi < 0) parser->index.soi = offset;
+    parser->state = STATE_MARKER;
+    return;
+  case 0xD9:
+    parser->index.eoi = offset;
+    parser->state = STATE_TRAILER;
+    return;
+  case 0x01:
+  case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+  case 0xD4: case 0xD5: case 0xD6: case 0xD7:
+    //No length
+    parser->state = STATE_MARKER;
+    return;
+  case 0xE1:
+    if (parser->index.app1 < 0){
+      parser->index.app1 = offset;
+      parser->in_app1 = 1;
+      parser->history = 0;
+    }
+    break;
+  case 0xDA:
+    if (parser->index.sos < 0) parser->index.sos = offset;
+    break;
+  }
+  parser->state = STATE_LENGTH_HIGH;
+}
+
+static void jpeg_parser_segment_end (jpeg_parser_t* parser){
+  if (parser->in_app1){
+    parser->in_app1 = 0;
+    parser->index.app1_size = parser->pos - parser->index.app1;
+    if (parser->index.thumbnail >= 0 && parser->thumbnail_end > 0){
+      parser->index.thumbnail_size =
+	parser->thumbnail_end - parser->index.thumbnail;
+    } else {
+      parser->index.thumbnail = -1;
+    }
+  }
+  parser->state = parser->marker == 0xDA ? STATE_SCAN : STATE_MARKER;
+}
+
+void jpeg_parser_feed (
+		       jpeg_parser_t* parser,
+		       const unsigned char* data,
+		       size_t size){
+  size_t i = 0;
+  while (i < size && parser->state != STATE_DONE){
+    unsigned char byte = data[i];
+    switch (parser->state){
+    case STATE_MARKER:
+      //Anything else than 0xFF between segments is ignored
+      if (byte == 0xFF) parser->state = STATE_CODE;
+      break;
+    case STATE_CODE:
+      //0xFF is fill
+      if (byte != 0xFF) jpeg_parser_marker (parser, byte, parser->pos - 1);
+      break;
+    case STATE_LENGTH_HIGH:
+      parser->length = byte << 8;
+      parser->state = STATE_LENGTH_LOW;
+      break;
+    case STATE_LENGTH_LOW:
+      parser->length |= byte;
+      parser->remaining = parser->length - 2;
+      parser->state = STATE_SEGMENT;
+      if (parser->remaining <= 0){
+	parser->pos++;
+	i++;
+	jpeg_parser_segment_end (parser);
+	continue;
+      }
+      break;
+    case STATE_SEGMENT:
+      if (!parser->in_app1){
+	//Skip the whole segment or what is available of it
+	size_t n = size - i;
+	if (n > parser->remaining) n = parser->remaining;
+	parser->remaining -= n;
+	parser->pos += n;
+	i += n;
+	if (!parser->remaining) jpeg_parser_segment_end (parser);
+	continue;
+      }
+      //The thumbnail is the first SOI followed by a marker inside APP1, it
+      //ends with the last EOI of the segment
+      parser->history = (parser->history << 8) | byte;
+      if (parser->index.thumbnail < 0 &&
+	  (parser->history & 0xFFFFFF) == 0xFFD8FF){
+	parser->index.thumbnail = parser->pos - 2;
+      }
+      if (parser->index.thumbnail >= 0 &&
+	  (parser->history & 0xFFFF) == 0xFFD9){
+	parser->thumbnail_end = parser->pos + 1;
+      }
+      if (!--parser->remaining){
+	parser->pos++;
+	i++;
+	jpeg_parser_segment_end (parser);
+	continue;
+      }
+      break;
+    case STATE_SCAN: {
+      //Entropy coded data, only 0xFF can start a marker
+      const unsigned char* ff = memchr (data + i, 0xFF, size - i);
+      size_t n = ff ? (size_t)(ff - (data + i)) + 1 : size - i;
+      if (ff) parser->state = STATE_SCAN_FF;
+      parser->pos += n;
+      i += n;
+      continue;
+    }
+    case STATE_SCAN_FF:
+      if (byte == 0x00 || (byte >= 0xD0 && byte <= 0xD7)){
+	//Stuffed byte or restart marker
+	parser->state = STATE_SCAN;
+      } else if (byte != 0xFF){
+	jpeg_parser_marker (parser, byte, parser->pos - 1);
+      }
+      break;
+    case STATE_TRAILER:
+      //The raw block follows the JPEG
+      if (byte == "BRCM"[parser->brcm_match]){
+	if (++parser->brcm_match == 4){
+	  parser->index.brcm = parser->pos - 3;
+	  parser->state = STATE_DONE;
+	}
+      } else {
+	parser->brcm_match = byte == 'B';
+      }
+      break;
+    }
+    parser->pos++;
+    i++;
+  }
+  //Nothing left to find, only count the bytes
+  parser->pos += size - i;
+}
+
+void jpeg_index_dump (const jpeg_index_t* index){
+  printf ("| SOI | APP1      | thumbnail     | SOS      | EOI      | BRCM     |\n");
+  printf ("| %3lld | %4lld+%-4lld | %6lld+%-6lld | %8lld | %8lld | %8lld |\n",
+	  (long long)index->soi, (long long)index->app1,
+	  (long long)index->app1_size, (long long)index->thumbnail,
+	  (long long)index->thumbnail_size, (long long)index->sos,
+	  (long long)index->eoi, (long long)index->brcm);
+}
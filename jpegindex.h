@@ -0,0 +1,46 @@
+#ifndef JPEGINDEX_H
+#define JPEGINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Offsets of the parts of a captured frame, -1 when absent. The thumbnail is
+//the JPEG embedded in the EXIF APP1 segment, brcm the raw block header
+typedef struct {
+  int64_t soi;
+  int64_t app1;
+  int64_t app1_size;
+  int64_t thumbnail;
+  int64_t thumbnail_size;
+  int64_t sos;
+  int64_t eoi;
+  int64_t brcm;
+} jpeg_index_t;
+
+//Incremental marker parser. The slices of a frame are fed in order as they
+//arrive and are only read, never copied or buffered
+typedef struct {
+  int state;
+  //Stream offset of the next byte fed
+  int64_t pos;
+  //Bytes left in the current segment
+  int remaining;
+  int length;
+  int marker;
+  int in_app1;
+  //Last bytes seen inside APP1, to find the embedded thumbnail
+  uint32_t history;
+  int64_t thumbnail_end;
+  //Bytes of "BRCM" matched so far after EOI
+  int brcm_match;
+  jpeg_index_t index;
+} jpeg_parser_t;
+
+void jpeg_parser_init (jpeg_parser_t* parser);
+void jpeg_parser_feed (
+		       jpeg_parser_t* parser,
+		       const unsigned char* data,
+		       size_t size);
+void jpeg_index_dump (const jpeg_index_t* index);
+
+#endif
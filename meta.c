@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "meta.h"
+
+int64_t meta_now (int clock){
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void meta_write (FILE* f, const void* data, size_t size){
+  if (fwrite (data, size, 1, f) != 1){
+    fprintf (stderr, "error: fwrite metadata\n");
+    exit (1);
+  }
+}
+
+//The header is rewritten with the final count when the index is closed, the
+//entries are appended as the frames complete
+FILE* meta_index_open (const char* filename){
+  FILE* index = fopen (filename, "w+b");
+  if (!index){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  meta_index_header_t header;
+  memcpy (header.magic, META_INDEX_MAGIC, 4);
+  header.version = META_VERSION;
+  header.count = 0;
+  header.entry_size = sizeof (meta_index_entry_t);
+  meta_write (index, &header, sizeof (header));
+  return index;
+}
+
+void meta_index_append (
+			FILE* index,
+			const char* frame_filename,
+			const frame_meta_t* meta){
+  meta_index_entry_t entry;
+  memset (entry.filename, 0, sizeof (entry.filename));
+  strncpy (entry.filename, frame_filename, sizeof (entry.filename) - 1);
+  entry.meta = *meta;
+  meta_write (index, &entry, sizeof (entry));
+  fflush (index);
+}
+
+void meta_index_close (FILE* index){
+  long end = ftell (index);
+  meta_index_header_t header;
+  memcpy (header.magic, META_INDEX_MAGIC, 4);
+  header.version = META_VERSION;
+  header.count = (end - sizeof (header))/sizeof (meta_index_entry_t);
+  header.entry_size = sizeof (meta_index_entry_t);
+  fseek (index, 0, SEEK_SET);
+  meta_write (index, &header, sizeof (header));
+  if (fclose (index)){
+    fprintf (stderr, "error: fclose index\n");
+    exit (1);
+  }
+}
+
+//<frame>.meta: magic, version and the record
+void meta_write_sidecar (const char* frame_filename, const frame_meta_t* meta){
+  char filename[255];
+  snprintf (filename, sizeof (filename), "%s.meta", frame_filename);
+  FILE* f = fopen (filename, "wb");
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  uint32_t version = META_VERSION;
+  meta_write (f, META_SIDECAR_MAGIC, 4);
+  meta_write (f, &version, sizeof (version));
+  meta_write (f, meta, sizeof (*meta));
+  if (fclose (f)){
+    fprintf (stderr, "error: fclose %s\n", filename);
+    exit (1);
+  }
+}
+
+void meta_dump (const frame_meta_t* meta){
+  printf ("| req exp | exp    | analog gain | digital gain | lux | AWB R | "
+	  "AWB B | focus | bytes    |\n");
+  printf ("| %7u | %6u | %5u       | %5u        | %3u | %5u | %5u | %5u | "
+	  "%8u |\n", meta->requested_exposure, meta->exposure,
+	  meta->analog_gain, meta->digital_gain, meta->lux, meta->awb_red,
+	  meta->awb_blue, meta->focus, meta->bytes);
+}
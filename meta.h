@@ -0,0 +1,69 @@
+#ifndef META_H
+#define META_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define META_INDEX_MAGIC "SIDX"
+#define META_SIDECAR_MAGIC "FMET"
+#define META_VERSION 2
+#define META_FILENAME_SIZE 64
+//Offset of a part missing from the frame
+#define META_NO_OFFSET 0xFFFFFFFF
+
+//Per-frame metadata. Fixed size, no padding, written little endian as it is
+//in memory. The camera values are stored as reported in
+//OMX_CONFIG_CAMERASETTINGSTYPE, the gains and the framerate are Q16
+typedef struct {
+  //When the capture was armed
+  int64_t monotonic_ns;
+  int64_t wall_ns;
+  //Buffer timestamp of the last slice, in us
+  int64_t omx_timestamp;
+  uint32_t requested_exposure; //us
+  uint32_t exposure; //us
+  uint32_t analog_gain;
+  uint32_t digital_gain;
+  uint32_t lux;
+  uint32_t awb_red;
+  uint32_t awb_blue;
+  uint32_t focus;
+  uint32_t framerate;
+  uint32_t sensor_mode;
+  //Bytes produced by the encoder (or the still port in raw-only mode)
+  uint32_t bytes;
+  //Layout of the JPEG as indexed while its slices arrived (see jpegindex.h),
+  //so a reader can mmap the file and seek straight to a part
+  uint32_t app1_offset;
+  uint32_t app1_size;
+  uint32_t thumbnail_offset;
+  uint32_t thumbnail_size;
+  uint32_t sos_offset;
+  uint32_t eoi_offset;
+  uint32_t brcm_offset;
+} frame_meta_t;
+
+//Series index: header followed by one entry per frame
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t entry_size;
+} meta_index_header_t;
+
+typedef struct {
+  char filename[META_FILENAME_SIZE];
+  frame_meta_t meta;
+} meta_index_entry_t;
+
+int64_t meta_now (int clock);
+FILE* meta_index_open (const char* filename);
+void meta_index_append (
+			FILE* index,
+			const char* frame_filename,
+			const frame_meta_t* meta);
+void meta_index_close (FILE* index);
+void meta_write_sidecar (const char* frame_filename, const frame_meta_t* meta);
+void meta_dump (const frame_meta_t* meta);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "raw.h"
+
+void raw_roi_from_percentages (
+			       roi_t* roi,
+			       double left,
+			       double top,
+			       double width,
+			       double height){
+  //Grow the region to the packing/CFA alignment instead of shrinking it, so the
+  //requested area is always covered
+  int x0 = (int)floor (RAW_WIDTH*left/100) & ~3;
+  int y0 = (int)floor (RAW_HEIGHT*top/100) & ~1;
+  int x1 = ((int)ceil (RAW_WIDTH*(left + width)/100) + 3) & ~3;
+  int y1 = ((int)ceil (RAW_HEIGHT*(top + height)/100) + 1) & ~1;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > RAW_WIDTH) x1 = RAW_WIDTH;
+  if (y1 > RAW_HEIGHT) y1 = RAW_HEIGHT;
+  if (x1 <= x0 || y1 <= y0){
+    fprintf (stderr, "error: empty ROI\n");
+    exit (1);
+  }
+
+  roi->left = x0;
+  roi->top = y0;
+  roi->width = x1 - x0;
+  roi->height = y1 - y0;
+}
+
+//The firmware does 180 degree rotations with the sensor flips, so they change
+//the order of the raw block. 90 degrees are applied later in the ISP and leave
+//it alone. The ROI alignment keeps the order of the full frame
+cfa_t raw_cfa (int mirror_horizontal, int mirror_vertical, int rotation){
+  int order = RAW_CFA;
+  if (rotation == 180 || rotation == 270){
+    mirror_horizontal = !mirror_horizontal;
+    mirror_vertical = !mirror_vertical;
+  }
+  if (mirror_horizontal) order ^= 1;
+  if (mirror_vertical) order ^= 2;
+  return order;
+}
+
+//Returns the first byte of the pixel data or NULL if there is no raw block at
+//the end of the JPEG
+const unsigned char* raw_find (const unsigned char* data, size_t size){
+  if (size < RAW_BLOCK_SIZE) return NULL;
+  const unsigned char* block = data + size - RAW_BLOCK_SIZE;
+  if (memcmp (block, "BRCM", 4)) return NULL;
+  return block + RAW_HEADER_SIZE;
+}
+
+//Only the packed groups covering the ROI are touched, the rest of the ~10 MB
+//block is never read. stride is the distance between packed rows in bytes
+void raw_unpack (
+		 const unsigned char* raw,
+		 int stride,
+		 const roi_t* roi,
+		 unsigned short* pixels){
+  int groups = roi->width/4;
+  int x, y, k;
+  for (y=0; y<roi->height; y++){
+    const unsigned char* in = raw + (roi->top + y)*stride + roi->left/4*5;
+    unsigned short* out = pixels + y*roi->width;
+    for (x=0; x<groups; x++){
+      unsigned char low = in[4];
+      for (k=0; k<4; k++){
+	out[k] = (in[k] << 2) | ((low >> (2*k)) & 3);
+      }
+      in += 5;
+      out += 4;
+    }
+  }
+}
+
+//Maps a whole file, raw points to its first byte
+void raw_map_file (raw_map_t* map, const char* filename){
+  int fd = open (filename, O_RDONLY);
+  if (fd == -1){
+    fprintf (stderr, "error: open %s\n", filename);
+    exit (1);
+  }
+  struct stat st;
+  if (fstat (fd, &st)){
+    fprintf (stderr, "error: fstat %s\n", filename);
+    exit (1);
+  }
+  map->size = st.st_size;
+  map->data = mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map->data == MAP_FAILED){
+    fprintf (stderr, "error: mmap %s\n", filename);
+    exit (1);
+  }
+  close (fd);
+  map->raw = map->data;
+}
+
+//Maps a JPEG file and locates its raw block. offset is the one of the BRCM
+//header if known, negative to look for the block at the end of the file
+void raw_map (raw_map_t* map, const char* filename, long long offset){
+  raw_map_file (map, filename);
+  if (offset < 0){
+    map->raw = raw_find (map->data, map->size);
+  } else if (offset + RAW_BLOCK_SIZE <= map->size &&
+	     !memcmp (map->data + offset, "BRCM", 4)){
+    map->raw = map->data + offset + RAW_HEADER_SIZE;
+  } else {
+    map->raw = NULL;
+  }
+  if (!map->raw){
+    fprintf (stderr, "error: %s has no raw data\n", filename);
+    exit (1);
+  }
+}
+
+void raw_unmap (raw_map_t* map){
+  munmap (map->data, map->size);
+}
+
+void raw_load (
+	       const char* filename,
+	       long long offset,
+	       const roi_t* roi,
+	       unsigned short* pixels){
+  raw_map_t map;
+  raw_map (&map, filename, offset);
+  raw_unpack (map.raw, RAW_STRIDE, roi, pixels);
+  raw_unmap (&map);
+}
@@ -0,0 +1,74 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include <stddef.h>
+
+//Layout of the BRCM block appended to the JPEG when
+//OMX_IndexConfigCaptureRawImageURI is set (Camera Module v2, IMX219, full
+//sensor mode). The 10 bit pixels are packed 4 per 5 bytes: the first 4 bytes
+//hold the 8 most significant bits, the 5th byte the 2 least significant bits
+//of each pixel
+#define RAW_WIDTH 3280
+#define RAW_HEIGHT 2464
+#define RAW_HEADER_SIZE 32768
+//round_up (RAW_WIDTH*5/4, 32)
+#define RAW_STRIDE 4128
+//round_up (RAW_HEIGHT, 16)
+#define RAW_PADDED_HEIGHT 2480
+#define RAW_BLOCK_SIZE (RAW_HEADER_SIZE + RAW_STRIDE*RAW_PADDED_HEIGHT)
+#define RAW_BLACK_LEVEL 64
+#define RAW_WHITE_LEVEL 1023
+
+//Colour filter array order, named after the top left 2x2 block. Bit 0 is set
+//if red is in an odd column, bit 1 if it is in an odd row, so a horizontal
+//flip toggles bit 0 and a vertical flip bit 1
+typedef enum {
+  CFA_RGGB = 0,
+  CFA_GRBG = 1,
+  CFA_GBRG = 2,
+  CFA_BGGR = 3
+} cfa_t;
+
+//Order of the raw block without mirroring or rotation
+#define RAW_CFA CFA_BGGR
+
+//Region of interest in sensor pixels. left and width are multiples of 4 (one
+//packed group), top and height multiples of 2 (one Bayer row pair), so the CFA
+//phase of the region is the same as the one of the full frame
+typedef struct {
+  int left;
+  int top;
+  int width;
+  int height;
+} roi_t;
+
+//A JPEG file mapped read-only and the pixel data of its raw block
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  const unsigned char* raw;
+} raw_map_t;
+
+cfa_t raw_cfa (int mirror_horizontal, int mirror_vertical, int rotation);
+void raw_roi_from_percentages (
+			       roi_t* roi,
+			       double left,
+			       double top,
+			       double width,
+			       double height);
+const unsigned char* raw_find (const unsigned char* data, size_t size);
+void raw_unpack (
+		 const unsigned char* raw,
+		 int stride,
+		 const roi_t* roi,
+		 unsigned short* pixels);
+void raw_map_file (raw_map_t* map, const char* filename);
+void raw_map (raw_map_t* map, const char* filename, long long offset);
+void raw_unmap (raw_map_t* map);
+void raw_load (
+	       const char* filename,
+	       long long offset,
+	       const roi_t* roi,
+	       unsigned short* pixels);
+
+#endif
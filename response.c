@@ -0,0 +1,246 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "response.h"
+#include "budget.h"
+
+#define RESPONSE_GRID 32
+#define RESPONSE_MIDDLE (RESPONSE_LEVELS/2)
+
+//Hat weight, values near black and white say little about the exposure. Not
+//0 at the ends so that every pixel has a radiance
+static inline double response_weight (int z){
+  return z < RESPONSE_MIDDLE ? z + 1 : RESPONSE_LEVELS - z;
+}
+
+//Reads the sample locations (a RESPONSE_GRID square grid) of one frame
+void response_sample (
+		      response_samples_t* samples,
+		      const unsigned char* rgb,
+		      int width,
+		      int height,
+		      int stride,
+		      double time){
+  int i, c;
+  if (samples->frames == RESPONSE_MAX_FRAMES){
+    fprintf (stderr, "error: response: more than %i frames\n",
+	     RESPONSE_MAX_FRAMES);
+    exit (1);
+  }
+  for (i=0; i<RESPONSE_SAMPLES; i++){
+    int x = (2*(i % RESPONSE_GRID) + 1)*width/(2*RESPONSE_GRID);
+    int y = (2*(i/RESPONSE_GRID) + 1)*height/(2*RESPONSE_GRID);
+    const unsigned char* p = rgb + (size_t)y*stride + 3*x;
+    for (c=0; c<3; c++) samples->z[samples->frames][i][c] = p[c];
+  }
+  samples->log_time[samples->frames++] = log (time);
+}
+
+//Cholesky decomposition and solve of the symmetric positive definite n x n
+//system a x = b in place, x ends up in b
+static void response_cholesky (double* a, double* b, int n){
+  int i, j, k;
+  for (j=0; j<n; j++){
+    double d = a[j*n + j];
+    for (k=0; k<j; k++) d -= a[j*n + k]*a[j*n + k];
+    if (d <= 0){
+      fprintf (stderr, "error: response: system not positive definite\n");
+      exit (1);
+    }
+    d = sqrt (d);
+    a[j*n + j] = d;
+    for (i=j + 1; i<n; i++){
+      double s = a[i*n + j];
+      for (k=0; k<j; k++) s -= a[i*n + k]*a[j*n + k];
+      a[i*n + j] = s/d;
+    }
+  }
+  for (i=0; i<n; i++){
+    for (k=0; k<i; k++) b[i] -= a[i*n + k]*b[k];
+    b[i] /= a[i*n + i];
+  }
+  for (i=n - 1; i>=0; i--){
+    for (k=i + 1; k<n; k++) b[i] -= a[k*n + i]*b[k];
+    b[i] /= a[i*n + i];
+  }
+}
+
+//Debevec and Malik: minimise the sum over samples i and frames j of
+//(w (z) (g (z_ij) - ln E_i - ln t_j))^2 plus the smoothness term. The normal
+//equations are sparse: every log radiance ln E_i only couples to the levels
+//it was seen at, so the radiances are eliminated per sample (Schur
+//complement) and only a 256 x 256 system is solved, instead of one with a
+//row per sample and frame
+static void response_solve_channel (
+				    const response_samples_t* samples,
+				    int c,
+				    float* g){
+  int n = RESPONSE_LEVELS;
+  double* a = budget_calloc (BUDGET_CALIBRATION, (size_t)n*n, sizeof (double));
+  double b[RESPONSE_LEVELS] = { 0 };
+  int levels[RESPONSE_MAX_FRAMES];
+  double w2[RESPONSE_MAX_FRAMES];
+  int i, j, k;
+  if (!a){
+    fprintf (stderr, "error: response: out of memory\n");
+    exit (1);
+  }
+
+  for (i=0; i<RESPONSE_SAMPLES; i++){
+    //Block of the sample: diagonal d of ln E_i, coupling -w^2 to the levels
+    double d = 0, e = 0;
+    for (j=0; j<samples->frames; j++){
+      int z = samples->z[j][i][c];
+      double w = response_weight (z);
+      levels[j] = z;
+      w2[j] = w*w;
+      a[z*n + z] += w2[j];
+      b[z] += w2[j]*samples->log_time[j];
+      d += w2[j];
+      e -= w2[j]*samples->log_time[j];
+    }
+    for (j=0; j<samples->frames; j++){
+      b[levels[j]] += w2[j]*e/d;
+      for (k=0; k<samples->frames; k++){
+	a[levels[j]*n + levels[k]] -= w2[j]*w2[k]/d;
+      }
+    }
+  }
+
+  //The smoothness is scaled with the number of data rows, so the trade off
+  //does not depend on RESPONSE_SAMPLES or the length of the series
+  double lambda = RESPONSE_SMOOTHNESS*
+    sqrt ((double)RESPONSE_SAMPLES*samples->frames/n);
+  for (k=1; k<n - 1; k++){
+    static const double stencil[3] = { 1, -2, 1 };
+    double s = lambda*response_weight (k);
+    for (i=0; i<3; i++){
+      for (j=0; j<3; j++){
+	a[(k - 1 + i)*n + k - 1 + j] += s*s*stencil[i]*stencil[j];
+      }
+    }
+  }
+  //g (128) = 0 removes the free offset, weighted like a well exposed sample
+  double fix = response_weight (RESPONSE_MIDDLE);
+  a[RESPONSE_MIDDLE*n + RESPONSE_MIDDLE] += fix*fix;
+
+  response_cholesky (a, b, n);
+  //A response is monotonic, noise in sparsely sampled levels is not
+  for (k=0; k<n; k++){
+    g[k] = k && b[k] < g[k - 1] ? g[k - 1] : b[k];
+  }
+  budget_free (a);
+}
+
+void response_solve (const response_samples_t* samples, response_t* response){
+  int c;
+  if (samples->frames < 2){
+    fprintf (stderr, "error: response: needs at least 2 frames\n");
+    exit (1);
+  }
+  for (c=0; c<3; c++) response_solve_channel (samples, c, response->g[c]);
+}
+
+//Returns 0 if there is no cached curve
+int response_load (response_t* response, const char* filename){
+  FILE* f = fopen (filename, "r");
+  int version, z;
+  if (!f) return 0;
+  if (fscanf (f, "crf %i\n", &version) != 1 || version != RESPONSE_VERSION){
+    fprintf (stderr, "error: %s is not a response curve\n", filename);
+    exit (1);
+  }
+  for (z=0; z<RESPONSE_LEVELS; z++){
+    if (fscanf (f, "%f %f %f\n", &response->g[0][z], &response->g[1][z],
+		&response->g[2][z]) != 3){
+      fprintf (stderr, "error: %s: level %i missing\n", filename, z);
+      exit (1);
+    }
+  }
+  fclose (f);
+  return 1;
+}
+
+void response_save (const response_t* response, const char* filename){
+  FILE* f = fopen (filename, "w");
+  int z;
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  fprintf (f, "crf %i\n", RESPONSE_VERSION);
+  for (z=0; z<RESPONSE_LEVELS; z++){
+    fprintf (f, "%.6f %.6f %.6f\n", response->g[0][z], response->g[1][z],
+	     response->g[2][z]);
+  }
+  if (fclose (f)){
+    fprintf (stderr, "error: fclose %s\n", filename);
+    exit (1);
+  }
+}
+
+void response_dump (const response_t* response){
+  int z;
+  printf ("| z   | g red   | g green | g blue  |\n");
+  for (z=0; z<RESPONSE_LEVELS; z+=32){
+    printf ("| %3i | %7.3f | %7.3f | %7.3f |\n", z, response->g[0][z],
+	    response->g[1][z], response->g[2][z]);
+  }
+}
+
+void response_merge_init (response_merge_t* merge, int width, int height){
+  size_t n = 3*(size_t)width*height;
+  merge->width = width;
+  merge->height = height;
+  merge->sum = budget_calloc (BUDGET_MERGE, n, sizeof (float));
+  merge->weight = budget_calloc (BUDGET_MERGE, n, sizeof (float));
+  if (!merge->sum || !merge->weight){
+    fprintf (stderr, "error: response_merge_init: out of memory\n");
+    exit (1);
+  }
+}
+
+void response_merge_free (response_merge_t* merge){
+  budget_free (merge->sum);
+  budget_free (merge->weight);
+  merge->sum = merge->weight = NULL;
+}
+
+//The curve, the exposure time and the weights are folded into lookup tables
+//once per frame, the pixels only index them
+void response_merge_add (
+			 response_merge_t* merge,
+			 const response_t* response,
+			 const unsigned char* rgb,
+			 int stride,
+			 double time){
+  float log_exposure[3][RESPONSE_LEVELS];
+  float weight[RESPONSE_LEVELS];
+  float log_time = log (time);
+  int x, y, c, z;
+  for (z=0; z<RESPONSE_LEVELS; z++){
+    weight[z] = response_weight (z);
+    for (c=0; c<3; c++){
+      log_exposure[c][z] = weight[z]*(response->g[c][z] - log_time);
+    }
+  }
+  for (y=0; y<merge->height; y++){
+    const unsigned char* p = rgb + (size_t)y*stride;
+    float* sum = merge->sum + 3*(size_t)y*merge->width;
+    float* w = merge->weight + 3*(size_t)y*merge->width;
+    for (x=0; x<3*merge->width; x+=3){
+      for (c=0; c<3; c++){
+	sum[x + c] += log_exposure[c][p[x + c]];
+	w[x + c] += weight[p[x + c]];
+      }
+    }
+  }
+}
+
+//Radiance relative to the one that gives value 128 in 1 us, 3 per pixel
+void response_merge_finish (response_merge_t* merge, float* radiance){
+  size_t i, n = 3*(size_t)merge->width*merge->height;
+  for (i=0; i<n; i++) radiance[i] = expf (merge->sum[i]/merge->weight[i]);
+}
@@ -0,0 +1,59 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+
+#define RESPONSE_LEVELS 256
+//Pixel locations sampled for the solve, on a grid over the image
+#define RESPONSE_SAMPLES 1024
+//Weight of the second derivative of the curve against the data (lambda of
+//Debevec and Malik)
+#define RESPONSE_SMOOTHNESS 32.0
+#define RESPONSE_MAX_FRAMES 64
+#define RESPONSE_VERSION 1
+
+//Camera response of the JPEG pipeline: g[c][z] is the log exposure (radiance
+//times time, g (128) = 0) that results in value z of channel c
+typedef struct {
+  float g[3][RESPONSE_LEVELS];
+} response_t;
+
+//Values of the sample locations in every frame of a series
+typedef struct {
+  int frames;
+  unsigned char z[RESPONSE_MAX_FRAMES][RESPONSE_SAMPLES][3];
+  double log_time[RESPONSE_MAX_FRAMES];
+} response_samples_t;
+
+//Streaming merge of 8 bit frames, weighted mean of the log radiance
+typedef struct {
+  int width;
+  int height;
+  //Weighted log radiance and weights, 3 per pixel
+  float* sum;
+  float* weight;
+} response_merge_t;
+
+void response_sample (
+		      response_samples_t* samples,
+		      const unsigned char* rgb,
+		      int width,
+		      int height,
+		      int stride,
+		      double time);
+void response_solve (const response_samples_t* samples, response_t* response);
+int response_load (response_t* response, const char* filename);
+void response_save (const response_t* response, const char* filename);
+void response_dump (const response_t* response);
+
+void response_merge_init (response_merge_t* merge, int width, int height);
+void response_merge_free (response_merge_t* merge);
+void response_merge_add (
+			 response_merge_t* merge,
+			 const response_t* response,
+			 const unsigned char* rgb,
+			 int stride,
+			 double time);
+void response_merge_finish (response_merge_t* merge, float* radiance);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ring.h"
+#include "budget.h"
+
+void ring_init (ring_t* ring, size_t size, int capacity, int64_t window_ns){
+  ring->size = size;
+  ring->capacity = capacity;
+  ring->first = 0;
+  ring->count = 0;
+  ring->window_ns = window_ns;
+  ring->overflows = 0;
+  ring->data = budget_malloc (BUDGET_STREAM, size);
+  ring->entries = budget_malloc (BUDGET_STREAM,
+				 capacity*sizeof (ring_entry_t));
+  if (!ring->data || !ring->entries){
+    fprintf (stderr, "error: out of memory\n");
+    exit (1);
+  }
+}
+
+void ring_free (ring_t* ring){
+  budget_free (ring->data);
+  budget_free (ring->entries);
+  ring->data = NULL;
+  ring->entries = NULL;
+  ring->count = 0;
+}
+
+//Keeps the store in RAM, see arena_lock()
+void ring_lock (ring_t* ring){
+  if (mlock (ring->data, ring->size)){
+    fprintf (stderr, "error: ring_lock: mlock of %zu bytes, raise "
+	     "RLIMIT_MEMLOCK\n", ring->size);
+    exit (1);
+  }
+}
+
+static const ring_entry_t* ring_entry (const ring_t* ring, int i){
+  return &ring->entries[(ring->first + i)%ring->capacity];
+}
+
+static void ring_drop (ring_t* ring){
+  ring->first = (ring->first + 1)%ring->capacity;
+  ring->count--;
+}
+
+//Where an entry of size bytes fits after the newest one without overwriting
+//the oldest, -1 if it does not
+static int64_t ring_room (const ring_t* ring, size_t size){
+  if (!ring->count) return 0;
+  const ring_entry_t* newest = ring_entry (ring, ring->count - 1);
+  size_t head = ring_entry (ring, 0)->offset;
+  size_t end = newest->offset + newest->size;
+  if (head < end){
+    //Held in [head, end), free at both ends
+    if (size <= ring->size - end) return end;
+    if (size <= head) return 0;
+  } else if (size <= head - end){
+    //Wrapped, free in [end, head)
+    return end;
+  }
+  return -1;
+}
+
+//Copies a buffer of the stream in, returns 0 if it is larger than the whole
+//ring and was not stored
+int ring_push (
+	       ring_t* ring,
+	       const void* data,
+	       size_t size,
+	       int64_t timestamp_ns,
+	       uint32_t flags){
+  int64_t offset;
+  if (!size || size > ring->size) return 0;
+  while (ring->count &&
+	 ring_entry (ring, 0)->timestamp_ns < timestamp_ns - ring->window_ns)
+    ring_drop (ring);
+  if (ring->count == ring->capacity){
+    ring_drop (ring);
+    ring->overflows++;
+  }
+  while ((offset = ring_room (ring, size)) < 0){
+    ring_drop (ring);
+    ring->overflows++;
+  }
+  ring_entry_t* entry =
+    &ring->entries[(ring->first + ring->count)%ring->capacity];
+  entry->offset = offset;
+  entry->size = size;
+  entry->flags = flags;
+  entry->timestamp_ns = timestamp_ns;
+  memcpy (ring->data + offset, data, size);
+  ring->count++;
+  return 1;
+}
+
+//Time between the oldest and the newest entry
+int64_t ring_span (const ring_t* ring){
+  if (!ring->count) return 0;
+  return ring_entry (ring, ring->count - 1)->timestamp_ns -
+    ring_entry (ring, 0)->timestamp_ns;
+}
+
+//Writes the entries in order from the oldest keyframe, the ones before it
+//cannot be decoded. Returns the bytes written
+size_t ring_write (const ring_t* ring, int fd){
+  size_t bytes = 0;
+  int i = 0;
+  while (i < ring->count && !(ring_entry (ring, i)->flags & RING_KEYFRAME))
+    i++;
+  for (; i<ring->count; i++){
+    const ring_entry_t* entry = ring_entry (ring, i);
+    if (write (fd, ring->data + entry->offset, entry->size) != entry->size){
+      fprintf (stderr, "error: ring_write\n");
+      exit (1);
+    }
+    bytes += entry->size;
+  }
+  return bytes;
+}
@@ -0,0 +1,48 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Set on an entry a decoder can start from: an H.264 sync frame, or the first
+//buffer of a raw or MJPEG frame
+#define RING_KEYFRAME 1
+
+typedef struct {
+  size_t offset;
+  uint32_t size;
+  uint32_t flags;
+  int64_t timestamp_ns;
+} ring_entry_t;
+
+//Pre-trigger store of a stream: the buffers of the last window_ns, copied
+//one after the other into one allocation that wraps around. Entries older
+//than the window are dropped as new ones arrive, and the oldest ones before
+//that if the memory or the table of entries is full, so holding the stream
+//costs a copy per buffer and saving it one write per entry
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  ring_entry_t* entries;
+  int capacity;
+  //Oldest entry and number of entries held
+  int first;
+  int count;
+  int64_t window_ns;
+  //Entries dropped for lack of room while still inside the window
+  unsigned long overflows;
+} ring_t;
+
+void ring_init (ring_t* ring, size_t size, int capacity, int64_t window_ns);
+void ring_free (ring_t* ring);
+void ring_lock (ring_t* ring);
+int ring_push (
+	       ring_t* ring,
+	       const void* data,
+	       size_t size,
+	       int64_t timestamp_ns,
+	       uint32_t flags);
+int64_t ring_span (const ring_t* ring);
+size_t ring_write (const ring_t* ring, int fd);
+
+#endif
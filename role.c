@@ -0,0 +1,246 @@
+//sched_setaffinity() and RUSAGE_THREAD
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "role.h"
+
+typedef struct {
+  const char* name;
+  //SCHED_FIFO priority, 0 for SCHED_OTHER
+  int priority;
+  //Bitmask of the CPUs the threads run on, 0 for any
+  unsigned long cpus;
+  int threads;
+  //Context switches of the threads that left the role
+  long voluntary;
+  long involuntary;
+  //From the event a thread of the role waited for to the thread running
+  unsigned long wakeups;
+  int64_t latency_sum_ns;
+  int64_t latency_max_ns;
+} role_t;
+
+//A thread in a role, with its context switch counts when it entered
+typedef struct {
+  pid_t tid;
+  role_id role;
+  long voluntary;
+  long involuntary;
+} role_thread_t;
+
+typedef struct {
+  role_id role;
+  void* (*main) (void*);
+  void* arg;
+  int64_t created_ns;
+} role_start_t;
+
+static role_t roles[ROLE_COUNT] = {
+  { .name = "control" },
+  { .name = "callback" },
+  { .name = "pool" }
+};
+//Set once a role is configured, until then the threads keep the scheduling
+//they inherit and are only counted
+static int role_configured = 0;
+static role_thread_t role_threads[ROLE_MAX_THREADS];
+static int role_thread_count = 0;
+static pthread_mutex_t role_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int role_current = -1;
+
+static int64_t role_now (){
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static pid_t role_tid (){
+  return syscall (SYS_gettid);
+}
+
+//Context switches of a thread of the process, from its status in /proc.
+//Returns 0 if it has ended
+static int role_switches (pid_t tid, long* voluntary, long* involuntary){
+  char line[128];
+  sprintf (line, "/proc/self/task/%i/status", tid);
+  FILE* file = fopen (line, "r");
+  if (!file) return 0;
+  while (fgets (line, sizeof (line), file)){
+    sscanf (line, "voluntary_ctxt_switches: %li", voluntary);
+    sscanf (line, "nonvoluntary_ctxt_switches: %li", involuntary);
+  }
+  fclose (file);
+  return 1;
+}
+
+int role_find (const char* name){
+  int i;
+  for (i=0; i<ROLE_COUNT; i++){
+    if (!strcmp (roles[i].name, name)) return i;
+  }
+  return -1;
+}
+
+const char* role_name (role_id role){
+  return roles[role].name;
+}
+
+//Applies to the threads entering the role from now on, configure the roles
+//before the threads start. cpus is a bitmask, bit n for CPU n
+void role_configure (role_id role, int priority, unsigned long cpus){
+  roles[role].priority = priority;
+  roles[role].cpus = cpus;
+  role_configured = 1;
+}
+
+static void role_apply (role_id role){
+  const role_t* r = &roles[role];
+  struct sched_param param = { .sched_priority = r->priority };
+  if (pthread_setschedparam (pthread_self (),
+			     r->priority ? SCHED_FIFO : SCHED_OTHER, &param)){
+    fprintf (stderr, "error: role_enter: %s priority %i, SCHED_FIFO needs "
+	     "root or RLIMIT_RTPRIO\n", r->name, r->priority);
+    exit (1);
+  }
+  cpu_set_t set;
+  int cpu;
+  CPU_ZERO (&set);
+  for (cpu=0; cpu<CPU_SETSIZE; cpu++){
+    if (!r->cpus ||
+	(cpu < 8*sizeof (r->cpus) && (r->cpus >> cpu & 1))) CPU_SET (cpu, &set);
+  }
+  if (pthread_setaffinity_np (pthread_self (), sizeof (set), &set)){
+    fprintf (stderr, "error: role_enter: %s CPUs 0x%lx\n", r->name,
+	     r->cpus);
+    exit (1);
+  }
+}
+
+//Puts the calling thread in a role: scheduled as configured for it and
+//counted with it. Cheap when the thread is already in the role, so the
+//callbacks call it every time
+void role_enter (role_id role){
+  struct rusage usage;
+  if (role_current == role) return;
+  if (role_current >= 0) role_leave ();
+  if (role_configured) role_apply (role);
+  getrusage (RUSAGE_THREAD, &usage);
+  pthread_mutex_lock (&role_lock);
+  roles[role].threads++;
+  if (role_thread_count < ROLE_MAX_THREADS){
+    role_thread_t* thread = &role_threads[role_thread_count++];
+    thread->tid = role_tid ();
+    thread->role = role;
+    thread->voluntary = usage.ru_nvcsw;
+    thread->involuntary = usage.ru_nivcsw;
+  }
+  pthread_mutex_unlock (&role_lock);
+  role_current = role;
+}
+
+//Adds the context switches of the calling thread to its role, before the
+//thread ends or changes role
+void role_leave (){
+  struct rusage usage;
+  long voluntary = 0;
+  long involuntary = 0;
+  int i;
+  if (role_current < 0) return;
+  getrusage (RUSAGE_THREAD, &usage);
+  pid_t tid = role_tid ();
+  pthread_mutex_lock (&role_lock);
+  for (i=0; i<role_thread_count; i++){
+    if (role_threads[i].tid == tid){
+      voluntary = role_threads[i].voluntary;
+      involuntary = role_threads[i].involuntary;
+      role_threads[i] = role_threads[--role_thread_count];
+      break;
+    }
+  }
+  roles[role_current].voluntary += usage.ru_nvcsw - voluntary;
+  roles[role_current].involuntary += usage.ru_nivcsw - involuntary;
+  pthread_mutex_unlock (&role_lock);
+  role_current = -1;
+}
+
+//Time from the event a thread of the role was blocked on to it running again
+void role_wakeup (role_id role, int64_t latency_ns){
+  role_t* r = &roles[role];
+  pthread_mutex_lock (&role_lock);
+  r->wakeups++;
+  r->latency_sum_ns += latency_ns;
+  if (latency_ns > r->latency_max_ns) r->latency_max_ns = latency_ns;
+  pthread_mutex_unlock (&role_lock);
+}
+
+static void* role_start (void* arg){
+  role_start_t start = *(role_start_t*)arg;
+  free (arg);
+  role_enter (start.role);
+  role_wakeup (start.role, role_now () - start.created_ns);
+  void* result = start.main (start.arg);
+  role_leave ();
+  return result;
+}
+
+//pthread_create() for a thread of a role: it is scheduled as the role before
+//main runs and counted with it until main returns, the time it took to start
+//is its wakeup latency. Returns the error of pthread_create()
+int role_spawn (
+		pthread_t* id,
+		role_id role,
+		void* (*main) (void*),
+		void* arg){
+  role_start_t* start = malloc (sizeof (role_start_t));
+  if (!start){
+    fprintf (stderr, "error: role_spawn: out of memory\n");
+    exit (1);
+  }
+  start->role = role;
+  start->main = main;
+  start->arg = arg;
+  start->created_ns = role_now ();
+  int error = pthread_create (id, NULL, role_start, start);
+  if (error) free (start);
+  return error;
+}
+
+//Context switches of the threads that left their role and of the ones still
+//in it, and the wakeup latencies
+void role_dump (){
+  long voluntary[ROLE_COUNT];
+  long involuntary[ROLE_COUNT];
+  int i;
+  pthread_mutex_lock (&role_lock);
+  for (i=0; i<ROLE_COUNT; i++){
+    voluntary[i] = roles[i].voluntary;
+    involuntary[i] = roles[i].involuntary;
+  }
+  for (i=0; i<role_thread_count; i++){
+    const role_thread_t* thread = &role_threads[i];
+    long v, iv;
+    if (role_switches (thread->tid, &v, &iv)){
+      voluntary[thread->role] += v - thread->voluntary;
+      involuntary[thread->role] += iv - thread->involuntary;
+    }
+  }
+  printf ("| role     | threads | priority | cpus       | voluntary | "
+	  "involuntary | wakeups | mean ms | max ms |\n");
+  for (i=0; i<ROLE_COUNT; i++){
+    const role_t* r = &roles[i];
+    printf ("| %-8s | %7i | %8i | 0x%08lx | %9li | %11li | %7lu | %7.3f | "
+	    "%6.3f |\n", r->name, r->threads, r->priority, r->cpus,
+	    voluntary[i], involuntary[i], r->wakeups,
+	    r->wakeups ? r->latency_sum_ns*1e-6/r->wakeups : 0,
+	    r->latency_max_ns*1e-6);
+  }
+  pthread_mutex_unlock (&role_lock);
+}
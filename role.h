@@ -0,0 +1,38 @@
+#ifndef ROLE_H
+#define ROLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+//Threads of the process that are alive at the same time and counted by
+//role_dump(), the ones past it are only counted when they leave
+#define ROLE_MAX_THREADS 32
+
+//What a thread does, the threads of a role share a scheduling policy and a
+//set of CPUs and are reported together
+typedef enum {
+  //The main thread: arms the captures, waits for the components, re-queues
+  //the buffers and writes the files
+  ROLE_CONTROL,
+  //Threads of the OMX core running the event and buffer callbacks, they are
+  //not ours and join the role on their first callback
+  ROLE_CALLBACK,
+  //Band workers of the processing stages, started with role_spawn()
+  ROLE_POOL,
+  ROLE_COUNT
+} role_id;
+
+int role_find (const char* name);
+const char* role_name (role_id role);
+void role_configure (role_id role, int priority, unsigned long cpus);
+void role_enter (role_id role);
+void role_leave ();
+void role_wakeup (role_id role, int64_t latency_ns);
+int role_spawn (
+		pthread_t* id,
+		role_id role,
+		void* (*main) (void*),
+		void* arg);
+void role_dump ();
+
+#endif
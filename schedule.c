@@ -0,0 +1,67 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "meta.h"
+#include "schedule.h"
+
+void schedule_init (schedule_t* schedule, int64_t interval_ns){
+  //The same instant on both clocks, the wall clock only places the grid
+  int64_t wall = meta_now (CLOCK_REALTIME);
+  int64_t now = meta_now (CLOCK_MONOTONIC);
+  int64_t first = (wall/interval_ns + 1)*interval_ns;
+  schedule->interval_ns = interval_ns;
+  schedule->origin_ns = now + first - wall;
+  schedule->slot = -1;
+  schedule->started = 0;
+  schedule->skipped = 0;
+  schedule->jitter_ns = 0;
+  schedule->jitter_sum_ns = 0;
+  schedule->jitter_max_ns = 0;
+}
+
+int64_t schedule_deadline (const schedule_t* schedule, int64_t slot){
+  return schedule->origin_ns + slot*schedule->interval_ns;
+}
+
+//Sleeps until the slot after the last one, or the first one still ahead if
+//it is already too late for that, and returns it. Returns -1 if a signal
+//interrupted the sleep, the caller decides whether to wait again
+int64_t schedule_wait (schedule_t* schedule){
+  int64_t slot = schedule->slot + 1;
+  int64_t now = meta_now (CLOCK_MONOTONIC);
+  if (now > schedule_deadline (schedule, slot) +
+      schedule->interval_ns*SCHEDULE_MAX_LATE){
+    int64_t ahead = (now - schedule->origin_ns)/schedule->interval_ns + 1;
+    printf ("schedule: overran, %lli slots skipped\n",
+	    (long long)(ahead - slot));
+    schedule->skipped += ahead - slot;
+    slot = ahead;
+  }
+  int64_t deadline = schedule_deadline (schedule, slot);
+  struct timespec ts = {
+    deadline/1000000000, deadline%1000000000
+  };
+  int error = clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  if (error == EINTR) return -1;
+  if (error){
+    fprintf (stderr, "error: clock_nanosleep\n");
+    exit (1);
+  }
+  schedule->jitter_ns = meta_now (CLOCK_MONOTONIC) - deadline;
+  schedule->jitter_sum_ns += schedule->jitter_ns;
+  if (schedule->jitter_ns > schedule->jitter_max_ns)
+    schedule->jitter_max_ns = schedule->jitter_ns;
+  schedule->slot = slot;
+  schedule->started++;
+  return slot;
+}
+
+void schedule_dump (const schedule_t* schedule){
+  if (!schedule->started) return;
+  printf ("schedule: %i series, %i slots skipped, start jitter mean %.3f ms, "
+	  "max %.3f ms\n", schedule->started, schedule->skipped,
+	  schedule->jitter_sum_ns*1e-6/schedule->started,
+	  schedule->jitter_max_ns*1e-6);
+}
@@ -0,0 +1,33 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+
+//A series may start this fraction of the interval after its slot, later
+//than that the slot is skipped
+#define SCHEDULE_MAX_LATE 0.1
+
+//Time-lapse grid: slot n starts at origin + n*interval on CLOCK_MONOTONIC,
+//slept to with absolute deadlines so errors do not add up from one series
+//to the next. The origin is the next multiple of the interval on the wall
+//clock, so the series of several runs (or cameras) fall on the same grid
+typedef struct {
+  int64_t interval_ns;
+  int64_t origin_ns;
+  //Slot of the series started last, -1 before the first
+  int64_t slot;
+  int started;
+  //Slots passed without a series because the previous one overran
+  int skipped;
+  //Start minus deadline of the last series, their sum and the largest
+  int64_t jitter_ns;
+  int64_t jitter_sum_ns;
+  int64_t jitter_max_ns;
+} schedule_t;
+
+void schedule_init (schedule_t* schedule, int64_t interval_ns);
+int64_t schedule_wait (schedule_t* schedule);
+int64_t schedule_deadline (const schedule_t* schedule, int64_t slot);
+void schedule_dump (const schedule_t* schedule);
+
+#endif
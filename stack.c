@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "raw.h"
+#include "stack.h"
+#include "budget.h"
+
+//4 samples per operation, NEON on the Pi, SSE elsewhere
+typedef float stack_v4 __attribute__ ((vector_size (16)));
+typedef int32_t stack_i4 __attribute__ ((vector_size (16)));
+
+#define STACK_LANES 4
+
+void stack_init (stack_accumulator_t* stack, int width, int height, int clip){
+  size_t n = (size_t)width*height;
+  stack->width = width;
+  stack->height = height;
+  stack->clip = clip;
+  stack->count = 0;
+  stack->rejected = 0;
+  stack->sum = budget_calloc (BUDGET_STACK, n, sizeof (uint16_t));
+  stack->squares = budget_calloc (BUDGET_STACK, n, sizeof (uint32_t));
+  stack->samples = budget_calloc (BUDGET_STACK, n, sizeof (uint8_t));
+  if (!stack->sum || !stack->squares || !stack->samples){
+    fprintf (stderr, "error: out of memory\n");
+    exit (1);
+  }
+}
+
+void stack_free (stack_accumulator_t* stack){
+  budget_free (stack->sum);
+  budget_free (stack->squares);
+  budget_free (stack->samples);
+  stack->sum = NULL;
+  stack->squares = NULL;
+  stack->samples = NULL;
+}
+
+//Adds a frame of width x height samples, the width is a multiple of 4
+void stack_add (stack_accumulator_t* stack, const unsigned short* pixels){
+  const stack_i4 zero = { 0 };
+  const stack_i4 white = zero + RAW_WHITE_LEVEL;
+  const stack_v4 black = (stack_v4){ 0 } + RAW_BLACK_LEVEL;
+  const stack_v4 read = (stack_v4){ 0 } + STACK_READ_NOISE*STACK_READ_NOISE;
+  const stack_v4 shot = (stack_v4){ 0 } + STACK_SHOT_NOISE;
+  const stack_v4 sigma2 = (stack_v4){ 0 } + STACK_CLIP_SIGMA*STACK_CLIP_SIGMA;
+  int clip = stack->clip && stack->count >= STACK_CLIP_MIN_FRAMES;
+  size_t i, n = (size_t)stack->width*stack->height;
+  int k;
+
+  if (stack->count == STACK_MAX_FRAMES){
+    fprintf (stderr, "error: stack: more than %i frames\n", STACK_MAX_FRAMES);
+    exit (1);
+  }
+  for (i=0; i<n; i += STACK_LANES){
+    const unsigned short* p = pixels + i;
+    uint16_t* s = stack->sum + i;
+    uint32_t* q = stack->squares + i;
+    uint8_t* c = stack->samples + i;
+    stack_i4 x = { p[0], p[1], p[2], p[3] };
+    stack_i4 count = { c[0], c[1], c[2], c[3] };
+    stack_i4 accept = zero - 1;
+    if (clip){
+      stack_v4 xf = { p[0], p[1], p[2], p[3] };
+      stack_v4 sf = { s[0], s[1], s[2], s[3] };
+      stack_v4 qf = { q[0], q[1], q[2], q[3] };
+      stack_v4 nf = { c[0] & ~STACK_CLIPPED, c[1] & ~STACK_CLIPPED,
+		      c[2] & ~STACK_CLIPPED, c[3] & ~STACK_CLIPPED };
+      stack_v4 mean = sf/nf;
+      stack_v4 variance = qf/nf - mean*mean;
+      stack_v4 noise = read + shot*(mean - black);
+      //Comparisons give -1 for true, select the larger variance by mask
+      stack_i4 larger = variance > noise;
+      variance = (stack_v4)(((stack_i4)variance & larger) |
+			    ((stack_i4)noise & ~larger));
+      stack_v4 d = xf - mean;
+      accept = d*d <= sigma2*variance;
+    }
+    count |= (x >= white) & STACK_CLIPPED;
+    count -= accept;
+    x &= accept;
+    for (k=0; k<STACK_LANES; k++){
+      s[k] += x[k];
+      q[k] += (uint32_t)x[k]*x[k];
+      c[k] = count[k];
+      stack->rejected += !accept[k];
+    }
+  }
+  stack->count++;
+}
+
+//Writes the mean of the frames (rounded, clipped where any frame was) and
+//clears the stack for the next step, rejected included
+void stack_finish (stack_accumulator_t* stack, unsigned short* pixels){
+  size_t i, n = (size_t)stack->width*stack->height;
+  for (i=0; i<n; i++){
+    int count = stack->samples[i] & ~STACK_CLIPPED;
+    if (stack->samples[i] & STACK_CLIPPED || !count){
+      pixels[i] = RAW_WHITE_LEVEL;
+    } else {
+      pixels[i] = (stack->sum[i] + count/2)/count;
+    }
+  }
+  memset (stack->sum, 0, n*sizeof (uint16_t));
+  memset (stack->squares, 0, n*sizeof (uint32_t));
+  memset (stack->samples, 0, n*sizeof (uint8_t));
+  stack->count = 0;
+  stack->rejected = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Frames per exposure step at most. The sums of squares stay below 2^24, so
+//they are exact as floats
+#define STACK_MAX_FRAMES 16
+//Sigma clipping starts once a pixel has this many samples, before the
+//variance means nothing
+#define STACK_CLIP_MIN_FRAMES 3
+//Samples further from the running mean than this many standard deviations
+//are rejected
+#define STACK_CLIP_SIGMA 3.0f
+//Noise floor of the variance in DN, as in deghost.h
+#define STACK_READ_NOISE 2.0f
+#define STACK_SHOT_NOISE 1.0f
+//Set in the counts of pixels that were clipped in any frame
+#define STACK_CLIPPED 0x80
+
+//Running mean of the unpacked raw frames of one exposure step. Sum, sum of
+//squares and count per pixel are all that is kept, 7 bytes per pixel however
+//many frames are stacked. With clipping, a sample is compared with the mean
+//and variance of the samples accepted before it (a streaming estimate, the
+//frames are not kept for a second pass)
+typedef struct {
+  int width;
+  int height;
+  int clip;
+  //Frames added since the last stack_finish
+  int count;
+  uint16_t* sum;
+  uint32_t* squares;
+  uint8_t* samples;
+  size_t rejected;
+} stack_accumulator_t;
+
+void stack_init (stack_accumulator_t* stack, int width, int height, int clip);
+void stack_free (stack_accumulator_t* stack);
+void stack_add (stack_accumulator_t* stack, const unsigned short* pixels);
+void stack_finish (stack_accumulator_t* stack, unsigned short* pixels);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "hdr.h"
+#include "meta.h"
+
+//8 samples per operation, NEON on the Pi, SSE2 elsewhere
+typedef unsigned short stats_v8 __attribute__ ((vector_size (16)));
+
+#define STATS_LANES 8
+#define STATS_DARK_LEVEL (RAW_BLACK_LEVEL + HDR_MIN_SIGNAL)
+
+//Counts the clipped and dark samples of one unpacked row. The lane counters
+//hold at most width/8 per row, far from overflowing
+static void stats_count_row (
+			     const unsigned short* row,
+			     int width,
+			     unsigned* clipped,
+			     unsigned* dark){
+  const stats_v8 white = (stats_v8){ 0 } + RAW_WHITE_LEVEL;
+  const stats_v8 black = (stats_v8){ 0 } + STATS_DARK_LEVEL;
+  stats_v8 clipped_lanes = { 0 };
+  stats_v8 dark_lanes = { 0 };
+  int x, k;
+  for (x=0; x + STATS_LANES <= width; x += STATS_LANES){
+    stats_v8 v;
+    memcpy (&v, row + x, sizeof (v));
+    //Comparisons give -1 for true
+    clipped_lanes -= (stats_v8)(v >= white);
+    dark_lanes -= (stats_v8)(v < black);
+  }
+  for (k=0; k<STATS_LANES; k++){
+    *clipped += clipped_lanes[k];
+    *dark += dark_lanes[k];
+  }
+  for (; x<width; x++){
+    *clipped += row[x] >= RAW_WHITE_LEVEL;
+    *dark += row[x] < STATS_DARK_LEVEL;
+  }
+}
+
+void stats_compute (
+		    const unsigned char* raw,
+		    int stride,
+		    const roi_t* roi,
+		    raw_stats_t* stats){
+  int64_t start = meta_now (CLOCK_MONOTONIC);
+  unsigned histogram[RAW_WHITE_LEVEL + 1];
+  unsigned short row[2*RAW_WIDTH];
+  int x, y;
+
+  memset (histogram, 0, sizeof (histogram));
+  memset (stats, 0, sizeof (*stats));
+  for (y=0; y<roi->height; y += 2*STATS_ROW_STEP){
+    //One row pair
+    roi_t band = { roi->left, roi->top + y, roi->width, 2 };
+    if (y + 2 > roi->height) band.height = roi->height - y;
+    raw_unpack (raw, stride, &band, row);
+    int n = band.width*band.height;
+    stats_count_row (row, n, &stats->clipped, &stats->dark);
+    for (x=0; x<n; x++) histogram[row[x]]++;
+    stats->samples += n;
+  }
+
+  unsigned half = (stats->samples + 1)/2;
+  unsigned sum = 0;
+  for (x=0; x<=RAW_WHITE_LEVEL; x++){
+    sum += histogram[x];
+    if (sum >= half) break;
+  }
+  stats->median = x;
+  stats->us = (meta_now (CLOCK_MONOTONIC) - start)/1000;
+}
+
+double stats_clipped_fraction (const raw_stats_t* stats){
+  return stats->samples ? (double)stats->clipped/stats->samples : 0;
+}
+
+double stats_dark_fraction (const raw_stats_t* stats){
+  return stats->samples ? (double)stats->dark/stats->samples : 0;
+}
+
+void stats_dump (const raw_stats_t* stats){
+  printf ("| samples | clipped  | dark     | median | us     |\n");
+  printf ("| %7u | %7.4f%% | %7.4f%% | %6i | %6i |\n",
+	  stats->samples, 100*stats_clipped_fraction (stats),
+	  100*stats_dark_fraction (stats), stats->median, stats->us);
+}
@@ -0,0 +1,31 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "raw.h"
+
+//Only every STATS_ROW_STEP-th row pair of the ROI is sampled, all columns of
+//it, so every CFA channel is seen and the rows are read sequentially
+#define STATS_ROW_STEP 16
+
+//Exposure statistics of a raw frame
+typedef struct {
+  unsigned samples;
+  //Samples at RAW_WHITE_LEVEL
+  unsigned clipped;
+  //Samples below RAW_BLACK_LEVEL + HDR_MIN_SIGNAL
+  unsigned dark;
+  int median;
+  //Time the kernel took
+  int us;
+} raw_stats_t;
+
+void stats_compute (
+		    const unsigned char* raw,
+		    int stride,
+		    const roi_t* roi,
+		    raw_stats_t* stats);
+double stats_clipped_fraction (const raw_stats_t* stats);
+double stats_dark_fraction (const raw_stats_t* stats);
+void stats_dump (const raw_stats_t* stats);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "thumbs.h"
+
+static void thumbs_write (FILE* f, const void* data, size_t size){
+  if (fwrite (data, size, 1, f) != 1){
+    fprintf (stderr, "error: fwrite thumbnails\n");
+    exit (1);
+  }
+}
+
+static void thumbs_write_header (FILE* thumbs, uint32_t count){
+  thumbs_header_t header;
+  memcpy (header.magic, THUMBS_MAGIC, 4);
+  header.version = THUMBS_VERSION;
+  header.count = count;
+  header.entry_size = sizeof (thumbs_entry_t);
+  thumbs_write (thumbs, &header, sizeof (header));
+}
+
+FILE* thumbs_open (const char* filename){
+  FILE* thumbs = fopen (filename, "w+b");
+  if (!thumbs){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  thumbs_write_header (thumbs, 0);
+  return thumbs;
+}
+
+//Copies the part of the thumbnail that is in a slice into the entry. Called
+//once the slice was fed to the parser, so the thumbnail is known as soon as
+//its SOI went by. Its end is only known at the end of APP1, until then
+//everything up to the end of the slice is taken
+void thumbs_collect (
+		     thumbs_entry_t* entry,
+		     const jpeg_index_t* index,
+		     int64_t slice_offset,
+		     const unsigned char* data,
+		     size_t size){
+  if (index->thumbnail < 0) return;
+  int64_t begin = index->thumbnail;
+  int64_t end = slice_offset + size;
+  if (index->app1_size >= 0 && index->app1 + index->app1_size < end){
+    end = index->app1 + index->app1_size;
+  }
+  if (index->thumbnail + THUMBS_DATA_SIZE < end){
+    end = index->thumbnail + THUMBS_DATA_SIZE;
+  }
+  if (begin < slice_offset){
+    //The SOI may end the previous slice, its bytes are known
+    entry->data[0] = 0xFF;
+    entry->data[1] = 0xD8;
+    begin = slice_offset;
+  }
+  if (end > begin){
+    memcpy (entry->data + (begin - index->thumbnail),
+	    data + (begin - slice_offset), end - begin);
+  }
+}
+
+void thumbs_append (
+		    FILE* thumbs,
+		    thumbs_entry_t* entry,
+		    const char* frame_filename,
+		    uint32_t exposure,
+		    const jpeg_index_t* index){
+  memset (entry->filename, 0, sizeof (entry->filename));
+  strncpy (entry->filename, frame_filename, sizeof (entry->filename) - 1);
+  entry->exposure = exposure;
+  entry->size = 0;
+  if (index->thumbnail_size > THUMBS_DATA_SIZE){
+    fprintf (stderr, "warning: thumbnail of %s too large (%lli bytes)\n",
+	     frame_filename, (long long)index->thumbnail_size);
+  } else if (index->thumbnail_size > 0){
+    entry->size = index->thumbnail_size;
+  }
+  memset (entry->data + entry->size, 0, THUMBS_DATA_SIZE - entry->size);
+  thumbs_write (thumbs, entry, sizeof (*entry));
+  fflush (thumbs);
+}
+
+void thumbs_close (FILE* thumbs){
+  long end = ftell (thumbs);
+  fseek (thumbs, 0, SEEK_SET);
+  thumbs_write_header (thumbs,
+		       (end - sizeof (thumbs_header_t))/sizeof (thumbs_entry_t));
+  if (fclose (thumbs)){
+    fprintf (stderr, "error: fclose thumbnails\n");
+    exit (1);
+  }
+}
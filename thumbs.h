@@ -0,0 +1,49 @@
+#ifndef THUMBS_H
+#define THUMBS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jpegindex.h"
+#include "meta.h"
+
+#define THUMBS_MAGIC "THMB"
+#define THUMBS_VERSION 1
+//Fixed entry size, so entry i of a mapped sheet is at
+//sizeof (thumbs_header_t) + i*THUMBS_ENTRY_SIZE
+#define THUMBS_ENTRY_SIZE 8192
+#define THUMBS_DATA_SIZE (THUMBS_ENTRY_SIZE - META_FILENAME_SIZE - 8)
+
+//Contact sheet of a series: header followed by one entry per frame holding
+//the thumbnail JPEG embedded in the EXIF data of the frame
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t entry_size;
+} thumbs_header_t;
+
+typedef struct {
+  char filename[META_FILENAME_SIZE];
+  uint32_t exposure; //us
+  //Bytes of data used, 0 if the frame had no thumbnail or it did not fit
+  uint32_t size;
+  unsigned char data[THUMBS_DATA_SIZE];
+} thumbs_entry_t;
+
+FILE* thumbs_open (const char* filename);
+void thumbs_collect (
+		     thumbs_entry_t* entry,
+		     const jpeg_index_t* index,
+		     int64_t slice_offset,
+		     const unsigned char* data,
+		     size_t size);
+void thumbs_append (
+		    FILE* thumbs,
+		    thumbs_entry_t* entry,
+		    const char* frame_filename,
+		    uint32_t exposure,
+		    const jpeg_index_t* index);
+void thumbs_close (FILE* thumbs);
+
+#endif
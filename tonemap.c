@@ -0,0 +1,377 @@
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tonemap.h"
+#include "budget.h"
+#include "role.h"
+
+//Keeps the logarithm of black finite, far below the smallest radiance of a
+//series (1 count in 1 s)
+#define TONEMAP_EPSILON 1e-9f
+//Linear [0,1] to 8 bit sRGB
+#define TONEMAP_LUT_SIZE 16384
+
+typedef struct {
+  int width;
+  int height;
+  int depth;
+  float log_min;
+  //Sum of the log luminance and count per cell. The luminance axis is the
+  //innermost, the 8 cells around a pixel are 4 pairs next to each other
+  float* data;
+} tonemap_grid_t;
+
+typedef struct tonemap_s tonemap_t;
+typedef void (*tonemap_pass_t) (tonemap_t* t, int top, int bottom);
+
+struct tonemap_s {
+  const float* rgb;
+  int width;
+  int height;
+  tonemap_operator_t op;
+  unsigned char* out;
+  int out_stride;
+  //Results of the statistics pass, every band adds its own under the lock
+  double log_sum;
+  float log_min;
+  float log_max;
+  pthread_mutex_t lock;
+  //Global operators
+  float scale;
+  float white;
+  //Local operator. The log luminance is kept from the statistics pass for the
+  //grid and the base layer
+  float* log_luminance;
+  tonemap_grid_t grid;
+  float base_max;
+  float compression;
+  unsigned char lut[TONEMAP_LUT_SIZE + 1];
+};
+
+typedef struct {
+  tonemap_t* t;
+  tonemap_pass_t pass;
+  int top;
+  int bottom;
+} tonemap_band_t;
+
+int tonemap_parse_operator (const char* name, tonemap_operator_t* op){
+  if (!strcmp (name, "reinhard")){
+    *op = TONEMAP_REINHARD;
+  } else if (!strcmp (name, "filmic")){
+    *op = TONEMAP_FILMIC;
+  } else if (!strcmp (name, "local")){
+    *op = TONEMAP_LOCAL;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+const char* tonemap_operator_name (tonemap_operator_t op){
+  switch (op){
+  case TONEMAP_FILMIC:
+    return "filmic";
+  case TONEMAP_LOCAL:
+    return "local";
+  default:
+    return "reinhard";
+  }
+}
+
+static inline float tonemap_luminance (const float* p){
+  float l = 0.2126f*p[0] + 0.7152f*p[1] + 0.0722f*p[2];
+  return l > 0 ? l : 0;
+}
+
+static void* tonemap_band_main (void* arg){
+  tonemap_band_t* band = arg;
+  band->pass (band->t, band->top, band->bottom);
+  return NULL;
+}
+
+//Runs a pass over bands of rows. The bands start on multiples of align rows,
+//offset by offset
+static void tonemap_parallel (
+			      tonemap_t* t,
+			      tonemap_pass_t pass,
+			      int threads,
+			      int align,
+			      int offset){
+  tonemap_band_t bands[TONEMAP_MAX_THREADS];
+  pthread_t ids[TONEMAP_MAX_THREADS];
+  int rows = ((t->height/align + threads)/threads)*align;
+  int i;
+  for (i=0; i<threads; i++){
+    int top = i ? i*rows + offset : 0;
+    int bottom = i + 1 < threads ? (i + 1)*rows + offset : t->height;
+    bands[i].t = t;
+    bands[i].pass = pass;
+    bands[i].top = top < t->height ? top : t->height;
+    bands[i].bottom = bottom < t->height ? bottom : t->height;
+  }
+  for (i=1; i<threads; i++){
+    if (role_spawn (&ids[i], ROLE_POOL, tonemap_band_main, &bands[i])){
+      fprintf (stderr, "error: tonemap: pthread_create\n");
+      exit (1);
+    }
+  }
+  tonemap_band_main (&bands[0]);
+  for (i=1; i<threads; i++) pthread_join (ids[i], NULL);
+}
+
+static void tonemap_statistics (tonemap_t* t, int top, int bottom){
+  double sum = 0;
+  float lo = FLT_MAX, hi = -FLT_MAX;
+  int x, y;
+  for (y=top; y<bottom; y++){
+    const float* p = t->rgb + 3*(size_t)y*t->width;
+    float* log_l = t->log_luminance ?
+      t->log_luminance + (size_t)y*t->width : NULL;
+    for (x=0; x<t->width; x++, p += 3){
+      float l = logf (tonemap_luminance (p) + TONEMAP_EPSILON);
+      if (log_l) log_l[x] = l;
+      sum += l;
+      if (l < lo) lo = l;
+      if (l > hi) hi = l;
+    }
+  }
+  pthread_mutex_lock (&t->lock);
+  t->log_sum += sum;
+  if (lo < t->log_min) t->log_min = lo;
+  if (hi > t->log_max) t->log_max = hi;
+  pthread_mutex_unlock (&t->lock);
+}
+
+static inline float* tonemap_cell (tonemap_grid_t* g, int x, int y, int z){
+  return g->data + 2*(((size_t)y*g->width + x)*g->depth + z);
+}
+
+//Each pixel goes to its nearest cell. The bands are aligned so that no two
+//bands touch the same row of cells
+static void tonemap_splat (tonemap_t* t, int top, int bottom){
+  tonemap_grid_t* g = &t->grid;
+  int x, y;
+  for (y=top; y<bottom; y++){
+    const float* log_l = t->log_luminance + (size_t)y*t->width;
+    int gy = (y + TONEMAP_GRID_SPACING/2)/TONEMAP_GRID_SPACING + 1;
+    for (x=0; x<t->width; x++){
+      float l = log_l[x];
+      int gx = (x + TONEMAP_GRID_SPACING/2)/TONEMAP_GRID_SPACING + 1;
+      int gz = (int)((l - g->log_min)/TONEMAP_GRID_RANGE + 0.5f) + 1;
+      float* cell = tonemap_cell (g, gx, gy, gz);
+      cell[0] += l;
+      cell[1] += 1;
+    }
+  }
+}
+
+//[1 2 1]/4 along each axis, the border cells stay empty
+static void tonemap_blur (tonemap_grid_t* g){
+  int steps[3] = { 1, g->depth, g->depth*g->width };
+  int sizes[3] = { g->depth, g->width, g->height };
+  size_t cells = (size_t)g->width*g->height*g->depth;
+  float* tmp = budget_malloc (BUDGET_TONEMAP, 2*cells*sizeof (float));
+  if (!tmp){
+    fprintf (stderr, "error: tonemap: out of memory\n");
+    exit (1);
+  }
+  int axis;
+  size_t i;
+  for (axis=0; axis<3; axis++){
+    memcpy (tmp, g->data, 2*cells*sizeof (float));
+    for (i=0; i<cells; i++){
+      size_t coordinate = (i/steps[axis]) % sizes[axis];
+      if (coordinate == 0 || coordinate == sizes[axis] - 1) continue;
+      size_t s = 2*steps[axis];
+      g->data[2*i] = 0.25f*tmp[2*i - s] + 0.5f*tmp[2*i] + 0.25f*tmp[2*i + s];
+      g->data[2*i + 1] = 0.25f*tmp[2*i + 1 - s] + 0.5f*tmp[2*i + 1] +
+	0.25f*tmp[2*i + 1 + s];
+    }
+  }
+  budget_free (tmp);
+}
+
+//Trilinear interpolation of the blurred grid, the base layer
+static inline float tonemap_slice (tonemap_grid_t* g, int x, int y, float l){
+  float fx = (float)x/TONEMAP_GRID_SPACING + 1;
+  float fy = (float)y/TONEMAP_GRID_SPACING + 1;
+  float fz = (l - g->log_min)/TONEMAP_GRID_RANGE + 1;
+  int x0 = fx, y0 = fy, z0 = fz;
+  float ax = fx - x0, ay = fy - y0, az = fz - z0;
+  float weights[4] = {
+    (1 - ax)*(1 - ay), ax*(1 - ay), (1 - ax)*ay, ax*ay
+  };
+  float sum = 0, weight = 0;
+  int i;
+  for (i=0; i<4; i++){
+    //Two neighbours along the luminance axis
+    const float* cell = tonemap_cell (g, x0 + (i & 1), y0 + (i >> 1), z0);
+    sum += weights[i]*((1 - az)*cell[0] + az*cell[2]);
+    weight += weights[i]*((1 - az)*cell[1] + az*cell[3]);
+  }
+  return weight > 0 ? sum/weight : l;
+}
+
+static inline float tonemap_filmic (float x){
+  const float a = 0.15f, b = 0.50f, c = 0.10f, d = 0.20f, e = 0.02f, f = 0.30f;
+  return (x*(a*x + c*b) + d*e)/(x*(a*x + b) + d*f) - e/f;
+}
+
+static inline unsigned char tonemap_encode (const tonemap_t* t, float v){
+  if (!(v > 0)) return 0;
+  if (v >= 1) return 255;
+  return t->lut[(int)(v*TONEMAP_LUT_SIZE + 0.5f)];
+}
+
+static void tonemap_apply (tonemap_t* t, int top, int bottom){
+  float filmic_white = 1/tonemap_filmic (TONEMAP_FILMIC_WHITE);
+  float white2 = t->white*t->white;
+  int x, y, c;
+  for (y=top; y<bottom; y++){
+    const float* p = t->rgb + 3*(size_t)y*t->width;
+    unsigned char* out = t->out + (size_t)y*t->out_stride;
+    for (x=0; x<t->width; x++, p += 3, out += 3){
+      float l = tonemap_luminance (p) + TONEMAP_EPSILON;
+      float v[3];
+      if (t->op == TONEMAP_FILMIC){
+	for (c=0; c<3; c++){
+	  v[c] = tonemap_filmic (p[c]*t->scale*TONEMAP_FILMIC_EXPOSURE)*
+	    filmic_white;
+	}
+      } else {
+	float ratio;
+	if (t->op == TONEMAP_REINHARD){
+	  float m = l*t->scale;
+	  ratio = (1 + m/white2)/(1 + m)*t->scale;
+	} else {
+	  float log_l = t->log_luminance[(size_t)y*t->width + x];
+	  float base = tonemap_slice (&t->grid, x, y, log_l);
+	  ratio = expf ((base - t->base_max)*t->compression + log_l - base)/l;
+	}
+	for (c=0; c<3; c++) v[c] = p[c]*ratio;
+      }
+      for (c=0; c<3; c++) out[c] = tonemap_encode (t, v[c]);
+    }
+  }
+}
+
+static void tonemap_local_init (tonemap_t* t, int threads, float log_min,
+				float log_max){
+  tonemap_grid_t* g = &t->grid;
+  g->log_min = log_min;
+  //1 cell of border on each side and 1 for rounding
+  g->width = t->width/TONEMAP_GRID_SPACING + 4;
+  g->height = t->height/TONEMAP_GRID_SPACING + 4;
+  g->depth = (log_max - log_min)/TONEMAP_GRID_RANGE + 4;
+  g->data = budget_calloc (BUDGET_TONEMAP,
+			   2*(size_t)g->width*g->height*g->depth,
+			   sizeof (float));
+  if (!g->data){
+    fprintf (stderr, "error: tonemap: out of memory\n");
+    exit (1);
+  }
+  tonemap_parallel (t, tonemap_splat, threads, TONEMAP_GRID_SPACING,
+		    TONEMAP_GRID_SPACING/2);
+  tonemap_blur (g);
+
+  //Range of the base layer
+  float base_min = FLT_MAX, base_max = -FLT_MAX;
+  size_t i, cells = (size_t)g->width*g->height*g->depth;
+  for (i=0; i<cells; i++){
+    //Ignore cells that only got a trace of the blur
+    if (g->data[2*i + 1] < 1) continue;
+    float base = g->data[2*i]/g->data[2*i + 1];
+    if (base < base_min) base_min = base;
+    if (base > base_max) base_max = base;
+  }
+  t->base_max = base_max;
+  t->compression = base_max > base_min ?
+    TONEMAP_LOCAL_RANGE/(base_max - base_min) : 1;
+  if (t->compression > 1) t->compression = 1;
+}
+
+//rgb is linear, 3 floats per pixel. out receives 8 bit sRGB, 3 bytes per
+//pixel, rows out_stride bytes apart
+void tonemap (
+	      const float* rgb,
+	      int width,
+	      int height,
+	      tonemap_operator_t op,
+	      int threads,
+	      unsigned char* out,
+	      int out_stride){
+  tonemap_t* t = budget_calloc (BUDGET_TONEMAP, 1, sizeof (tonemap_t));
+  int i;
+  if (!t){
+    fprintf (stderr, "error: tonemap: out of memory\n");
+    exit (1);
+  }
+  if (threads < 1) threads = 1;
+  if (threads > TONEMAP_MAX_THREADS) threads = TONEMAP_MAX_THREADS;
+  t->rgb = rgb;
+  t->width = width;
+  t->height = height;
+  t->op = op;
+  t->out = out;
+  t->out_stride = out_stride;
+  for (i=0; i<=TONEMAP_LUT_SIZE; i++){
+    float v = (float)i/TONEMAP_LUT_SIZE;
+    v = v <= 0.0031308f ? 12.92f*v : 1.055f*powf (v, 1/2.4f) - 0.055f;
+    t->lut[i] = v*255 + 0.5f;
+  }
+
+  if (op == TONEMAP_LOCAL){
+    t->log_luminance = budget_malloc (BUDGET_TONEMAP,
+				      (size_t)width*height*sizeof (float));
+    if (!t->log_luminance){
+      fprintf (stderr, "error: tonemap: out of memory\n");
+      exit (1);
+    }
+  }
+  t->log_min = FLT_MAX;
+  t->log_max = -FLT_MAX;
+  pthread_mutex_init (&t->lock, NULL);
+  tonemap_parallel (t, tonemap_statistics, threads, 1, 0);
+  pthread_mutex_destroy (&t->lock);
+  float average = expf (t->log_sum/((double)width*height));
+  t->scale = TONEMAP_KEY/average;
+  t->white = expf (t->log_max)*t->scale;
+
+  if (op == TONEMAP_LOCAL)
+    tonemap_local_init (t, threads, t->log_min, t->log_max);
+  tonemap_parallel (t, tonemap_apply, threads, 1, 0);
+
+  budget_free (t->grid.data);
+  budget_free (t->log_luminance);
+  budget_free (t);
+}
+
+void tonemap_write_ppm (
+			const char* filename,
+			int width,
+			int height,
+			const unsigned char* data,
+			int stride){
+  FILE* f = fopen (filename, "wb");
+  if (!f){
+    fprintf (stderr, "error: fopen %s\n", filename);
+    exit (1);
+  }
+  fprintf (f, "P6\n%d %d\n255\n", width, height);
+  int y;
+  for (y=0; y<height; y++){
+    if (fwrite (data + (size_t)y*stride, 3, width, f) != (size_t)width){
+      fprintf (stderr, "error: fwrite %s\n", filename);
+      exit (1);
+    }
+  }
+  if (fclose (f)){
+    fprintf (stderr, "error: fclose %s\n", filename);
+    exit (1);
+  }
+}
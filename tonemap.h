@@ -0,0 +1,43 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+//Middle grey the log average luminance is mapped to by the global operators
+#define TONEMAP_KEY 0.18f
+//Exposure applied before the filmic curve and its linear white point
+#define TONEMAP_FILMIC_EXPOSURE 2.0f
+#define TONEMAP_FILMIC_WHITE 11.2f
+//Bilateral grid of the local operator: pixels per cell and natural log
+//luminance per cell. The base layer is compressed to TONEMAP_LOCAL_RANGE (log
+//units), the details are kept
+#define TONEMAP_GRID_SPACING 16
+#define TONEMAP_GRID_RANGE 0.4f
+#define TONEMAP_LOCAL_RANGE 4.6f
+#define TONEMAP_MAX_THREADS 16
+
+typedef enum {
+  //Reinhard on the luminance, with the brightest pixel as white
+  TONEMAP_REINHARD,
+  //Hable's filmic curve on each channel
+  TONEMAP_FILMIC,
+  //Durand's base/detail decomposition, the base from a bilateral grid
+  TONEMAP_LOCAL
+} tonemap_operator_t;
+
+int tonemap_parse_operator (const char* name, tonemap_operator_t* op);
+const char* tonemap_operator_name (tonemap_operator_t op);
+void tonemap (
+	      const float* rgb,
+	      int width,
+	      int height,
+	      tonemap_operator_t op,
+	      int threads,
+	      unsigned char* out,
+	      int out_stride);
+void tonemap_write_ppm (
+			const char* filename,
+			int width,
+			int height,
+			const unsigned char* data,
+			int stride);
+
+#endif